@@ -101,6 +101,7 @@ static void send_net_stat(const struct ctl_ctx *ctx, struct netif *iface)
 	stat = g_malloc0(len);
 	stat->type = CTL_MSG_NETSTAT;
 	stat->stats = iface->stats;
+	merge_worker_stats(iface, &stat->stats);
 	memcpy(&stat->name, iface->name, strlen(iface->name) + 1);
 	sendto(ctl_fd, stat, len, 0, (struct sockaddr *)&ctx->src, ctx->srclen);
 	g_free(stat);
@@ -188,6 +189,32 @@ out:
 	g_free(res);
 }
 
+static void send_initiators(const struct ctl_ctx *ctx, struct device *dev)
+{
+	struct msg_initiator *res;
+	struct initiator *ini;
+	GHashTableIter iter;
+	int len;
+
+	len = sizeof(*res) + strlen(dev->name) + 1;
+	res = g_malloc0(len);
+	res->type = CTL_MSG_INITIATOR;
+	memcpy(&res->name, dev->name, strlen(dev->name) + 1);
+
+	g_hash_table_iter_init(&iter, dev->initiators);
+	while (g_hash_table_iter_next(&iter, NULL, (void **)&ini))
+	{
+		res->stats.addr.u = ini->mac;
+		res->stats.queue_length = ini->queue.deferred[0].length +
+			ini->queue.deferred[1].length;
+		res->stats.paths = ini->num_paths;
+		res->stats.io_cnt = ini->queue.io_cnt;
+		res->stats.io_bytes = ini->queue.io_bytes;
+		sendto(ctl_fd, res, len, 0, (struct sockaddr *)&ctx->src, ctx->srclen);
+	}
+	g_free(res);
+}
+
 static void clear_dev_stat(const struct ctl_ctx *ctx, struct device *dev)
 {
 	memset(&dev->stats, 0, sizeof(dev->stats));
@@ -196,6 +223,7 @@ static void clear_dev_stat(const struct ctl_ctx *ctx, struct device *dev)
 static void clear_net_stat(const struct ctl_ctx *ctx, struct netif *iface)
 {
 	memset(&iface->stats, 0, sizeof(iface->stats));
+	clear_worker_stats(iface);
 }
 
 static void clear_config(const struct ctl_ctx *ctx, struct device *dev)
@@ -298,6 +326,9 @@ static void ctl_io(uint32_t events, void *data G_GNUC_UNUSED)
 
 	patterns = NULL;
 
+	/* Keep the worker threads away from the data being looked at */
+	pause_workers();
+
 	switch (ctx->cmd)
 	{
 		case CTL_CMD_HELLO:
@@ -321,6 +352,10 @@ static void ctl_io(uint32_t events, void *data G_GNUC_UNUSED)
 			patterns = get_pattern_list(ctx->buf, ret);
 			for_each_dev(ctx, patterns, send_maclist);
 			break;
+		case CTL_CMD_GET_INITIATORS:
+			patterns = get_pattern_list(ctx->buf, ret);
+			for_each_dev(ctx, patterns, send_initiators);
+			break;
 		case CTL_CMD_CLEAR_STATS:
 			patterns = get_pattern_list(ctx->buf, ret);
 			for_each_dev(ctx, patterns, clear_dev_stat);
@@ -346,6 +381,7 @@ static void ctl_io(uint32_t events, void *data G_GNUC_UNUSED)
 
 	send_msg_ok(ctx);
 out:
+	resume_workers();
 	free_patternlist(patterns);
 	g_free(ctx);
 }
@@ -21,7 +21,8 @@ typedef enum {
 	CTL_CMD_CLEAR_STATS,
 	CTL_CMD_CLEAR_CONFIG,
 	CTL_CMD_CLEAR_MACMASK,
-	CTL_CMD_CLEAR_RESERVE
+	CTL_CMD_CLEAR_RESERVE,
+	CTL_CMD_GET_INITIATORS
 } ctl_command;
 
 typedef enum {
@@ -31,14 +32,15 @@ typedef enum {
 	CTL_MSG_NETSTAT,
 	CTL_MSG_OK,
 	CTL_MSG_MACLIST,
-	CTL_MSG_CONFIG
+	CTL_MSG_CONFIG,
+	CTL_MSG_INITIATOR
 } ctl_message;
 
 #define CONFIG_LOCATION		SYSCONFDIR "/ggaoed.conf"
 #define SOCKET_LOCATION		LOCALSTATEDIR "/run/ggaoed.sock"
 #define PIDFILE_LOCATION	LOCALSTATEDIR "/run/ggaoed.pid"
 
-#define CTL_PROTO_VERSION	1
+#define CTL_PROTO_VERSION	12
 
 #define CTL_MAX_PACKET		4096
 
@@ -86,4 +88,11 @@ struct msg_config
 	char			name[0];
 };
 
+struct msg_initiator
+{
+	uint32_t		type;
+	struct initiator_stats	stats;
+	char			name[0];
+};
+
 #endif /* CTL_H */
@@ -30,6 +30,43 @@
 /* Number of I/O events to submit/receive in one system call */
 #define EVENT_BATCH		32
 
+/* Idle time of the kernel submission thread in milliseconds */
+#define SQPOLL_IDLE		1000
+
+/* Max. number of initiators remembered per device */
+#define MAX_INITIATORS		256
+
+/* Multipath: only read responses at least this long are steered */
+#define MULTIPATH_MIN_LENGTH	4096
+
+/* Multipath: seconds after which an interface the initiator has stopped
+ * using is no longer considered */
+#define MULTIPATH_TIMEOUT	2
+
+/* Requests a device may submit in one round of run_devices(), per unit of
+ * weight */
+#define RUN_QUANTUM		EVENT_BATCH
+
+/* Smallest request buffer. Large enough for the response of any command
+ * that does not transfer sectors */
+#define MIN_REQ_BUFSIZE		4096
+
+/* The completion ring libaio shares with the kernel. This is not part of the
+ * libaio API, but the layout has been stable since it was introduced */
+struct aio_ring
+{
+	unsigned		id;
+	unsigned		nr;
+	unsigned		head;
+	unsigned		tail;
+	unsigned		magic;
+	unsigned		compat_features;
+	unsigned		incompat_features;
+	unsigned		header_length;
+};
+
+#define AIO_RING_MAGIC		0xa10a10a1
+
 /**********************************************************************
  * Forward declarations
  */
@@ -131,7 +168,10 @@ static const struct cmd_info aoe_cmds[] =
 	},
 };
 
-GQueue active_devs;
+#ifdef HAVE_LIBURING
+/* io_uring instance owning the shared SQPOLL thread */
+static int sqpoll_wq_fd = -1;
+#endif
 
 /**********************************************************************
  * Misc. helpers
@@ -177,6 +217,10 @@ static inline void drop_buffer(struct queue_item *q)
 		free_packet(q->buf, q->bufsize);
 		q->dynalloc = FALSE;
 	}
+	if (q->tx_zero_copy)
+		tx_release(q);
+	if (q->rx_zero_copy)
+		rx_release(q);
 	q->length = 0;
 }
 
@@ -209,6 +253,23 @@ void drop_request(struct queue_item *q)
 	g_slice_free(struct queue_item, q);
 }
 
+/* Size of the buffer needed to hold both the request and its response.
+ * Only ATA commands may need more than MIN_REQ_BUFSIZE, so with jumbo frames
+ * most requests do not get an MTU-sized buffer */
+static unsigned request_bufsize(const struct queue_item *q)
+{
+	unsigned size;
+
+	size = q->length - q->hdrlen;
+	if (q->aoe_hdr.cmd == AOE_CMD_ATA && (unsigned)q->ata_hdr.nsect << 9 > size)
+		size = (unsigned)q->ata_hdr.nsect << 9;
+	if (size < MIN_REQ_BUFSIZE)
+		size = MIN_REQ_BUFSIZE;
+	if (size > (unsigned)q->iface->mtu)
+		size = q->iface->mtu;
+	return size;
+}
+
 /* Copy the contents of the original request to a dynamically allocated buffer */
 static int clone_pkt(struct queue_item *q)
 {
@@ -224,11 +285,312 @@ static int clone_pkt(struct queue_item *q)
 	return 0;
 }
 
+/* Writes using direct I/O can be submitted straight from the RX ring
+ * instead of copying the data */
+static int hold_frame(const struct device *dev, struct queue_item *q)
+{
+	if (q->aoe_hdr.cmd != AOE_CMD_ATA || !dev->cfg.direct_io || dev->cfg.read_only)
+		return FALSE;
+	if (q->ata_hdr.cmdstat != WIN_WRITE && q->ata_hdr.cmdstat != WIN_WRITE_EXT)
+		return FALSE;
+	return rx_hold(q, dev->dio_align);
+}
+
 static inline unsigned max_sect_nr(const struct netif *iface)
 {
 	return (iface->mtu - sizeof(struct aoe_ata_hdr)) >> 9;
 }
 
+/**********************************************************************
+ * Initiators
+ */
+
+static inline gint64 mac_key(const void *mac)
+{
+	gint64 key = 0;
+
+	memcpy(&key, mac, ETH_ALEN);
+	return key;
+}
+
+static void init_io_queue(struct io_queue *ioq)
+{
+	g_queue_init(&ioq->deferred[0]);
+	g_queue_init(&ioq->deferred[1]);
+	ioq->sorted[0] = g_sequence_new(NULL);
+	ioq->sorted[1] = g_sequence_new(NULL);
+	ioq->chain.data = ioq;
+}
+
+static void destroy_io_queue(struct io_queue *ioq)
+{
+	g_sequence_free(ioq->sorted[0]);
+	g_sequence_free(ioq->sorted[1]);
+}
+
+static void free_initiator(void *data)
+{
+	struct initiator *ini = data;
+
+	destroy_io_queue(&ini->queue);
+	g_slice_free(struct initiator, ini);
+}
+
+/* Find the QoS limits of an initiator: the first class of the device that
+ * matches it */
+static const struct qos_limit *initiator_qos(const struct device *dev, gint64 mac)
+{
+	const struct qos_class *cls;
+	unsigned i;
+
+	for (i = 0; dev->cfg.qos_classes && i < dev->cfg.qos_classes->len; i++)
+	{
+		cls = g_ptr_array_index(dev->cfg.qos_classes, i);
+		if (!cls->match || match_acl(cls->match, &mac))
+			return &cls->limit;
+	}
+	return NULL;
+}
+
+/* The configuration has changed, look up the QoS class again */
+static void update_qos(void *key G_GNUC_UNUSED, void *value, void *user_data)
+{
+	struct initiator *ini = value;
+
+	ini->queue.qos = initiator_qos(user_data, ini->mac);
+}
+
+/* Look up an initiator, adding it if it was not seen before. Returns NULL
+ * if the device knows too many initiators already */
+static struct initiator *get_initiator(struct device *dev, const void *mac)
+{
+	struct initiator *ini;
+	gint64 key;
+
+	key = mac_key(mac);
+	ini = g_hash_table_lookup(dev->initiators, &key);
+	if (ini)
+		return ini;
+
+	if (g_hash_table_size(dev->initiators) >= MAX_INITIATORS)
+		return NULL;
+	ini = g_slice_new0(struct initiator);
+	ini->mac = key;
+	init_io_queue(&ini->queue);
+	ini->queue.qos = initiator_qos(dev, key);
+	g_hash_table_insert(dev->initiators, &ini->mac, ini);
+	return ini;
+}
+
+/**********************************************************************
+ * Multipath responses
+ */
+
+static time_t monotonic_seconds(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static void remove_path(struct initiator *ini, unsigned i)
+{
+	ini->paths[i] = ini->paths[--ini->num_paths];
+}
+
+/* Remember that the initiator can be reached through the interface, and
+ * forget the interfaces it has not used for a while */
+static void learn_path(struct device *dev, struct netif *iface, const void *mac)
+{
+	struct initiator *ini;
+	unsigned i, found;
+	time_t now;
+
+	ini = get_initiator(dev, mac);
+	if (!ini)
+		return;
+
+	now = monotonic_seconds();
+	found = FALSE;
+	for (i = ini->num_paths; i-- > 0;)
+	{
+		if (ini->paths[i].iface == iface)
+		{
+			ini->paths[i].last_seen = now;
+			found = TRUE;
+		}
+		else if (now - ini->paths[i].last_seen > MULTIPATH_TIMEOUT)
+			remove_path(ini, i);
+	}
+	if (found || ini->num_paths >= MAX_PATHS)
+		return;
+
+	ini->paths[ini->num_paths].iface = iface;
+	ini->paths[ini->num_paths++].last_seen = now;
+}
+
+static void forget_path(void *key G_GNUC_UNUSED, void *value, void *user_data)
+{
+	struct initiator *ini = value;
+	unsigned i;
+
+	for (i = ini->num_paths; i-- > 0;)
+		if (ini->paths[i].iface == user_data)
+			remove_path(ini, i);
+}
+
+/* Send a read response on the least busy interface the initiator has sent
+ * requests on recently. The initiator matches responses by tag, so it does
+ * not matter which of its ports the response arrives on. Ties keep the
+ * interface the request came in on */
+static void steer_response(struct device *dev, struct queue_item *q)
+{
+	struct netif *iface, *best;
+	struct initiator *ini;
+	unsigned i, load, best_load;
+	time_t now;
+	gint64 key;
+
+	key = mac_key(&q->aoe_hdr.addr.ether_shost);
+	ini = g_hash_table_lookup(dev->initiators, &key);
+	if (!ini || ini->num_paths < 2)
+		return;
+
+	now = monotonic_seconds();
+	best = q->iface;
+	best_load = tx_backlog(best);
+	for (i = 0; i < ini->num_paths && best_load; i++)
+	{
+		iface = ini->paths[i].iface;
+		if (iface == q->iface || q->hdrlen + q->length > (unsigned)iface->mtu)
+			continue;
+		/* A port that went dead looks idle, do not send there */
+		if (now - ini->paths[i].last_seen > MULTIPATH_TIMEOUT)
+			continue;
+		load = tx_backlog(iface);
+		if (load < best_load)
+		{
+			best = iface;
+			best_load = load;
+		}
+	}
+
+	if (best != q->iface)
+	{
+		q->iface = best;
+		++dev->stats.steered;
+	}
+}
+
+/**********************************************************************
+ * QoS limits
+ */
+
+static inline int qos_enabled(const struct device_config *cfg)
+{
+	return cfg->qos.iops || cfg->qos.bandwidth || cfg->qos_classes;
+}
+
+/* Add the tokens earned since the last refill. The buckets use
+ * CLOCK_MONOTONIC, so steps of the wall clock do not stall them */
+static void refill_bucket(struct token_bucket *tb, const struct qos_limit *limit,
+	const struct timespec *now)
+{
+	struct timespec diff;
+	double elapsed;
+
+	timespec_sub(now, &tb->last, &diff);
+	elapsed = (double)diff.tv_sec + (double)diff.tv_nsec / NSEC_PER_SEC;
+	tb->last = *now;
+
+	tb->iops = MIN(tb->iops + elapsed * limit->iops, limit->iops_burst);
+	tb->bytes = MIN(tb->bytes + elapsed * limit->bandwidth, limit->bandwidth_burst);
+}
+
+/* Nanoseconds until the bucket has tokens again, or 0 if it has some now.
+ * A request may be submitted as long as there are any tokens left; the
+ * debt it causes delays the following ones */
+static long qos_wait(const struct device *dev, struct token_bucket *tb,
+	const struct qos_limit *limit, const struct timespec *now)
+{
+	int throttled = FALSE;
+	double wait = 0.0;
+
+	/* Without a timer, nothing would resume throttled requests */
+	if (!limit || (!limit->iops && !limit->bandwidth) || dev->timer_fd == -1)
+		return 0;
+
+	refill_bucket(tb, limit, now);
+	if (limit->iops && tb->iops <= 0.0)
+	{
+		throttled = TRUE;
+		wait = -tb->iops / limit->iops;
+	}
+	if (limit->bandwidth && tb->bytes <= 0.0)
+	{
+		throttled = TRUE;
+		wait = MAX(wait, -tb->bytes / limit->bandwidth);
+	}
+	if (!throttled)
+		return 0;
+
+	/* Look again at least once a second */
+	return MIN(wait * NSEC_PER_SEC + 1.0, NSEC_PER_SEC - 1.0);
+}
+
+/* Take the tokens of a request, or give them back with negative values.
+ * Only limited resources are accounted, so there is no debt piling up
+ * while there is no limit */
+static void charge_bucket(struct token_bucket *tb, const struct qos_limit *limit,
+	long requests, long bytes)
+{
+	if (!limit)
+		return;
+	if (limit->iops)
+		tb->iops -= requests;
+	if (limit->bandwidth)
+		tb->bytes -= bytes;
+}
+
+/* Requests are held back by QoS limits. Arm the timer to look at them again
+ * once tokens are available. If the merge delay timer is running, the
+ * queue will be run when it expires anyway */
+static void throttle_dev(struct device *dev, long wait, const struct timespec *now)
+{
+	struct itimerspec new, old;
+
+	if (!dev->throttle_start.tv_sec && !dev->throttle_start.tv_nsec)
+	{
+		dev->throttle_start = *now;
+		++dev->stats.qos_throttled;
+	}
+
+	if (dev->timer_armed)
+		return;
+
+	/* New requests wait for the timer instead of running the queue again
+	 * just to find it still throttled */
+	memset(&new, 0, sizeof(new));
+	new.it_value.tv_nsec = wait;
+	if (timerfd_settime(dev->timer_fd, 0, &new, &old))
+		deverr(dev, "Failed to arm timer");
+	else
+		dev->timer_armed = TRUE;
+}
+
+static void unthrottle_dev(struct device *dev, const struct timespec *now)
+{
+	struct timespec diff;
+
+	if (!dev->throttle_start.tv_sec && !dev->throttle_start.tv_nsec)
+		return;
+
+	timespec_sub(now, &dev->throttle_start, &diff);
+	timespec_add(&dev->stats.qos_throttle_time, &diff, &dev->stats.qos_throttle_time);
+	memset(&dev->throttle_start, 0, sizeof(dev->throttle_start));
+}
+
 /**********************************************************************
  * Allocate/deallocate devices
  */
@@ -240,14 +602,23 @@ static void free_dev(struct device *dev)
 		close(dev->fd);
 	if (dev->event_fd != -1)
 	{
-		del_fd(dev->event_fd);
+		del_worker_fd(dev->worker, dev->event_fd);
 		close(dev->event_fd);
 	}
 	if (dev->timer_fd != -1)
 	{
-		del_fd(dev->timer_fd);
+		del_worker_fd(dev->worker, dev->timer_fd);
 		close(dev->timer_fd);
 	}
+#ifdef HAVE_LIBURING
+	if (dev->uring_ready)
+	{
+		del_worker_fd(dev->worker, dev->uring.ring_fd);
+		if (sqpoll_wq_fd == dev->uring.ring_fd)
+			sqpoll_wq_fd = -1;
+		io_uring_queue_exit(&dev->uring);
+	}
+#endif
 
 	if (dev->aoe_conf && dev->aoe_conf != MAP_FAILED)
 		munmap(dev->aoe_conf, sizeof(*dev->aoe_conf));
@@ -257,7 +628,8 @@ static void free_dev(struct device *dev)
 		munmap(dev->reserve, sizeof(*dev->reserve));
 
 	g_ptr_array_free(dev->ifaces, TRUE);
-	g_ptr_array_free(dev->deferred, TRUE);
+	g_hash_table_destroy(dev->initiators);
+	destroy_io_queue(&dev->queue);
 	destroy_device_config(&dev->cfg);
 	g_slice_free(struct device, dev);
 }
@@ -349,14 +721,22 @@ static int open_dev(struct device *dev, struct device_config *cfg)
 
 	if (S_ISBLK(st.st_mode))
 	{
+		int sector_size;
+
 		if (ioctl(dev->fd, BLKGETSIZE64, &dev->size))
 		{
 			deverr(dev, "ioctl(BLKGETSIZE64) failed");
 			return -1;
 		}
+		if (ioctl(dev->fd, BLKSSZGET, &sector_size) || sector_size < 512)
+			sector_size = 512;
+		dev->dio_align = sector_size;
 	}
 	else
+	{
 		dev->size = st.st_size;
+		dev->dio_align = 512;
+	}
 
 	hsize = human_format(dev->size, &unit);
 	devlog(dev, LOG_INFO, "Shelf %d, slot %d, path '%s' (size %lld %s, sectors %lld) opened%s%s",
@@ -420,6 +800,109 @@ static int validate_dev_fd(struct device *dev, struct device_config *cfg)
 	return 0;
 }
 
+/* Set up the libaio context and the eventfd used for completions */
+static int setup_aio(struct device *dev)
+{
+	int ret;
+
+	ret = io_setup(2 * EVENT_BATCH, &dev->aio_ctx);
+	if (ret)
+	{
+		if (ret == -EAGAIN)
+		{
+			devlog(dev, LOG_ERR, "Failed to allocate the AIO context.");
+			devlog(dev, LOG_ERR, "Consider increasing /proc/sys/fs/aio-max-nr");
+		}
+		else
+			devlog(dev, LOG_ERR, "io_setup() failed: %s", strerror(-ret));
+		return -1;
+	}
+
+	dev->event_fd = eventfd(0, EFD_NONBLOCK);
+	if (dev->event_fd == -1)
+	{
+		deverr(dev, "Failed to create eventfd");
+		return -1;
+	}
+	add_worker_fd(dev->worker, dev->event_fd, &dev->event_ctx);
+	return 0;
+}
+
+#ifdef HAVE_LIBURING
+/* Set up the io_uring instance of the device. The ring fd itself is watched
+ * for completions, so no eventfd is needed */
+static int setup_uring(struct device *dev)
+{
+	struct io_uring_params p;
+	struct iovec arena;
+	int ret, fd;
+
+	memset(&p, 0, sizeof(p));
+	if (dev->cfg.uring_iopoll)
+		p.flags |= IORING_SETUP_IOPOLL;
+	if (dev->cfg.uring_sqpoll)
+	{
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = SQPOLL_IDLE;
+		/* Share the kernel submission thread between devices */
+		if (sqpoll_wq_fd != -1)
+		{
+			p.flags |= IORING_SETUP_ATTACH_WQ;
+			p.wq_fd = sqpoll_wq_fd;
+		}
+	}
+
+	ret = io_uring_queue_init_params(2 * EVENT_BATCH, &dev->uring, &p);
+	if (ret && (p.flags & IORING_SETUP_SQPOLL))
+	{
+		devlog(dev, LOG_WARNING, "SQPOLL is not available (%s), "
+			"using normal submission", strerror(-ret));
+		p.flags &= ~(IORING_SETUP_SQPOLL | IORING_SETUP_ATTACH_WQ);
+		p.sq_thread_idle = 0;
+		p.wq_fd = 0;
+		ret = io_uring_queue_init_params(2 * EVENT_BATCH, &dev->uring, &p);
+	}
+	if (ret)
+	{
+		devlog(dev, LOG_ERR, "Failed to set up io_uring: %s", strerror(-ret));
+		return -1;
+	}
+	dev->uring_ready = TRUE;
+	dev->uring_depth = p.cq_entries;
+	if ((p.flags & IORING_SETUP_SQPOLL) && sqpoll_wq_fd == -1)
+		sqpoll_wq_fd = dev->uring.ring_fd;
+
+	/* Reserve a sparse slot for the device; setup_dev() fills it once
+	 * the device is opened */
+	fd = -1;
+	ret = io_uring_register_files(&dev->uring, &fd, 1);
+	if (ret)
+		devlog(dev, LOG_NOTICE, "Registering the device file failed: %s",
+			strerror(-ret));
+	else
+		dev->uring_fixed_file = TRUE;
+
+	if (get_packet_arena(&arena))
+	{
+		ret = io_uring_register_buffers(&dev->uring, &arena, 1);
+		if (ret)
+			devlog(dev, LOG_NOTICE, "Registering the packet buffers failed: %s",
+				strerror(-ret));
+		else
+			dev->uring_fixed_buf = TRUE;
+	}
+
+	add_worker_fd(dev->worker, dev->uring.ring_fd, &dev->event_ctx);
+
+	devlog(dev, LOG_INFO, "Using io_uring%s%s%s%s",
+		p.flags & IORING_SETUP_SQPOLL ? ", SQPOLL" : "",
+		p.flags & IORING_SETUP_IOPOLL ? ", IOPOLL" : "",
+		dev->uring_fixed_file ? ", registered file" : "",
+		dev->uring_fixed_buf ? ", registered buffers" : "");
+	return 0;
+}
+#endif
+
 /* Allocate the device. Do everything that does not need changing if the
  * configuration is updated */
 static struct device *alloc_dev(const char *name)
@@ -434,11 +917,16 @@ static struct device *alloc_dev(const char *name)
 	dev->event_fd = -1;
 	dev->timer_fd = -1;
 	dev->ifaces = g_ptr_array_new();
+	dev->initiators = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+		NULL, free_initiator);
+	init_io_queue(&dev->queue);
 	dev->event_ctx.callback = dev_io;
 	dev->event_ctx.data = dev;
 	dev->timer_ctx.callback = dev_timer;
 	dev->timer_ctx.data = dev;
 	dev->chain.data = dev;
+	dev->poll_chain.data = dev;
+	dev->worker = assign_worker();
 
 	if (!get_device_config(name, &dev->cfg))
 	{
@@ -446,8 +934,6 @@ static struct device *alloc_dev(const char *name)
 		return NULL;
 	}
 
-	dev->deferred = g_ptr_array_sized_new(dev->cfg.queue_length);
-
 	for (i = 0; i < devices->len; i++)
 	{
 		struct device *dev2 = g_ptr_array_index(devices, i);
@@ -460,29 +946,18 @@ static struct device *alloc_dev(const char *name)
 		return NULL;
 	}
 
-	ret = io_setup(2 * EVENT_BATCH, &dev->aio_ctx);
+#ifdef HAVE_LIBURING
+	if (dev->cfg.io_engine == IO_ENGINE_URING)
+		ret = setup_uring(dev);
+	else
+#endif
+		ret = setup_aio(dev);
 	if (ret)
 	{
-		if (ret == -EAGAIN)
-		{
-			devlog(dev, LOG_ERR, "Failed to allocate the AIO context.");
-			devlog(dev, LOG_ERR, "Consider increasing /proc/sys/fs/aio-max-nr");
-		}
-		else
-			devlog(dev, LOG_ERR, "io_setup() failed: %s", strerror(-ret));
 		free_dev(dev);
 		return NULL;
 	}
 
-	dev->event_fd = eventfd(0, EFD_NONBLOCK);
-	if (dev->event_fd == -1)
-	{
-		deverr(dev, "Failed to create eventfd");
-		free_dev(dev);
-		return NULL;
-	}
-	add_fd(dev->event_fd, &dev->event_ctx);
-
 	dev->aoe_conf = open_and_map(dev, "config", sizeof(*dev->aoe_conf));
 	dev->mac_mask = open_and_map(dev, "mac_mask", sizeof(*dev->mac_mask));
 	dev->reserve = open_and_map(dev, "reserve", sizeof(*dev->reserve));
@@ -501,10 +976,24 @@ static struct device *alloc_dev(const char *name)
 }
 
 /* (Re-)configure a device */
+/* Update the socket filters of the interfaces the device is attached to */
+static void refresh_filters(struct device *dev)
+{
+	unsigned i;
+
+	/* The sockets belong to the main thread */
+	if (current_worker != &main_worker)
+		return request_filter_refresh();
+
+	for (i = 0; i < dev->ifaces->len; i++)
+		update_filter(g_ptr_array_index(dev->ifaces, i));
+}
+
 static int setup_dev(struct device *dev)
 {
 	struct device_config newcfg;
-	int ret;
+	unsigned i;
+	int ret, moved;
 
 	if (!get_device_config(dev->name, &newcfg))
 		return -1;
@@ -519,23 +1008,44 @@ static int setup_dev(struct device *dev)
 	}
 
 	if (dev->fd == -1)
+	{
 		ret = open_dev(dev, &newcfg);
+#ifdef HAVE_LIBURING
+		if (!ret && dev->uring_fixed_file &&
+				io_uring_register_files_update(&dev->uring, 0, &dev->fd, 1) != 1)
+		{
+			devlog(dev, LOG_NOTICE, "Failed to update the registered file");
+			dev->uring_fixed_file = FALSE;
+		}
+#endif
+	}
 	else
 		ret = validate_dev_fd(dev, &newcfg);
 	if (ret)
 		return ret;
 
-	if (newcfg.merge_delay && dev->timer_fd == -1)
+	/* The I/O engine is set up when the device is allocated */
+	if (newcfg.io_engine != dev->cfg.io_engine ||
+			newcfg.uring_sqpoll != dev->cfg.uring_sqpoll ||
+			newcfg.uring_iopoll != dev->cfg.uring_iopoll)
+	{
+		devlog(dev, LOG_WARNING, "Changing the I/O engine settings requires a restart");
+		newcfg.io_engine = dev->cfg.io_engine;
+		newcfg.uring_sqpoll = dev->cfg.uring_sqpoll;
+		newcfg.uring_iopoll = dev->cfg.uring_iopoll;
+	}
+
+	if ((newcfg.merge_delay || qos_enabled(&newcfg)) && dev->timer_fd == -1)
 	{
 		dev->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
 		if (dev->timer_fd == -1)
-			deverr(dev, "Failed to create timerfd, merge-delay disabled");
+			deverr(dev, "Failed to create timerfd, merge-delay and QoS disabled");
 		else
-			add_fd(dev->timer_fd, &dev->timer_ctx);
+			add_worker_fd(dev->worker, dev->timer_fd, &dev->timer_ctx);
 	}
-	if (!newcfg.merge_delay && dev->timer_fd != -1)
+	if (!newcfg.merge_delay && !qos_enabled(&newcfg) && dev->timer_fd != -1)
 	{
-		del_fd(dev->timer_fd);
+		del_worker_fd(dev->worker, dev->timer_fd);
 		close(dev->timer_fd);
 		dev->timer_fd = -1;
 		dev->timer_armed = FALSE;
@@ -543,8 +1053,22 @@ static int setup_dev(struct device *dev)
 		activate_dev(dev);
 	}
 
+	/* The lookup tables of the interfaces are keyed by the address */
+	moved = newcfg.shelf != dev->cfg.shelf || newcfg.slot != dev->cfg.slot;
+	for (i = 0; moved && i < dev->ifaces->len; i++)
+		unindex_device(g_ptr_array_index(dev->ifaces, i), dev);
+
 	destroy_device_config(&dev->cfg);
 	dev->cfg = newcfg;
+
+	for (i = 0; moved && i < dev->ifaces->len; i++)
+		index_device(g_ptr_array_index(dev->ifaces, i), dev);
+
+	/* The QoS classes may have changed */
+	g_hash_table_foreach(dev->initiators, update_qos, dev);
+
+	/* The ACLs may have changed */
+	refresh_filters(dev);
 	return 0;
 }
 
@@ -575,6 +1099,11 @@ static void finish_request(struct queue_item *q, int error)
 			ether_ntoa((struct ether_addr *)&q->aoe_hdr.addr.ether_shost),
 			(uint32_t)ntohl(q->aoe_hdr.tag), error);
 
+	/* Zero-copy responses are bound to the TX ring they were read into */
+	if (dev->cfg.multipath && !error && q->is_ata && !q->is_write &&
+			q->length >= MULTIPATH_MIN_LENGTH && !q->tx_zero_copy)
+		steer_response(dev, q);
+
 	/* Swap the source/destination addresses */
 	memcpy(&q->aoe_hdr.addr.ether_dhost, &q->aoe_hdr.addr.ether_shost, ETH_ALEN);
 	memcpy(&q->aoe_hdr.addr.ether_shost, &q->iface->mac, ETH_ALEN);
@@ -613,8 +1142,7 @@ static void complete_io(struct submit_slot *s, long res)
 	if (G_UNLIKELY(res < 0))
 	{
 		devlog(s->dev, LOG_ERR, "%s request failed: %s",
-			s->iocb.aio_lio_opcode == IO_CMD_PREADV ? "Read" : "Write",
-			strerror(-res));
+			s->is_write ? "Write" : "Read", strerror(-res));
 		error = res == -EIO ? ATA_UNC : ATA_ABORTED;
 		status = ATA_ERR | ATA_DRDY;
 	}
@@ -632,126 +1160,524 @@ static void complete_io(struct submit_slot *s, long res)
 		if (G_UNLIKELY(!res))
 		{
 			devlog(q->dev, LOG_ERR, "Short %s request",
-				s->iocb.aio_lio_opcode == IO_CMD_PREADV ? "read" : "write");
+				s->is_write ? "write" : "read");
 			error = ATA_ABORTED;
 			status |= ATA_ERR;
 		}
 		res -= q->length;
 
 		/* Do not send back the data to the client in case of a write
-		 * request */
-		if (s->iocb.aio_lio_opcode == IO_CMD_PWRITEV)
-			q->length = 0;
+		 * request. This also gives back the RX frame of zero-copy
+		 * writes as soon as possible */
+		if (s->is_write)
+			drop_buffer(q);
 
 		finish_ata(q, error, status);
 	}
 	g_slice_free(struct submit_slot, s);
 }
 
-static void activate_dev(struct device *dev)
+static void activate_dev(struct device *dev)
+{
+	struct itimerspec new, old;
+
+	if (dev->is_active || dev->timer_armed)
+		return;
+
+	if (dev->timer_fd != -1 && dev->cfg.merge_delay)
+	{
+		memset(&new, 0, sizeof(new));
+		new.it_value.tv_nsec = dev->cfg.merge_delay;
+		if (timerfd_settime(dev->timer_fd, 0, &new, &old))
+			deverr(dev, "Failed to arm timer");
+		else
+		{
+			dev->timer_armed = TRUE;
+			return;
+		}
+	}
+
+	g_queue_push_tail_link(&dev->worker->active_devs, &dev->chain);
+	dev->is_active = TRUE;
+}
+
+static void deactivate_dev(struct device *dev)
+{
+	if (!dev->is_active)
+		return;
+
+	g_queue_unlink(&dev->worker->active_devs, &dev->chain);
+	dev->is_active = FALSE;
+}
+
+/* Make the event loop poll for completions of the device */
+static void poll_dev(struct device *dev)
+{
+	if (dev->is_polled)
+		return;
+
+	g_queue_push_tail_link(&dev->worker->polled_devs, &dev->poll_chain);
+	dev->is_polled = TRUE;
+}
+
+static void unpoll_dev(struct device *dev)
+{
+	if (!dev->is_polled)
+		return;
+
+	g_queue_unlink(&dev->worker->polled_devs, &dev->poll_chain);
+	dev->is_polled = FALSE;
+}
+
+/* Check the completion ring without entering the kernel */
+static int aio_ring_empty(const struct device *dev)
+{
+	const volatile struct aio_ring *ring = (const void *)dev->aio_ctx;
+
+	if (ring->magic != AIO_RING_MAGIC)
+		return FALSE;
+	return ring->head == ring->tail;
+}
+
+/* Collect libaio completions */
+static void reap_aio(struct device *dev, uint32_t events)
+{
+	struct io_event ev[EVENT_BATCH];
+	eventfd_t dummy;
+	int ret, i;
+
+	/* Busy polling: avoid the system call if there is nothing to reap */
+	if (!events && aio_ring_empty(dev))
+		return;
+
+	/* Reset the event counter */
+	if (events & EPOLLIN)
+	{
+		ret = read(dev->event_fd, &dummy, sizeof(dummy));
+		if (ret != sizeof(dummy))
+			devlog(dev, LOG_WARNING, "Short read on the eventfd");
+	}
+
+	while (dev->active.length)
+	{
+		ret = io_getevents(dev->aio_ctx, 0, EVENT_BATCH, ev, NULL);
+		if (ret < 0)
+		{
+			devlog(dev, LOG_ERR, "io_getevents() failed: %s",
+				strerror(-ret));
+			break;
+		}
+
+		for (i = 0; i < ret; i++)
+			complete_io(ev[i].data, ev[i].res);
+
+		if (ret < EVENT_BATCH)
+			break;
+	}
+}
+
+#ifdef HAVE_LIBURING
+/* Collect io_uring completions */
+static void reap_uring(struct device *dev)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, cnt;
+
+	/* With IOPOLL, completions must be reaped by entering the kernel */
+	if ((dev->uring.flags & IORING_SETUP_IOPOLL) && !io_uring_cq_ready(&dev->uring))
+		io_uring_peek_cqe(&dev->uring, &cqe);
+
+	cnt = 0;
+	io_uring_for_each_cqe(&dev->uring, head, cqe)
+	{
+		complete_io(io_uring_cqe_get_data(cqe), cqe->res);
+		++cnt;
+	}
+	io_uring_cq_advance(&dev->uring, cnt);
+}
+#endif
+
+/* Completion event handler callback */
+static void dev_io(uint32_t events, void *data)
+{
+	struct device *const dev = data;
+
+#ifdef HAVE_LIBURING
+	if (dev->uring_ready)
+		reap_uring(dev);
+	else
+#endif
+		reap_aio(dev, events);
+
+	/* A device waiting for its next turn keeps its place */
+	if (dev->is_active && dev->run_credit <= 0)
+		return;
+	deactivate_dev(dev);
+	run_queue(dev);
+}
+
+/* timerfd callback */
+void dev_timer(uint32_t events, void *data)
+{
+	struct device *const dev = data;
+	uint64_t expires;
+	int ret;
+
+	if (G_UNLIKELY(dev->cfg.trace_io))
+		devlog(dev, LOG_DEBUG, "Timer expired");
+
+	ret = read(dev->timer_fd, &expires, sizeof(expires));
+	if (ret == -1)
+	{
+		if (errno != EAGAIN)
+			deverr(dev, "Timer read");
+		return;
+	}
+
+	dev->timer_armed = FALSE;
+	run_queue(dev);
+}
+
+#define CMP(a, b) ((a) < (b) ? -1 : ((a) > (b) ? 1 : 0))
+static int offset_compare(const void *a, const void *b, void *user_data G_GNUC_UNUSED)
+{
+	const struct queue_item *aa = a, *bb = b;
+
+	return CMP(aa->offset, bb->offset);
+}
+
+static inline unsigned queue_depth(const struct io_queue *ioq)
+{
+	return ioq->deferred[0].length + ioq->deferred[1].length;
+}
+
+static int arrival_compare(const void *a, const void *b)
+{
+	const struct queue_item *const aa = *(struct queue_item *const *)a;
+	const struct queue_item *const bb = *(struct queue_item *const *)b;
+
+	if (aa->start.tv_sec != bb->start.tv_sec)
+		return CMP(aa->start.tv_sec, bb->start.tv_sec);
+	return CMP(aa->start.tv_nsec, bb->start.tv_nsec);
+}
+
+/* Put a request on its deferred queue. The queue joins the round-robin
+ * list when it gets its first request. A request put back after a failed
+ * submission goes to the head, so it is taken again first */
+static void link_deferred(struct device *dev, struct queue_item *q, int requeue)
+{
+	struct io_queue *const ioq = q->ioq;
+	const int dir = q->is_write != 0;
+
+	if (requeue)
+	{
+		if (!queue_depth(ioq))
+			g_queue_push_head_link(&dev->busy_queues, &ioq->chain);
+		g_queue_push_head_link(&ioq->deferred[dir], &q->deferred_link);
+	}
+	else
+	{
+		if (!queue_depth(ioq))
+			g_queue_push_tail_link(&dev->busy_queues, &ioq->chain);
+		g_queue_push_tail_link(&ioq->deferred[dir], &q->deferred_link);
+	}
+	q->sorted_pos = g_sequence_insert_sorted(ioq->sorted[dir], q, offset_compare, NULL);
+}
+
+/* Add a request to the deferred queues. With fairness or QoS classes
+ * enabled every initiator has its own queue; initiators the device cannot
+ * keep track of share the queue of the device */
+static void queue_deferred(struct device *dev, struct queue_item *q)
+{
+	struct initiator *ini;
+
+	q->ioq = &dev->queue;
+	if (dev->cfg.initiator_quantum || dev->cfg.qos_classes)
+	{
+		ini = get_initiator(dev, &q->aoe_hdr.addr.ether_shost);
+		if (ini)
+			q->ioq = &ini->queue;
+	}
+
+	q->deferred_link.data = q;
+	link_deferred(dev, q, FALSE);
+}
+
+static void unqueue_deferred(struct device *dev, struct queue_item *q)
+{
+	struct io_queue *const ioq = q->ioq;
+
+	g_queue_unlink(&ioq->deferred[q->is_write != 0], &q->deferred_link);
+	g_sequence_remove(q->sorted_pos);
+	q->sorted_pos = NULL;
+
+	if (!queue_depth(ioq))
+	{
+		g_queue_unlink(&dev->busy_queues, &ioq->chain);
+		/* An idle queue does not save up credit, but it keeps its
+		 * debt */
+		if (ioq->deficit > 0)
+			ioq->deficit = 0;
+	}
+}
+
+/* Give back the TX frame of a read that has to wait in the queue again, so
+ * it does not hold up the responses behind it */
+static void unreserve_frame(struct queue_item *q)
+{
+	void *buf;
+
+	if (!q->tx_zero_copy)
+		return;
+	buf = alloc_packet(q->bufsize);
+	if (!buf)
+		return;
+	tx_release(q);
+	q->buf = buf;
+	q->dynalloc = TRUE;
+}
+
+/* Put back the requests of slots that could not be submitted, and free the
+ * slots. Slots are built by offset, so the requests are sorted by arrival
+ * first; pushing the youngest to the head first leaves the unsubmitted
+ * requests in front of their queues in arrival order, without walking the
+ * queues */
+static void requeue_slots(struct device *dev, struct submit_slot **slots, unsigned n)
 {
-	struct itimerspec new, old;
-
-	if (dev->is_active || dev->timer_armed)
-		return;
+	struct queue_item *items[EVENT_BATCH * MAX_MERGE];
+	struct queue_item *q;
+	unsigned i, j, cnt;
 
-	if (dev->timer_fd != -1 && dev->cfg.merge_delay)
+	cnt = 0;
+	for (i = 0; i < n; i++)
 	{
-		memset(&new, 0, sizeof(new));
-		new.it_value.tv_nsec = dev->cfg.merge_delay;
-		if (timerfd_settime(dev->timer_fd, 0, &new, &old))
-			deverr(dev, "Failed to arm timer");
-		else
+		for (j = 0; j < slots[i]->num_iov; j++)
 		{
-			dev->timer_armed = TRUE;
-			return;
+			q = slots[i]->items[j];
+			if (dev->cfg.initiator_quantum)
+				q->ioq->deficit += q->length;
+			charge_bucket(&dev->qos_bucket, &dev->cfg.qos, -1, -(long)q->length);
+			charge_bucket(&q->ioq->bucket, q->ioq->qos, -1, -(long)q->length);
+			--q->ioq->io_cnt;
+			q->ioq->io_bytes -= q->length;
+			unreserve_frame(q);
+			items[cnt++] = q;
 		}
+		dev->run_credit += slots[i]->num_iov;
+		g_slice_free(struct submit_slot, slots[i]);
 	}
 
-	g_queue_push_tail_link(&active_devs, &dev->chain);
-	dev->is_active = TRUE;
+	qsort(items, cnt, sizeof(items[0]), arrival_compare);
+	while (cnt)
+		link_deferred(dev, items[--cnt], TRUE);
 }
 
-static void deactivate_dev(struct device *dev)
+/* Time a request has been waiting for, in nanoseconds. Saturates at one
+ * second, which is longer than any configurable delay */
+static long request_age(const struct queue_item *q, const struct timespec *now)
 {
-	if (!dev->is_active)
-		return;
+	struct timespec age;
 
-	g_queue_unlink(&active_devs, &dev->chain);
-	dev->is_active = FALSE;
+	timespec_sub(now, &q->start, &age);
+	if (age.tv_sec < 0)
+		return 0;
+	return age.tv_sec ? NSEC_PER_SEC : age.tv_nsec;
 }
 
-/* eventfd event handler callback */
-static void dev_io(uint32_t events, void *data)
+/* Direction of the oldest queued request, or -1 if nothing is queued */
+static int oldest_direction(struct io_queue *ioq)
 {
-	struct device *const dev = data;
-	struct io_event ev[EVENT_BATCH];
-	eventfd_t dummy;
-	int ret, i;
+	const struct queue_item *r, *w;
+
+	r = g_queue_peek_head(&ioq->deferred[0]);
+	w = g_queue_peek_head(&ioq->deferred[1]);
+	if (!r || !w)
+		return r ? 0 : w ? 1 : -1;
+	if (w->start.tv_sec != r->start.tv_sec)
+		return w->start.tv_sec < r->start.tv_sec;
+	return w->start.tv_nsec < r->start.tv_nsec;
+}
 
-	/* Reset the event counter */
-	if (events & EPOLLIN)
+/* Deadline scheduler: choose the direction of the next batch. Reads are
+ * preferred, but writes go once their deadline has expired or after
+ * writes_starved read batches */
+static int deadline_direction(struct device *dev, struct io_queue *ioq,
+	const struct timespec *now)
+{
+	const struct queue_item *w;
+
+	w = g_queue_peek_head(&ioq->deferred[1]);
+	if (!w)
 	{
-		ret = read(dev->event_fd, &dummy, sizeof(dummy));
-		if (ret != sizeof(dummy))
-			devlog(dev, LOG_WARNING, "Short read on the eventfd");
+		ioq->write_starved = 0;
+		return 0;
+	}
+	if (!ioq->deferred[0].length)
+	{
+		ioq->write_starved = 0;
+		return 1;
+	}
+	if (request_age(w, now) > dev->cfg.write_deadline)
+	{
+		ioq->write_starved = 0;
+		return 1;
+	}
+	if (ioq->write_starved >= dev->cfg.writes_starved)
+	{
+		++dev->stats.sched_writes_starved;
+		ioq->write_starved = 0;
+		return 1;
 	}
+	++ioq->write_starved;
+	return 0;
+}
 
-	while (dev->active.length)
+/* Choose the queue to take the next submit slot from. Without fairness
+ * this is the queue of the device. Otherwise the queues take turns by
+ * deficit round robin: a queue is served until it has used up its credit,
+ * then it moves to the back and receives another quantum. Queues over
+ * their QoS limits are skipped; *wait is lowered to the time until the
+ * first of them may go again */
+static struct io_queue *next_queue(struct device *dev, const struct timespec *now,
+	long *wait)
+{
+	struct io_queue *ioq;
+	unsigned skipped;
+	long w;
+
+	skipped = 0;
+	while ((ioq = g_queue_peek_head(&dev->busy_queues)))
 	{
-		ret = io_getevents(dev->aio_ctx, 0, EVENT_BATCH, ev, NULL);
-		if (ret < 0)
+		w = qos_wait(dev, &ioq->bucket, ioq->qos, now);
+		if (w)
 		{
-			devlog(dev, LOG_ERR, "io_getevents() failed: %s",
-				strerror(-ret));
-			break;
+			if (!*wait || w < *wait)
+				*wait = w;
+			if (++skipped >= dev->busy_queues.length)
+				return NULL;
 		}
+		else if (!dev->cfg.initiator_quantum || ioq->deficit > 0)
+			return ioq;
+		else
+		{
+			ioq->deficit += dev->cfg.initiator_quantum;
+			skipped = 0;
+		}
+		g_queue_unlink(&dev->busy_queues, &ioq->chain);
+		g_queue_push_tail_link(&dev->busy_queues, &ioq->chain);
+	}
+	return NULL;
+}
 
-		for (i = 0; i < ret; i++)
-			complete_io(ev[i].data, ev[i].res);
-
-		if (ret < EVENT_BATCH)
+/* Pick the request in the given direction to start the next submit slot
+ * with. Expired requests go in arrival order; otherwise requests are swept
+ * in increasing offset order, starting after the last submitted request */
+static struct queue_item *next_request(struct device *dev, struct io_queue *ioq,
+	int dir, const struct timespec *now)
+{
+	struct queue_item *q, key;
+	GSequenceIter *iter;
+	GSequence *seq;
+	long deadline;
+
+	q = g_queue_peek_head(&ioq->deferred[dir]);
+	switch (dev->cfg.io_scheduler)
+	{
+		case IO_SCHED_FIFO:
+			return q;
+		case IO_SCHED_DEADLINE:
+			deadline = dir ? dev->cfg.write_deadline : dev->cfg.read_deadline;
 			break;
+		default:
+			deadline = dev->cfg.max_delay;
+			break;
+	}
+	if (request_age(q, now) > deadline)
+	{
+		++dev->stats.sched_expired;
+		return q;
 	}
 
-	deactivate_dev(dev);
-	run_queue(dev);
+	/* Offsets are multiples of the sector size, so searching for the
+	 * position of sweep_pos - 1 finds the first request at or above
+	 * sweep_pos */
+	seq = ioq->sorted[dir];
+	if (ioq->sweep_pos)
+	{
+		key.offset = ioq->sweep_pos - 1;
+		iter = g_sequence_search(seq, &key, offset_compare, NULL);
+	}
+	else
+		iter = g_sequence_get_begin_iter(seq);
+	if (g_sequence_iter_is_end(iter))
+		iter = g_sequence_get_begin_iter(seq);
+	return g_sequence_get(iter);
 }
 
-/* timerfd callback */
-void dev_timer(uint32_t events, void *data)
+/* Take the run of adjacent requests containing q off its deferred queue
+ * and build a submit slot from them. Adjacent requests are neighbours in
+ * the sorted sequence, so finding them does not need a search. Only
+ * requests of the same queue are merged */
+static struct submit_slot *build_slot(struct device *dev, struct queue_item *q)
 {
-	struct device *const dev = data;
-	uint64_t expires;
-	int ret;
-
-	if (G_UNLIKELY(dev->cfg.trace_io))
-		devlog(dev, LOG_DEBUG, "Timer expired");
+	struct io_queue *const ioq = q->ioq;
+	unsigned long long offset;
+	GSequenceIter *first, *iter, *next;
+	struct submit_slot *s;
+	struct queue_item *p;
+	unsigned n;
 
-	ret = read(dev->timer_fd, &expires, sizeof(expires));
-	if (ret == -1)
+	/* Find the start of the run */
+	first = q->sorted_pos;
+	offset = q->offset;
+	for (n = 1; n < MAX_MERGE && !g_sequence_iter_is_begin(first); n++)
 	{
-		if (errno != EAGAIN)
-			deverr(dev, "Timer read");
-		return;
+		iter = g_sequence_iter_prev(first);
+		p = g_sequence_get(iter);
+		if (p->offset + p->length != offset)
+			break;
+		first = iter;
+		offset = p->offset;
 	}
 
-	dev->timer_armed = FALSE;
-	run_queue(dev);
-}
-
-#define CMP(a, b) ((a) < (b) ? -1 : ((a) > (b) ? 1 : 0))
-static int queue_compare(const void *a, const void *b)
-{
-	const struct queue_item *aa = *(void **)a, *bb = *(void **)b;
-	long t;
+	s = g_slice_new0(struct submit_slot);
+	s->chain.data = s;
+	s->dev = dev;
+	s->is_write = q->is_write;
+	s->offset = offset;
 
-	if (aa->start.tv_sec != bb->start.tv_sec)
-		return CMP(aa->start.tv_sec, bb->start.tv_sec);
-	t = aa->start.tv_nsec - bb->start.tv_nsec;
-	if (abs(t) > aa->dev->cfg.max_delay)
-		return t;
-	return CMP(aa->offset, bb->offset);
+	for (iter = first; !g_sequence_iter_is_end(iter) &&
+			s->num_iov < G_N_ELEMENTS(s->iov); iter = next)
+	{
+		p = g_sequence_get(iter);
+		if (p->offset != offset)
+			break;
+		next = g_sequence_iter_next(iter);
+		unqueue_deferred(dev, p);
+
+		/* Let the data land directly in the TX ring of the interface.
+		 * This is only safe with direct I/O, where the kernel pins the
+		 * buffer pages when the request is submitted. The kernel sends
+		 * the ring in order, so the frame is not taken before the read
+		 * is about to start */
+		if (!s->is_write && p->iface && dev->cfg.direct_io && p->iface->zero_copy_read)
+			tx_reserve(p, dev->dio_align);
+
+		s->iov[s->num_iov].iov_base = p->buf;
+		s->iov[s->num_iov].iov_len = p->length;
+		s->items[s->num_iov++] = p;
+		offset += p->length;
+
+		if (dev->cfg.initiator_quantum)
+			ioq->deficit -= p->length;
+		charge_bucket(&dev->qos_bucket, &dev->cfg.qos, 1, p->length);
+		charge_bucket(&ioq->bucket, ioq->qos, 1, p->length);
+		++ioq->io_cnt;
+		ioq->io_bytes += p->length;
+	}
+
+	ioq->sweep_pos = offset;
+	return s;
 }
 
 /* Set up the iocb for submission */
@@ -765,71 +1691,170 @@ static inline void prepare_io(struct submit_slot *s)
 	io_set_eventfd(&s->iocb, s->dev->event_fd);
 }
 
-static void submit(struct device *dev)
+static int submit_aio(struct device *dev, struct submit_slot **slots, unsigned num)
 {
 	struct iocb *iocbs[EVENT_BATCH];
-	unsigned i, num_iocbs, req_prep;
-	unsigned long long next_offset;
-	struct submit_slot *s;
-	struct queue_item *q;
-	int ret;
+	unsigned i;
+
+	for (i = 0; i < num; i++)
+	{
+		prepare_io(slots[i]);
+		iocbs[i] = &slots[i]->iocb;
+	}
+	return io_submit(dev->aio_ctx, num, iocbs);
+}
 
-	/* Sort the deferred queue so we can merge more (we hope) */
-	g_ptr_array_sort(dev->deferred, queue_compare);
+#ifdef HAVE_LIBURING
+/* Number of submit slots the ring can accept right now */
+static unsigned uring_capacity(struct device *dev)
+{
+	unsigned space;
+
+	/* Do not let more requests be in flight than the completion ring
+	 * can hold */
+	if (dev->active.length >= dev->uring_depth)
+		return 0;
+	space = dev->uring_depth - dev->active.length;
+	return MIN(space, io_uring_sq_space_left(&dev->uring));
+}
+
+/* Set up the SQE for submission */
+static inline void prepare_uring(struct submit_slot *s)
+{
+	struct device *const dev = s->dev;
+	struct io_uring_sqe *sqe;
+	void *buf;
+	int fd;
 
-	s = NULL;
-	num_iocbs = 0;
-	next_offset = 0ull;
-	req_prep = 0;
+	sqe = io_uring_get_sqe(&dev->uring);
+	fd = dev->uring_fixed_file ? 0 : dev->fd;
+	buf = s->iov[0].iov_base;
 
-	while (1)
+	/* Fixed buffers can only be used for single-segment transfers */
+	if (s->num_iov == 1 && dev->uring_fixed_buf &&
+			packet_in_arena(buf, s->iov[0].iov_len))
 	{
-		/* Add a guard element to force flushing the last slot */
-		if (req_prep < dev->deferred->len)
-			q = g_ptr_array_index(dev->deferred, req_prep);
+		if (s->is_write)
+			io_uring_prep_write_fixed(sqe, fd, buf, s->iov[0].iov_len, s->offset, 0);
 		else
-			q = NULL;
-
-		/* - If there is already an open slot, and
-		 *   - either nothing is left in the queue, or
-		 *   - the next item cannot be merged into the current slot,
-		 * then flush the current slot and open a new one. */
-		if (s && (!q ||
-				q->is_write != s->is_write ||
-				q->offset != next_offset ||
-				s->num_iov >= G_N_ELEMENTS(s->iov)))
-		{
-			prepare_io(s);
-			iocbs[num_iocbs++] = &s->iocb;
-			s = NULL;
+			io_uring_prep_read_fixed(sqe, fd, buf, s->iov[0].iov_len, s->offset, 0);
+	}
+	else if (s->is_write)
+		io_uring_prep_writev(sqe, fd, s->iov, s->num_iov, s->offset);
+	else
+		io_uring_prep_readv(sqe, fd, s->iov, s->num_iov, s->offset);
 
-			/* This is the real exit from the loop */
-			if (!q || num_iocbs >= G_N_ELEMENTS(iocbs))
-				break;
+	if (dev->uring_fixed_file)
+		sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data(sqe, s);
+}
+
+static int submit_uring(struct device *dev, struct submit_slot **slots, unsigned num)
+{
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < num; i++)
+		prepare_uring(slots[i]);
+
+	/* Queued SQEs cannot be taken back. If entering the kernel fails,
+	 * they will be picked up by the next submission */
+	ret = io_uring_submit(&dev->uring);
+	if (ret == -EAGAIN || ret == -EBUSY)
+	{
+		dev->io_stall = TRUE;
+		++dev->stats.queue_stall;
+	}
+	else if (ret < 0)
+		devlog(dev, LOG_ERR, "Failed to submit I/O: %s", strerror(-ret));
+
+	if (dev->uring.flags & IORING_SETUP_IOPOLL)
+		poll_dev(dev);
+	return num;
+}
+#endif
+
+static void submit(struct device *dev)
+{
+	struct submit_slot *slots[EVENT_BATCH];
+	unsigned i, j, num_slots, max_slots;
+	struct io_queue *ioq, *last;
+	struct timespec now, qos_now;
+	int ret, dir, batch_dir;
+	long wait, w;
+
+	max_slots = G_N_ELEMENTS(slots);
+#ifdef HAVE_LIBURING
+	if (dev->uring_ready)
+	{
+		max_slots = MIN(max_slots, uring_capacity(dev));
+		if (!max_slots)
+		{
+			dev->io_stall = TRUE;
+			++dev->stats.queue_stall;
+			return;
 		}
+	}
+#endif
 
-		if (!s)
+	clock_gettime(CLOCK_REALTIME, &now);
+	clock_gettime(CLOCK_MONOTONIC, &qos_now);
+	batch_dir = -1;
+	last = NULL;
+	wait = 0;
+
+	for (num_slots = 0; num_slots < max_slots && dev->run_credit > 0; num_slots++)
+	{
+		w = qos_wait(dev, &dev->qos_bucket, &dev->cfg.qos, &qos_now);
+		if (w)
 		{
-			s = g_slice_new0(struct submit_slot);
-			s->chain.data = s;
-			s->dev = dev;
+			wait = w;
+			break;
+		}
+		ioq = next_queue(dev, &qos_now, &wait);
+		if (!ioq)
+			break;
 
-			s->is_write = q->is_write;
-			next_offset = s->offset = q->offset;
+		/* The deadline scheduler submits a batch in one direction
+		 * from each queue it visits, the others follow the oldest
+		 * request slot by slot */
+		if (ioq != last && dev->cfg.io_scheduler == IO_SCHED_DEADLINE)
+		{
+			batch_dir = deadline_direction(dev, ioq, &now);
+			if (batch_dir)
+				++dev->stats.sched_write_batches;
+			else
+				++dev->stats.sched_read_batches;
 		}
+		last = ioq;
+
+		dir = batch_dir >= 0 ? batch_dir : oldest_direction(ioq);
+		if (dir < 0 || !ioq->deferred[dir].length)
+			break;
+		slots[num_slots] = build_slot(dev, next_request(dev, ioq, dir, &now));
+		dev->run_credit -= slots[num_slots]->num_iov;
+	}
 
-		s->iov[s->num_iov].iov_base = q->buf;
-		s->iov[s->num_iov].iov_len = q->length;
-		s->items[s->num_iov++] = q;
-		next_offset += q->length;
-		++req_prep;
+	if (wait)
+		throttle_dev(dev, wait, &qos_now);
+	else
+		unthrottle_dev(dev, &qos_now);
+	if (!num_slots)
+	{
+		/* Everything is waiting for QoS tokens */
+		dev->is_throttled = TRUE;
+		return;
 	}
 
-	ret = io_submit(dev->aio_ctx, num_iocbs, iocbs);
+#ifdef HAVE_LIBURING
+	if (dev->uring_ready)
+		ret = submit_uring(dev, slots, num_slots);
+	else
+#endif
+		ret = submit_aio(dev, slots, num_slots);
 	if (ret == -EAGAIN)
 	{
-		for (i = 0; i < num_iocbs; i++)
-			g_slice_free(struct submit_slot, iocbs[i]->data);
+		requeue_slots(dev, slots, num_slots);
 		dev->io_stall = TRUE;
 		++dev->stats.queue_stall;
 		return;
@@ -837,59 +1862,138 @@ static void submit(struct device *dev)
 	else if (ret < 0)
 	{
 		devlog(dev, LOG_ERR, "Failed to submit I/O: %s", strerror(-ret));
-		for (i = 0; i < num_iocbs; i++)
-			g_slice_free(struct submit_slot, iocbs[i]->data);
-		for (i = 0; i < req_prep; i++)
+		for (i = 0; i < num_slots; i++)
 		{
-			q = g_ptr_array_index(dev->deferred, i);
-			finish_ata(q, ATA_ABORTED, ATA_DRDY | ATA_ERR);
+			for (j = 0; j < slots[i]->num_iov; j++)
+				finish_ata(slots[i]->items[j], ATA_ABORTED, ATA_DRDY | ATA_ERR);
+			g_slice_free(struct submit_slot, slots[i]);
 		}
-		g_ptr_array_remove_range(dev->deferred, 0, req_prep);
 		return;
 	}
 
 	dev->stats.io_slots += ret;
 	++dev->stats.io_runs;
 
-	/* Add the submitted requests to the active queue */
+	/* Add the submitted requests to the active queue. The kernel may be
+	 * using the RX frames of zero-copy writes now */
 	for (i = 0; i < (unsigned)ret; i++)
 	{
-		s = iocbs[i]->data;
-		g_queue_push_tail_link(&dev->active, &s->chain);
+		g_queue_push_tail_link(&dev->active, &slots[i]->chain);
+		for (j = 0; j < slots[i]->num_iov; j++)
+			rx_submitted(slots[i]->items[j]);
 	}
 
-	/* If not all the requests were submitted, just leave the unsubmitted
-	 * ones in the queue */
-	while (i < num_iocbs)
-	{
-		s = iocbs[i++]->data;
-		req_prep -= s->num_iov;
-		g_slice_free(struct submit_slot, s);
-	}
-	g_ptr_array_remove_range(dev->deferred, 0, req_prep);
+	/* Spin on the completion ring instead of waiting for the eventfd */
+	if (defaults.busy_poll && ret > 0)
+		poll_dev(dev);
+
+	/* If not all the requests were submitted, put the unsubmitted ones
+	 * back to the queue */
+	requeue_slots(dev, slots + i, num_slots - i);
 }
 
 static void run_queue(struct device *dev)
 {
+	struct timespec start, end;
+	long quantum;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* A device that has used up its credit receives the next quantum
+	 * right away instead of waiting for another round; one that could
+	 * not use its credit does not get more */
+	if (dev->run_credit <= 0)
+	{
+		quantum = (long)RUN_QUANTUM * dev->cfg.weight;
+		dev->run_credit = MIN(dev->run_credit + quantum, quantum);
+	}
+
+#ifdef HAVE_LIBURING
+	/* Push out SQEs left over from a failed submission */
+	if (dev->uring_ready && io_uring_sq_ready(&dev->uring))
+		io_uring_submit(&dev->uring);
+#endif
+
 	/* Submit any prepared I/Os */
 	dev->io_stall = FALSE;
-	while (dev->deferred->len && !dev->io_stall)
+	dev->is_throttled = FALSE;
+	while (dev->busy_queues.length && !dev->io_stall && !dev->is_throttled &&
+			dev->run_credit > 0)
 		submit(dev);
+
+	if (!dev->busy_queues.length)
+	{
+		/* An idle device does not save up credit */
+		if (dev->run_credit > 0)
+			dev->run_credit = 0;
+	}
+	else if (dev->run_credit <= 0 && !dev->io_stall && !dev->is_throttled &&
+			!dev->is_active)
+	{
+		/* Continue after the other active devices had their turn */
+		++dev->stats.run_over_budget;
+		g_queue_push_tail_link(&dev->worker->active_devs, &dev->chain);
+		dev->is_active = TRUE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	timespec_sub(&end, &start, &end);
+	timespec_add(&dev->stats.run_time, &end, &dev->stats.run_time);
+	++dev->stats.run_visits;
 }
 
+/* Give every active device a turn to submit requests, in proportion to
+ * its weight. Devices running out of credit go to the back of the list,
+ * and continue in the next round, after the network had a chance to be
+ * serviced */
 void run_devices(void)
 {
+	unsigned n;
 	GList *l;
 
-	while ((l = g_queue_pop_head_link(&active_devs)))
+	for (n = current_worker->active_devs.length; n; n--)
 	{
-		struct device *dev = l->data;
+		struct device *dev;
 
+		l = g_queue_pop_head_link(&current_worker->active_devs);
+		dev = l->data;
 		dev->is_active = FALSE;
 		run_queue(dev);
 	}
 }
 
+/* Check if an active device of a worker has requests it can submit now.
+ * Stalled devices wait for their completions instead */
+int devices_runnable(const struct worker *w)
+{
+	const struct device *dev;
+	GList *l;
+
+	for (l = w->active_devs.head; l; l = l->next)
+	{
+		dev = l->data;
+		if (dev->busy_queues.length && !dev->io_stall)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Reap the completions of devices using polled I/O */
+void poll_devices(void)
+{
+	GList *l, *next;
+
+	for (l = current_worker->polled_devs.head; l; l = next)
+	{
+		struct device *dev = l->data;
+
+		next = l->next;
+		dev_io(0, dev);
+		if (!dev->active.length)
+			unpoll_dev(dev);
+	}
+}
+
 static void ata_rw(struct queue_item *q)
 {
 	struct device *const dev = q->dev;
@@ -933,7 +2037,7 @@ static void ata_rw(struct queue_item *q)
 
 	/* If there are any deferred requests, then mark the device as active
 	 * to ensure run_queue() will get called */
-	g_ptr_array_add(dev->deferred, q);
+	queue_deferred(dev, q);
 	activate_dev(dev);
 }
 
@@ -1246,6 +2350,7 @@ static void do_macmask_cmd(struct device *dev, struct queue_item *q)
 
 		/* Make sure the changes eventually hit the disk */
 		msync(dev->mac_mask, sizeof(*dev->mac_mask), MS_ASYNC);
+		refresh_filters(dev);
 		if (i < q->mask_hdr.dcnt)
 		{
 			q->mask_hdr.dcnt = i;
@@ -1332,6 +2437,10 @@ void process_request(struct netif *iface, struct device *dev, void *buf,
 	const struct aoe_hdr *pkt = buf;
 	struct queue_item *q;
 
+	/* Devices owned by a worker thread get a copy of the request */
+	if (dev->worker != current_worker)
+		return hand_over_request(iface, dev, buf, len, tv);
+
 	/* Check the ACLs */
 	if (dev->cfg.accept && !match_acl(dev->cfg.accept, &pkt->addr.ether_shost))
 		return;
@@ -1341,6 +2450,9 @@ void process_request(struct netif *iface, struct device *dev, void *buf,
 	if (dev->mac_mask->length && !match_acl(dev->mac_mask, &pkt->addr.ether_shost))
 		return;
 
+	if (dev->cfg.multipath)
+		learn_path(dev, iface, &pkt->addr.ether_shost);
+
 	q = queue_get(dev, iface, buf, len, tv);
 
 	if (pkt->cmd > G_N_ELEMENTS(aoe_cmds) || !aoe_cmds[pkt->cmd].header_length)
@@ -1361,8 +2473,9 @@ void process_request(struct netif *iface, struct device *dev, void *buf,
 
 	memcpy(&q->ata_hdr, q->buf, aoe_cmds[pkt->cmd].header_length);
 	q->hdrlen = aoe_cmds[pkt->cmd].header_length;
+	q->bufsize = request_bufsize(q);
 
-	if (clone_pkt(q))
+	if (!hold_frame(dev, q) && clone_pkt(q))
 		return drop_request(q);
 
 	if (G_UNLIKELY(dev->cfg.trace_io))
@@ -1400,6 +2513,10 @@ void send_advertisment(struct device *dev, struct netif *iface)
 	struct ether_addr mac;
 	unsigned i;
 
+	/* Let the owner of the device send it */
+	if (dev->worker != current_worker)
+		return hand_over_request(iface, dev, NULL, 0, NULL);
+
 	if (!dev->cfg.accept || !dev->cfg.accept->length || dev->cfg.broadcast)
 	{
 		/* If there is no accept list, send a broadcast */
@@ -1436,6 +2553,7 @@ void attach_device(void *data, void *user_data)
 
 	g_ptr_array_add(iface->devices, dev);
 	g_ptr_array_add(dev->ifaces, iface);
+	index_device(iface, dev);
 
 	send_advertisment(dev, iface);
 }
@@ -1443,8 +2561,9 @@ void attach_device(void *data, void *user_data)
 void detach_device(struct netif *iface, struct device *dev)
 {
 	struct submit_slot *s;
+	struct io_queue *ioq;
 	struct queue_item *q;
-	GList *l;
+	GList *k, *l;
 	unsigned i;
 
 	for (l = dev->active.head; l; l = l->next)
@@ -1454,38 +2573,196 @@ void detach_device(struct netif *iface, struct device *dev)
 			if (s->items[i]->iface == iface)
 				s->items[i]->iface = NULL;
 	}
-	for (i = 0; i < dev->deferred->len; i++)
+	for (k = dev->busy_queues.head; k; k = k->next)
+	{
+		ioq = k->data;
+		for (i = 0; i < G_N_ELEMENTS(ioq->deferred); i++)
+			for (l = ioq->deferred[i].head; l; l = l->next)
+			{
+				q = l->data;
+				if (q->iface == iface)
+					q->iface = NULL;
+			}
+	}
+	for (i = iface->deferred_head; i != iface->deferred_tail; i++)
 	{
-		q = g_ptr_array_index(dev->deferred, i);
-		if (q->iface == iface)
-			q->iface = NULL;
+		q = iface->deferred[i & (DEFERRED_LEN - 1)];
+		if (q->dev == dev)
+		{
+			q->dev = NULL;
+			--dev->queue_length;
+		}
 	}
-	for (i = 0; i < iface->deferred->len; i++)
+	for (i = 0; i < iface->tx_batch_len; i++)
 	{
-		q = g_ptr_array_index(iface->deferred, i);
+		q = iface->tx_batch[i];
 		if (q->dev == dev)
 		{
 			q->dev = NULL;
 			--dev->queue_length;
 		}
 	}
+	if (dev->worker != &main_worker)
+	{
+		struct worker_tx *wtx = &iface->wtx[dev->worker->index];
+
+		for (i = 0; i < wtx->batch_len; i++)
+		{
+			q = wtx->batch[i];
+			if (q->dev == dev)
+			{
+				q->dev = NULL;
+				--dev->queue_length;
+			}
+		}
+		for (i = wtx->deferred_head; i != wtx->deferred_tail; i++)
+		{
+			q = wtx->deferred[i & (DEFERRED_LEN - 1)];
+			if (q->dev == dev)
+			{
+				q->dev = NULL;
+				--dev->queue_length;
+			}
+		}
+		forget_handed_over(iface, dev);
+	}
 
+	g_hash_table_foreach(dev->initiators, forget_path, iface);
+	unindex_device(iface, dev);
 	g_ptr_array_remove(iface->devices, dev);
 	g_ptr_array_remove(dev->ifaces, iface);
+	update_filter(iface);
+}
+
+/* Give a request that does not use the kernel yet a private buffer instead
+ * of a ring frame. Returns FALSE if the buffer can not be allocated */
+int unshare_buffer(struct queue_item *q, const struct netif *iface)
+{
+	void *buf;
+
+	if (q->tx_zero_copy && q->tx_iface == iface)
+	{
+		buf = alloc_packet(q->bufsize);
+		if (!buf)
+			return FALSE;
+		q->tx_zero_copy = FALSE;
+		q->tx_iface = NULL;
+		q->buf = buf;
+		q->dynalloc = TRUE;
+	}
+	if (q->rx_zero_copy && q->rx_iface == iface)
+	{
+		buf = alloc_packet(q->bufsize);
+		if (!buf)
+			return FALSE;
+		memcpy(buf, q->buf, q->length);
+		rx_release(q);
+		q->buf = buf;
+		q->dynalloc = TRUE;
+	}
+	return TRUE;
+}
+
+/* Called when the rings of an interface are destroyed. Requests with I/O in
+ * progress using the rings can not be answered */
+void forget_ring_frames(struct netif *iface)
+{
+	struct submit_slot *s;
+	struct io_queue *ioq;
+	struct queue_item *q;
+	struct device *dev;
+	unsigned i, j, n;
+	GList *k, *l, *next_k, *next_l;
+
+	for (i = 0; i < devices->len; i++)
+	{
+		dev = g_ptr_array_index(devices, i);
+
+		for (l = dev->active.head; l; l = l->next)
+		{
+			s = l->data;
+			for (j = 0; j < s->num_iov; j++)
+			{
+				q = s->items[j];
+				if (q->tx_iface == iface)
+					q->tx_iface = NULL;
+				if (q->rx_iface == iface)
+					q->rx_iface = NULL;
+			}
+		}
+
+		/* Requests that can not get a buffer of their own are lost
+		 * together with the ring, so drop them */
+		for (k = dev->busy_queues.head; k; k = next_k)
+		{
+			next_k = k->next;
+			ioq = k->data;
+			for (j = 0; j < G_N_ELEMENTS(ioq->deferred); j++)
+				for (l = ioq->deferred[j].head; l; l = next_l)
+				{
+					next_l = l->next;
+					q = l->data;
+					if (unshare_buffer(q, iface))
+						continue;
+					unqueue_deferred(dev, q);
+					drop_request(q);
+				}
+		}
+	}
+
+	n = iface->deferred_head;
+	for (j = iface->deferred_head; j != iface->deferred_tail; j++)
+	{
+		q = iface->deferred[j & (DEFERRED_LEN - 1)];
+		if (unshare_buffer(q, iface))
+			iface->deferred[n++ & (DEFERRED_LEN - 1)] = q;
+		else
+		{
+			++iface->stats.dropped;
+			drop_request(q);
+		}
+	}
+	iface->deferred_tail = n;
 }
 
 static void invalidate_device(struct device *dev)
 {
+	struct io_queue *ioq;
+	struct queue_item *q;
 	struct io_event ev;
-	unsigned i;
 	GList *l;
 
 	devlog(dev, LOG_DEBUG, "Shutting down");
 
-	for (i = 0; i < dev->deferred->len; i++)
-		drop_request(g_ptr_array_index(dev->deferred, i));
-	if (dev->deferred->len)
-		g_ptr_array_remove_range(dev->deferred, 0, dev->deferred->len);
+	while ((ioq = g_queue_peek_head(&dev->busy_queues)))
+	{
+		q = g_queue_peek_head(&ioq->deferred[oldest_direction(ioq)]);
+		unqueue_deferred(dev, q);
+		drop_request(q);
+	}
+
+#ifdef HAVE_LIBURING
+	/* The kernel may still be using the buffers of in-flight requests,
+	 * so wait for them to finish */
+	if (dev->uring_ready)
+		io_uring_submit(&dev->uring);
+	while (dev->uring_ready && dev->active.length)
+	{
+		struct io_uring_cqe *cqe;
+		struct submit_slot *s;
+		unsigned i;
+
+		if (io_uring_wait_cqe(&dev->uring, &cqe))
+			break;
+		s = io_uring_cqe_get_data(cqe);
+		io_uring_cqe_seen(&dev->uring, cqe);
+
+		g_queue_unlink(&dev->active, &s->chain);
+		for (i = 0; i < s->num_iov; i++)
+			drop_request(s->items[i]);
+		g_slice_free(struct submit_slot, s);
+	}
+#endif
 
 	while ((l = g_queue_pop_head_link(&dev->active)))
 	{
@@ -1502,6 +2779,7 @@ static void invalidate_device(struct device *dev)
 		detach_device(g_ptr_array_index(dev->ifaces, 0), dev);
 
 	deactivate_dev(dev);
+	unpoll_dev(dev);
 	/* Careful: the caller may be iterating over devices */
 	g_ptr_array_remove(devices, dev);
 	free_dev(dev);
@@ -1520,7 +2798,7 @@ void setup_devices(void)
 	for (i = 0; i < devices->len;)
 	{
 		dev = g_ptr_array_index(devices, i);
-		if (!g_key_file_has_group(global_config, dev->name))
+		if (!is_local_device(dev->name))
 			invalidate_device(dev);
 		else
 			i++;
@@ -1531,10 +2809,12 @@ void setup_devices(void)
 	for (i = 0; groups[i]; i++)
 	{
 		/* Skip special groups */
-		if (!strcmp(groups[i], "defaults") || !strcmp(groups[i], "acls"))
+		if (!strcmp(groups[i], "defaults") || !strcmp(groups[i], "acls") ||
+				!strcmp(groups[i], "qos"))
 			continue;
 
-		if (!g_key_file_has_key(global_config, groups[i], "shelf", NULL))
+		/* Devices of other instances are served by other processes */
+		if (!is_local_device(groups[i]))
 			continue;
 
 		/* Check if a device with the same name already exists */
@@ -409,6 +409,16 @@ static void dump_devstats(const struct msg_devstat *stats, unsigned length)
 	PRINT32(queue_over);
 	PRINT32(ata_err);
 	PRINT32(proto_err);
+	PRINT64(steered);
+	PRINT32(sched_expired);
+	PRINT32(sched_read_batches);
+	PRINT32(sched_write_batches);
+	PRINT32(sched_writes_starved);
+	PRINT32(qos_throttled);
+	PRINTtime(qos_throttle_time);
+	PRINT64(run_visits);
+	PRINTtime(run_time);
+	PRINT32(run_over_budget);
 }
 
 static void dump_netstats(const struct msg_netstat *stats, unsigned length)
@@ -429,6 +439,15 @@ static void dump_netstats(const struct msg_netstat *stats, unsigned length)
 	PRINT32(dropped);
 	PRINT32(ignored);
 	PRINT32(broadcast);
+	PRINT64(tx_zero_copy);
+	PRINT64(rx_zero_copy);
+	PRINT32(rx_ring_max);
+	PRINT32(tx_ring_max);
+	PRINT64(tx_kick_frames);
+	PRINT32(tx_kick_max);
+	PRINT32(tx_kick_timer);
+	PRINT32(worker_queue_full);
+	PRINT32(rx_paused);
 }
 
 static void do_dump_stats(int argc, char **argv)
@@ -622,10 +641,65 @@ static void do_get_maclist(int cmd, int argc, char **argv)
 	} while (1);
 }
 
+static void dump_initiator(struct msg_initiator *msg, unsigned len, char **last)
+{
+	if (len < sizeof(*msg) + 1)
+	{
+		fprintf(stderr, "Short read\n");
+		exit(1);
+	}
+
+	/* Initiators of the same device arrive one after the other */
+	if (!*last || strncmp(*last, msg->name, len - sizeof(*msg)))
+	{
+		if (*last)
+			putchar('\n');
+		g_free(*last);
+		*last = g_strndup(msg->name, len - sizeof(*msg));
+		printf("Device %s:\n", *last);
+	}
+
+	printf("%s queued %" PRIu32 " paths %" PRIu32 " requests %" PRIu64
+		" bytes %" PRIu64 "\n", print_eth(&msg->stats.addr.e),
+		msg->stats.queue_length, msg->stats.paths, msg->stats.io_cnt,
+		msg->stats.io_bytes);
+}
+
+static void do_get_initiators(int argc, char **argv)
+{
+	char *last = NULL;
+	unsigned len;
+	void *msg;
+
+	send_command(CTL_CMD_GET_INITIATORS, argv);
+
+	do {
+		len = receive_msg(&msg);
+		if (len < 4)
+			break;
+
+		uint32_t *type = msg;
+		if (*type == CTL_MSG_OK)
+		{
+			g_free(msg);
+			break;
+		}
+		if (*type != CTL_MSG_INITIATOR)
+		{
+			fprintf(stderr, "Unexpected message\n");
+			break;
+		}
+		dump_initiator(msg, len, &last);
+		g_free(msg);
+	} while (1);
+	g_free(last);
+}
+
 static struct option longopts[] =
 {
 	{ "config",	required_argument,	NULL, 'c' },
 	{ "help",	no_argument,		NULL, 'h' },
+	{ "instance",	required_argument,	NULL, 'i' },
 	{ "version",	no_argument,		NULL, 'V' },
 	{ NULL }
 };
@@ -637,6 +711,7 @@ static void usage(const char *prog, int error)
 	printf("Valid options:\n");
 	printf("\t-c FILE, --config FILE\tUse the specified config. file\n");
 	printf("\t-h, --help\t\tThis help text\n");
+	printf("\t-i NAME, --instance NAME\tTalk to the given daemon instance\n");
 	printf("\t-V, --version\t\tPrint the version number and exit\n");
 	printf("Valid commands:\n");
 	printf("\treload\t\t\t\tReload the configuration file\n");
@@ -645,6 +720,7 @@ static void usage(const char *prog, int error)
 	printf("\tshow-config [name...]\t\tShow the AoE configuration info\n");
 	printf("\tshow-macmask [name...]\t\tShow the AoE MAC Mask list\n");
 	printf("\tshow-reserve [name...]\t\tShow the AoE Reserve list\n");
+	printf("\tshow-initiators [name...]\tShow the initiators of devices\n");
 	printf("\tclear-stats name [name...]\tClear device/interface statistics\n");
 	printf("\tclear-config name [name...]\tClear the AoE configuration info\n");
 	printf("\tclear-macmask name [name...]\tClear the AoE MAC Mask list\n");
@@ -664,7 +740,7 @@ static void signal_handler(int sig G_GNUC_UNUSED)
 
 int main(int argc, char **argv)
 {
-	char *config_file = CONFIG_LOCATION, *ctl_socket;
+	char *config_file = CONFIG_LOCATION, *instance = NULL, *ctl_socket, *str;
 	struct msg_hello *hello;
 	struct sockaddr_un sun;
 	struct sigaction sig;
@@ -685,6 +761,9 @@ int main(int argc, char **argv)
 				break;
 			case 'h':
 				usage(argv[0], 0);
+			case 'i':
+				instance = optarg;
+				break;
 			case 'V':
 				printf("%s\n", PACKAGE_STRING);
 				exit(0);
@@ -714,9 +793,9 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	ctl_socket = g_key_file_get_string(config, "defaults", "control-socket", NULL);
-	if (!ctl_socket)
-		ctl_socket = g_strdup(SOCKET_LOCATION);
+	str = g_key_file_get_string(config, "defaults", "control-socket", NULL);
+	ctl_socket = instance_path(str ? str : SOCKET_LOCATION, instance);
+	g_free(str);
 
 	ctl_fd = socket(PF_UNIX, SOCK_DGRAM, 0);
 	if (ctl_fd == -1)
@@ -776,6 +855,8 @@ int main(int argc, char **argv)
 		do_get_maclist(CTL_CMD_GET_MACMASK, argc - 1, argv + 1);
 	else if (!strcmp(argv[0], "show-reserve"))
 		do_get_maclist(CTL_CMD_GET_RESERVE, argc - 1, argv + 1);
+	else if (!strcmp(argv[0], "show-initiators"))
+		do_get_initiators(argc - 1, argv + 1);
 	else if (!strcmp(argv[0], "clear-stats"))
 		do_clear(CTL_CMD_CLEAR_STATS, argc - 1, argv + 1);
 	else if (!strcmp(argv[0], "clear-config"))
@@ -28,6 +28,7 @@
 
 #define GRP_DEFAULTS		"defaults"
 #define GRP_ACLS		"acls"
+#define GRP_QOS			"qos"
 
 #define STATEDIR		LOCALSTATEDIR "/lib/ggaoed"
 
@@ -47,9 +48,6 @@ GKeyFile *global_config;
 /* Configuration defaults */
 struct default_config defaults;
 
-/* epoll control file descriptor */
-static int efd = -1;
-
 /* If true, messages go to syslog, otherwise to stderr */
 static int use_syslog;
 
@@ -62,6 +60,9 @@ static char *pid_file;
 /* If true, don't fork to the background */
 static int nofork_flag;
 
+/* Name of this instance if several daemons share the config file */
+static char *instance_name;
+
 /* If true, enable debug mode */
 static int debug_flag;
 
@@ -74,6 +75,43 @@ struct timespec startup;
 /* True if PACKET_TX_RING is buggy */
 static int tx_ring_bug;
 
+/* Names of the I/O engines in the configuration file */
+static const char *const io_engines[] =
+{
+	[IO_ENGINE_AIO] = "aio",
+	[IO_ENGINE_URING] = "uring",
+	NULL
+};
+
+static const char *const io_schedulers[] =
+{
+	[IO_SCHED_FIFO] = "fifo",
+	[IO_SCHED_OFFSET] = "offset",
+	[IO_SCHED_DEADLINE] = "deadline",
+	NULL
+};
+
+static const char *const transports[] =
+{
+	[TRANSPORT_PACKET] = "packet",
+	[TRANSPORT_XDP] = "xdp",
+	NULL
+};
+
+static const char *const rx_fanouts[] =
+{
+	[RX_FANOUT_QUEUE] = "queue",
+	[RX_FANOUT_CPU] = "cpu",
+	NULL
+};
+
+static const char *const worker_modes[] =
+{
+	[WORKER_MODE_SHARD] = "shard",
+	[WORKER_MODE_PIPELINE] = "pipeline",
+	NULL
+};
+
 
 /**********************************************************************
  * Generic helpers
@@ -130,17 +168,27 @@ unsigned long long human_format(unsigned long long size, const char **unit)
  * Event loop
  */
 
-void add_fd(int fd, struct event_ctx *ctx)
+void add_worker_fd(struct worker *w, int fd, struct event_ctx *ctx)
 {
 	struct epoll_event event;
 
 	memset(&event, 0, sizeof(event));
 	event.events = EPOLLIN;
 	event.data.ptr = ctx;
-	if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event))
+	if (epoll_ctl(w->efd, EPOLL_CTL_ADD, fd, &event))
 		logerr("Failed to watch fd");
 }
 
+void del_worker_fd(struct worker *w, int fd)
+{
+	epoll_ctl(w->efd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void add_fd(int fd, struct event_ctx *ctx)
+{
+	add_worker_fd(&main_worker, fd, ctx);
+}
+
 void modify_fd(int fd, struct event_ctx *ctx, uint32_t events)
 {
 	struct epoll_event event;
@@ -148,51 +196,110 @@ void modify_fd(int fd, struct event_ctx *ctx, uint32_t events)
 	memset(&event, 0, sizeof(event));
 	event.events = events;
 	event.data.ptr = ctx;
-	if (epoll_ctl(efd, EPOLL_CTL_MOD, fd, &event))
+	if (epoll_ctl(main_worker.efd, EPOLL_CTL_MOD, fd, &event))
 		logerr("EPOLL_CTL_MOD failed");
 }
 
+/* Change the events a worker polls the fd for, and start watching the fd
+ * if it is not watched yet */
+void watch_worker_fd(struct worker *w, int fd, struct event_ctx *ctx, uint32_t events)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.ptr = ctx;
+	if (!epoll_ctl(w->efd, EPOLL_CTL_MOD, fd, &event))
+		return;
+	if (errno != ENOENT || epoll_ctl(w->efd, EPOLL_CTL_ADD, fd, &event))
+		logerr("Failed to watch fd");
+}
+
 void del_fd(int fd)
 {
-	epoll_ctl(efd, EPOLL_CTL_DEL, fd, NULL);
+	del_worker_fd(&main_worker, fd);
 }
 
 static void event_init(void)
 {
-	efd = epoll_create(32);
-	if (efd < 0)
+	main_worker.efd = epoll_create(32);
+	if (main_worker.efd < 0)
 	{
 		logerr("Failed to create the epoll fd");
 		exit_flag = 1;
 	}
 }
 
+/* Check if busy polling should go on */
+static int busy_polling(const struct timespec *last_work)
+{
+	struct timespec now, idle;
+
+	if (!defaults.busy_poll)
+		return FALSE;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespec_sub(&now, last_work, &idle);
+	return idle.tv_sec == 0 && idle.tv_nsec < defaults.busy_poll * NSEC_PER_SEC;
+}
+
 static void event_run(void)
 {
 	struct epoll_event events[16];
+	struct timespec last_work;
 	struct event_ctx *ctx;
-	int ret, i;
+	int ret, i, timeout, busy, spins;
 
+	clock_gettime(CLOCK_MONOTONIC, &last_work);
+	spins = 0;
 	while (!exit_flag && !reload_flag)
 	{
-		ret = epoll_wait(efd, events, G_N_ELEMENTS(events), 10000);
-		if (ret == -1)
+		busy = busy_polling(&last_work);
+
+		/* When busy polling, look at the receive rings directly, and
+		 * only ask epoll about the other descriptors if there was
+		 * nothing to do or it has been a while */
+		if (busy && spins < BUSY_POLL_SPINS && poll_ifaces())
 		{
-			if (errno == EINTR)
-				return;
-			logerr("epoll_wait() failed");
-			exit_flag = 1;
-			return;
+			++spins;
+			ret = 0;
 		}
-		for (i = 0; i < ret; i++)
+		else
 		{
-			ctx = events[i].data.ptr;
-			ctx->callback(events[i].events, ctx->data);
+			spins = 0;
+			/* Completions of polled I/O are not signalled, so do
+			 * not sleep while such requests are in flight, or
+			 * while devices have requests to submit */
+			timeout = main_worker.polled_devs.head ||
+				devices_runnable(&main_worker) || busy ? 0 : 10000;
+			ret = epoll_wait(main_worker.efd, events, G_N_ELEMENTS(events), timeout);
+			if (ret == -1)
+			{
+				if (errno == EINTR)
+					return;
+				logerr("epoll_wait() failed");
+				exit_flag = 1;
+				return;
+			}
+			for (i = 0; i < ret; i++)
+			{
+				ctx = events[i].data.ptr;
+				ctx->callback(events[i].events, ctx->data);
+			}
 		}
-		if (active_devs.head)
+
+		/* Any work restarts the busy polling period */
+		if (defaults.busy_poll && (ret || spins || main_worker.polled_devs.head))
+			clock_gettime(CLOCK_MONOTONIC, &last_work);
+
+		if (main_worker.polled_devs.head)
+			poll_devices();
+		if (main_worker.active_devs.head)
 			run_devices();
 		if (active_ifaces.head)
 			run_ifaces();
+		if (nworkers)
+			run_workers();
 	}
 }
 
@@ -392,6 +499,145 @@ error:
 	return FALSE;
 }
 
+static void free_qos_class(struct qos_class *cls)
+{
+	g_free(cls->name);
+	if (cls->match)
+		g_slice_free(struct acl_map, cls->match);
+	g_slice_free(struct qos_class, cls);
+}
+
+static struct qos_class *lookup_qos_class(const char *name)
+{
+	struct qos_class *cls;
+	unsigned i;
+
+	for (i = 0; i < defaults.qos_classes->len; i++)
+	{
+		cls = g_ptr_array_index(defaults.qos_classes, i);
+		if (!strcmp(cls->name, name))
+			return cls;
+	}
+	return NULL;
+}
+
+/* Unless specified otherwise, allow bursts of 100ms worth of tokens */
+static void finish_qos_limit(struct qos_limit *limit)
+{
+	if (limit->iops && !limit->iops_burst)
+		limit->iops_burst = MAX(limit->iops / 10, 1);
+	if (limit->bandwidth && !limit->bandwidth_burst)
+		limit->bandwidth_burst = MAX(limit->bandwidth / 10, 1);
+}
+
+/* Parse the elements of a QoS class. Every element is a keyword followed
+ * by a value: "iops N", "iops-burst N", "bandwidth N" (KiB/s),
+ * "bandwidth-burst N" (KiB), or "match ADDRESS", where ADDRESS is
+ * resolved the same way as ACL elements */
+static int parse_qos_class(struct qos_class *cls, char **values)
+{
+	char *key, *arg, *end;
+	GPtrArray *match;
+	unsigned j;
+	long val;
+	int ret;
+
+	ret = TRUE;
+	match = g_ptr_array_new();
+	for (j = 0; values[j]; j++)
+	{
+		key = g_strstrip(values[j]);
+		arg = key + strcspn(key, " \t");
+		if (*arg)
+			*arg++ = '\0';
+		while (isspace(*arg))
+			arg++;
+
+		if (!strcmp(key, "match"))
+		{
+			g_ptr_array_add(match, arg);
+			continue;
+		}
+
+		val = strtol(arg, &end, 10);
+		if (!*arg || *end || val < 0 || val > G_MAXINT)
+		{
+			logit(LOG_ERR, "QoS class %s: Invalid value for '%s'", cls->name, key);
+			ret = FALSE;
+		}
+		else if (!strcmp(key, "iops"))
+			cls->limit.iops = val;
+		else if (!strcmp(key, "iops-burst"))
+			cls->limit.iops_burst = val;
+		else if (!strcmp(key, "bandwidth"))
+			cls->limit.bandwidth = val * 1024;
+		else if (!strcmp(key, "bandwidth-burst"))
+			cls->limit.bandwidth_burst = val * 1024;
+		else
+		{
+			logit(LOG_ERR, "QoS class %s: Unknown setting '%s'", cls->name, key);
+			ret = FALSE;
+		}
+	}
+
+	if (match->len)
+	{
+		g_ptr_array_add(match, NULL);
+		resolve_acls(&cls->match, (char **)match->pdata, cls->name);
+		if (!cls->match)
+		{
+			logit(LOG_ERR, "QoS class %s: No initiator matches", cls->name);
+			ret = FALSE;
+		}
+	}
+	g_ptr_array_free(match, TRUE);
+
+	finish_qos_limit(&cls->limit);
+	return ret;
+}
+
+static int parse_qos_classes(GKeyFile *config)
+{
+	struct qos_class *cls;
+	char **keys, **values;
+	GError *error;
+	unsigned i;
+	int ret;
+
+	defaults.qos_classes = g_ptr_array_new();
+
+	keys = g_key_file_get_keys(config, GRP_QOS, NULL, NULL);
+	if (!keys)
+		return TRUE;
+
+	ret = TRUE;
+	for (i = 0; keys[i]; i++)
+	{
+		error = NULL;
+		values = g_key_file_get_string_list(config, GRP_QOS, keys[i], NULL, &error);
+		if (error)
+		{
+			logit(LOG_ERR, "Failed to parse QoS class %s: %s", keys[i], error->message);
+			g_error_free(error);
+			ret = FALSE;
+			continue;
+		}
+
+		cls = g_slice_new0(struct qos_class);
+		cls->name = g_strdup(keys[i]);
+		if (parse_qos_class(cls, values))
+			g_ptr_array_add(defaults.qos_classes, cls);
+		else
+		{
+			free_qos_class(cls);
+			ret = FALSE;
+		}
+		g_strfreev(values);
+	}
+	g_strfreev(keys);
+	return ret;
+}
+
 /* Match a MAC address against an ACL map */
 int match_acl(const struct acl_map *acls, const void *mac)
 {
@@ -530,6 +776,36 @@ static int parse_double(GKeyFile *config, const char *section, const char *name,
 	return TRUE;
 }
 
+/* Parse a string option that must be one of the listed values */
+static int parse_enum(GKeyFile *config, const char *section, const char *name,
+		const char *const *values, int *val, int defval)
+{
+	char *str;
+	int i;
+
+	str = g_key_file_get_string(config, section, name, NULL);
+	if (!str)
+	{
+		*val = defval;
+		return TRUE;
+	}
+
+	g_strstrip(str);
+	for (i = 0; values[i]; i++)
+		if (!strcmp(values[i], str))
+			break;
+	if (!values[i])
+	{
+		logit(LOG_ERR, "%s: Invalid value '%s' for '%s'", section, str, name);
+		g_free(str);
+		return FALSE;
+	}
+
+	*val = i;
+	g_free(str);
+	return TRUE;
+}
+
 static void destroy_defaults(struct default_config *defcfg)
 {
 	free_patternlist(defcfg->interfaces);
@@ -544,6 +820,16 @@ static void destroy_defaults(struct default_config *defcfg)
 		g_ptr_array_free(defcfg->acls, TRUE);
 	}
 
+	if (defcfg->qos_classes)
+	{
+		while (defcfg->qos_classes->len)
+		{
+			free_qos_class(g_ptr_array_index(defcfg->qos_classes, 0));
+			g_ptr_array_remove_index_fast(defcfg->qos_classes, 0);
+		}
+		g_ptr_array_free(defcfg->qos_classes, TRUE);
+	}
+
 	g_free(defcfg->pid_file);
 	g_free(defcfg->ctl_socket);
 	g_free(defcfg->statedir);
@@ -559,9 +845,39 @@ static int delay_valid(double val)
 	return val >= 0.0 && val < 1.0;
 }
 
+/* 0 disables fairness, larger values are bytes per round */
+static int quantum_valid(int val)
+{
+	return val >= 0 && val <= 16 * 1024 * 1024;
+}
+
+static int io_engine_valid(const char *section, int engine)
+{
+#ifndef HAVE_LIBURING
+	if (engine == IO_ENGINE_URING)
+	{
+		logit(LOG_ERR, "%s: io_uring support is not compiled in", section);
+		return FALSE;
+	}
+#endif
+	return TRUE;
+}
+
+static int transport_valid(const char *section, int transport)
+{
+#ifndef HAVE_LINUX_IF_XDP_H
+	if (transport == TRANSPORT_XDP)
+	{
+		logit(LOG_ERR, "%s: XDP support is not compiled in", section);
+		return FALSE;
+	}
+#endif
+	return TRUE;
+}
+
 static int parse_defaults(GKeyFile *config)
 {
-	char **patterns;
+	char **patterns, *str;
 	struct stat st;
 	int ret;
 
@@ -581,12 +897,12 @@ static int parse_defaults(GKeyFile *config)
 	if (debug_flag)
 		defaults.trace_io = TRUE;
 
-	defaults.pid_file = g_key_file_get_string(config, GRP_DEFAULTS, "pid-file", NULL);
-	if (!defaults.pid_file)
-		defaults.pid_file = g_strdup(PIDFILE_LOCATION);
-	defaults.ctl_socket = g_key_file_get_string(config, GRP_DEFAULTS, "control-socket", NULL);
-	if (!defaults.ctl_socket)
-		defaults.ctl_socket = g_strdup(SOCKET_LOCATION);
+	str = g_key_file_get_string(config, GRP_DEFAULTS, "pid-file", NULL);
+	defaults.pid_file = instance_path(str ? str : PIDFILE_LOCATION, instance_name);
+	g_free(str);
+	str = g_key_file_get_string(config, GRP_DEFAULTS, "control-socket", NULL);
+	defaults.ctl_socket = instance_path(str ? str : SOCKET_LOCATION, instance_name);
+	g_free(str);
 	defaults.statedir = g_key_file_get_string(config, GRP_DEFAULTS, "state-directory", NULL);
 	if (!defaults.statedir)
 		defaults.statedir = g_strdup(STATEDIR);
@@ -604,6 +920,11 @@ static int parse_defaults(GKeyFile *config)
 		logit(LOG_ERR, "%s: Requested MTU is too small", GRP_DEFAULTS);
 		return FALSE;
 	}
+	if (ret && defaults.mtu > MAX_MTU)
+	{
+		logit(LOG_ERR, "%s: Requested MTU is too large", GRP_DEFAULTS);
+		return FALSE;
+	}
 	if (g_key_file_has_key(config, GRP_DEFAULTS, "buffers", NULL))
 		logit(LOG_WARNING, "%s: 'buffers' is obsolete. Use 'ring-buffer-size' instead",
 			GRP_DEFAULTS);
@@ -613,6 +934,16 @@ static int parse_defaults(GKeyFile *config)
 		logit(LOG_ERR, "%s: Requested ring buffer size is invalid", GRP_DEFAULTS);
 		return FALSE;
 	}
+	ret &= parse_flag(config, GRP_DEFAULTS, "ring-auto-size", &defaults.ring_auto_size, FALSE);
+	ret &= parse_int(config, GRP_DEFAULTS, "ring-buffer-min-size", &defaults.ring_min_size,
+		DEF_RING_MIN_SIZE);
+	ret &= parse_int(config, GRP_DEFAULTS, "ring-buffer-max-size", &defaults.ring_max_size,
+		DEF_RING_MAX_SIZE);
+	if (ret && (defaults.ring_min_size <= 0 || defaults.ring_max_size < defaults.ring_min_size))
+	{
+		logit(LOG_ERR, "%s: Invalid ring buffer size limits", GRP_DEFAULTS);
+		return FALSE;
+	}
 
 	ret &= parse_int(config, GRP_DEFAULTS, "send-buffer-size", &defaults.send_buf_size, 0);
 	if (ret && defaults.send_buf_size < 0)
@@ -629,6 +960,30 @@ static int parse_defaults(GKeyFile *config)
 	}
 
 	ret &= parse_flag(config, GRP_DEFAULTS, "tx-ring-bug", &defaults.tx_ring_bug, tx_ring_bug);
+	ret &= parse_flag(config, GRP_DEFAULTS, "zero-copy-read", &defaults.zero_copy_read, FALSE);
+	ret &= parse_flag(config, GRP_DEFAULTS, "zero-copy-write", &defaults.zero_copy_write, FALSE);
+	ret &= parse_flag(config, GRP_DEFAULTS, "rx-ring-v3", &defaults.rx_ring_v3, FALSE);
+	ret &= parse_int(config, GRP_DEFAULTS, "rx-block-timeout", &defaults.rx_block_timeout,
+		DEF_BLOCK_TIMEOUT);
+	if (ret && defaults.rx_block_timeout < 0)
+	{
+		logit(LOG_ERR, "%s: Invalid RX block timeout", GRP_DEFAULTS);
+		return FALSE;
+	}
+	ret &= parse_int(config, GRP_DEFAULTS, "tx-kick-frames", &defaults.tx_kick_frames, 0);
+	if (ret && defaults.tx_kick_frames < 0)
+	{
+		logit(LOG_ERR, "%s: Invalid TX kick frame limit", GRP_DEFAULTS);
+		return FALSE;
+	}
+	ret &= parse_double(config, GRP_DEFAULTS, "tx-kick-delay", &defaults.tx_kick_delay, 0.0);
+	if (ret && !delay_valid(defaults.tx_kick_delay))
+	{
+		logit(LOG_ERR, "%s: Invalid TX kick delay", GRP_DEFAULTS);
+		return FALSE;
+	}
+	ret &= parse_flag(config, GRP_DEFAULTS, "qdisc-bypass", &defaults.qdisc_bypass, FALSE);
+	ret &= parse_flag(config, GRP_DEFAULTS, "shared-socket", &defaults.shared_socket, FALSE);
 
 	ret &= parse_double(config, GRP_DEFAULTS, "max-delay", &defaults.max_delay, 0.001);
 	if (ret && !delay_valid(defaults.max_delay))
@@ -644,6 +999,66 @@ static int parse_defaults(GKeyFile *config)
 		return FALSE;
 	}
 
+	ret &= parse_enum(config, GRP_DEFAULTS, "io-scheduler", io_schedulers,
+		&defaults.io_scheduler, IO_SCHED_OFFSET);
+	ret &= parse_double(config, GRP_DEFAULTS, "read-deadline", &defaults.read_deadline, 0.01);
+	if (ret && (defaults.read_deadline <= 0.0 || !delay_valid(defaults.read_deadline)))
+	{
+		logit(LOG_ERR, "%s: Invalid read deadline", GRP_DEFAULTS);
+		return FALSE;
+	}
+	ret &= parse_double(config, GRP_DEFAULTS, "write-deadline", &defaults.write_deadline, 0.1);
+	if (ret && (defaults.write_deadline <= 0.0 || !delay_valid(defaults.write_deadline)))
+	{
+		logit(LOG_ERR, "%s: Invalid write deadline", GRP_DEFAULTS);
+		return FALSE;
+	}
+	ret &= parse_int(config, GRP_DEFAULTS, "writes-starved", &defaults.writes_starved, 2);
+	if (ret && defaults.writes_starved < 1)
+	{
+		logit(LOG_ERR, "%s: Invalid writes-starved value", GRP_DEFAULTS);
+		return FALSE;
+	}
+	ret &= parse_int(config, GRP_DEFAULTS, "initiator-quantum", &defaults.initiator_quantum, 0);
+	if (ret && !quantum_valid(defaults.initiator_quantum))
+	{
+		logit(LOG_ERR, "%s: Invalid initiator quantum", GRP_DEFAULTS);
+		return FALSE;
+	}
+
+	ret &= parse_double(config, GRP_DEFAULTS, "busy-poll", &defaults.busy_poll, 0.0);
+	if (ret && !delay_valid(defaults.busy_poll))
+	{
+		logit(LOG_ERR, "%s: Invalid busy poll period", GRP_DEFAULTS);
+		return FALSE;
+	}
+
+	ret &= parse_int(config, GRP_DEFAULTS, "worker-threads", &defaults.worker_threads, 0);
+	if (ret && (defaults.worker_threads < 0 || defaults.worker_threads > MAX_WORKERS))
+	{
+		logit(LOG_ERR, "%s: Invalid number of worker threads", GRP_DEFAULTS);
+		return FALSE;
+	}
+	ret &= parse_enum(config, GRP_DEFAULTS, "worker-mode", worker_modes,
+		&defaults.worker_mode, WORKER_MODE_SHARD);
+	/* The pipeline needs at least one worker to feed */
+	if (ret && defaults.worker_mode == WORKER_MODE_PIPELINE && !defaults.worker_threads)
+		defaults.worker_threads = 1;
+
+	ret &= parse_enum(config, GRP_DEFAULTS, "io-engine", io_engines,
+		&defaults.io_engine, IO_ENGINE_AIO);
+	if (ret && !io_engine_valid(GRP_DEFAULTS, defaults.io_engine))
+		return FALSE;
+	ret &= parse_flag(config, GRP_DEFAULTS, "uring-sqpoll", &defaults.uring_sqpoll, FALSE);
+	ret &= parse_flag(config, GRP_DEFAULTS, "uring-iopoll", &defaults.uring_iopoll, FALSE);
+	ret &= parse_int(config, GRP_DEFAULTS, "uring-buffer-size", &defaults.uring_buffer_size,
+		DEF_URING_BUFFER_SIZE);
+	if (ret && defaults.uring_buffer_size < 0)
+	{
+		logit(LOG_ERR, "%s: Requested io_uring buffer size is invalid", GRP_DEFAULTS);
+		return FALSE;
+	}
+
 	/* Compile the network interface pattern list */
 	patterns = g_key_file_get_string_list(config, GRP_DEFAULTS, "interfaces", NULL, NULL);
 	if (patterns)
@@ -670,9 +1085,67 @@ void destroy_device_config(struct device_config *devcfg)
 	if (devcfg->deny)
 		g_free(devcfg->deny);
 
+	if (devcfg->qos_classes)
+	{
+		while (devcfg->qos_classes->len)
+		{
+			free_qos_class(g_ptr_array_index(devcfg->qos_classes, 0));
+			g_ptr_array_remove_index_fast(devcfg->qos_classes, 0);
+		}
+		g_ptr_array_free(devcfg->qos_classes, TRUE);
+	}
+
 	g_free(devcfg->path);
 }
 
+static int parse_qos_limit(GKeyFile *config, const char *section, struct qos_limit *limit)
+{
+	int ret, iops, iops_burst, bandwidth, bandwidth_burst;
+
+	ret = parse_int(config, section, "qos-iops", &iops, 0);
+	ret &= parse_int(config, section, "qos-iops-burst", &iops_burst, 0);
+	ret &= parse_int(config, section, "qos-bandwidth", &bandwidth, 0);
+	ret &= parse_int(config, section, "qos-bandwidth-burst", &bandwidth_burst, 0);
+	if (ret && (iops < 0 || iops_burst < 0 || bandwidth < 0 || bandwidth_burst < 0))
+	{
+		logit(LOG_ERR, "%s: Invalid QoS limit", section);
+		return FALSE;
+	}
+
+	limit->iops = iops;
+	limit->iops_burst = iops_burst;
+	/* Bandwidth is specified in KiB */
+	limit->bandwidth = bandwidth * 1024L;
+	limit->bandwidth_burst = bandwidth_burst * 1024L;
+	finish_qos_limit(limit);
+	return ret;
+}
+
+/* Copy the QoS classes the device uses */
+static int resolve_qos_classes(struct device_config *devcfg, char **values, const char *name)
+{
+	struct qos_class *cls, *copy;
+	unsigned j;
+
+	devcfg->qos_classes = g_ptr_array_new();
+	for (j = 0; values[j]; j++)
+	{
+		cls = lookup_qos_class(g_strstrip(values[j]));
+		if (!cls)
+		{
+			logit(LOG_ERR, "%s: Unknown QoS class '%s'", name, values[j]);
+			return FALSE;
+		}
+
+		copy = g_slice_dup(struct qos_class, cls);
+		copy->name = g_strdup(cls->name);
+		if (cls->match)
+			copy->match = g_slice_dup(struct acl_map, cls->match);
+		g_ptr_array_add(devcfg->qos_classes, copy);
+	}
+	return TRUE;
+}
+
 static int parse_device(GKeyFile *config, const char *name, struct device_config *devcfg)
 {
 	GError *error = NULL;
@@ -686,6 +1159,7 @@ static int parse_device(GKeyFile *config, const char *name, struct device_config
 	ret &= parse_flag(config, name, "trace-io", &devcfg->trace_io, defaults.trace_io);
 	ret &= parse_flag(config, name, "broadcast", &devcfg->broadcast, FALSE);
 	ret &= parse_flag(config, name, "read-only", &devcfg->read_only, FALSE);
+	ret &= parse_flag(config, name, "multipath", &devcfg->multipath, FALSE);
 
 	/* The command line overrides the configuration */
 	if (debug_flag)
@@ -699,6 +1173,13 @@ static int parse_device(GKeyFile *config, const char *name, struct device_config
 	}
 	devcfg->queue_length = val;
 
+	ret &= parse_int(config, name, "weight", &devcfg->weight, 1);
+	if (ret && (devcfg->weight < 1 || devcfg->weight > MAX_WEIGHT))
+	{
+		logit(LOG_ERR, "%s: Invalid weight", name);
+		return FALSE;
+	}
+
 	ret &= parse_int(config, name, "shelf", &val, -1);
 	if (ret && (val < 0 || val >= SHELF_BCAST))
 	{
@@ -731,6 +1212,51 @@ static int parse_device(GKeyFile *config, const char *name, struct device_config
 	}
 	devcfg->merge_delay = tmp * NSEC_PER_SEC;
 
+	ret &= parse_enum(config, name, "io-scheduler", io_schedulers, &devcfg->io_scheduler,
+		defaults.io_scheduler);
+	ret &= parse_double(config, name, "read-deadline", &tmp, defaults.read_deadline);
+	if (ret && (tmp <= 0.0 || tmp >= 1.0))
+	{
+		logit(LOG_ERR, "%s: Invalid read deadline", name);
+		return FALSE;
+	}
+	devcfg->read_deadline = tmp * NSEC_PER_SEC;
+	ret &= parse_double(config, name, "write-deadline", &tmp, defaults.write_deadline);
+	if (ret && (tmp <= 0.0 || tmp >= 1.0))
+	{
+		logit(LOG_ERR, "%s: Invalid write deadline", name);
+		return FALSE;
+	}
+	devcfg->write_deadline = tmp * NSEC_PER_SEC;
+	ret &= parse_int(config, name, "writes-starved", &devcfg->writes_starved,
+		defaults.writes_starved);
+	if (ret && devcfg->writes_starved < 1)
+	{
+		logit(LOG_ERR, "%s: Invalid writes-starved value", name);
+		return FALSE;
+	}
+	ret &= parse_int(config, name, "initiator-quantum", &devcfg->initiator_quantum,
+		defaults.initiator_quantum);
+	if (ret && !quantum_valid(devcfg->initiator_quantum))
+	{
+		logit(LOG_ERR, "%s: Invalid initiator quantum", name);
+		return FALSE;
+	}
+	ret &= parse_qos_limit(config, name, &devcfg->qos);
+
+	ret &= parse_enum(config, name, "io-engine", io_engines, &devcfg->io_engine,
+		defaults.io_engine);
+	if (ret && !io_engine_valid(name, devcfg->io_engine))
+		return FALSE;
+	ret &= parse_flag(config, name, "uring-sqpoll", &devcfg->uring_sqpoll, defaults.uring_sqpoll);
+	ret &= parse_flag(config, name, "uring-iopoll", &devcfg->uring_iopoll, defaults.uring_iopoll);
+	if (ret && devcfg->io_engine == IO_ENGINE_URING && devcfg->uring_iopoll &&
+			!devcfg->direct_io)
+	{
+		logit(LOG_ERR, "%s: 'uring-iopoll' requires direct I/O", name);
+		return FALSE;
+	}
+
 	if (g_key_file_has_key(config, name, "uuid", NULL))
 	{
 		char *uuid;
@@ -791,11 +1317,19 @@ static int parse_device(GKeyFile *config, const char *name, struct device_config
 		resolve_acls(&devcfg->deny, vlist, name);
 		g_strfreev(vlist);
 	}
+
+	vlist = g_key_file_get_string_list(config, name, "qos-classes", NULL, NULL);
+	if (vlist)
+	{
+		ret &= resolve_qos_classes(devcfg, vlist, name);
+		g_strfreev(vlist);
+	}
 	return ret;
 }
 
 static int parse_netif(GKeyFile *config, const char *name, struct netif_config *netcfg)
 {
+	double tmp;
 	int ret;
 
 	memset(netcfg, 0, sizeof(*netcfg));
@@ -806,6 +1340,11 @@ static int parse_netif(GKeyFile *config, const char *name, struct netif_config *
 		logit(LOG_ERR, "%s: Requested MTU is too small", name);
 		return FALSE;
 	}
+	if (netcfg->mtu > MAX_MTU)
+	{
+		logit(LOG_ERR, "%s: Requested MTU is too large", name);
+		return FALSE;
+	}
 	if (g_key_file_has_key(config, name, "buffers", NULL))
 		logit(LOG_WARNING, "%s: 'buffers' is obsolete. Use 'ring-buffer-size' instead", name);
 	ret &= parse_int(config, name, "ring-buffer-size", &netcfg->ring_size, defaults.ring_size);
@@ -814,6 +1353,17 @@ static int parse_netif(GKeyFile *config, const char *name, struct netif_config *
 		logit(LOG_ERR, "%s: Requested ring buffer size is invalid", name);
 		return FALSE;
 	}
+	ret &= parse_flag(config, name, "ring-auto-size", &netcfg->ring_auto_size,
+		defaults.ring_auto_size);
+	ret &= parse_int(config, name, "ring-buffer-min-size", &netcfg->ring_min_size,
+		defaults.ring_min_size);
+	ret &= parse_int(config, name, "ring-buffer-max-size", &netcfg->ring_max_size,
+		defaults.ring_max_size);
+	if (ret && (netcfg->ring_min_size <= 0 || netcfg->ring_max_size < netcfg->ring_min_size))
+	{
+		logit(LOG_ERR, "%s: Invalid ring buffer size limits", name);
+		return FALSE;
+	}
 	ret &= parse_int(config, name, "send-buffer-size", &netcfg->send_buf_size, defaults.send_buf_size);
 	if (ret && netcfg->send_buf_size < 0)
 	{
@@ -828,6 +1378,65 @@ static int parse_netif(GKeyFile *config, const char *name, struct netif_config *
 		return FALSE;
 	}
 
+	ret &= parse_flag(config, name, "zero-copy-read", &netcfg->zero_copy_read, defaults.zero_copy_read);
+	ret &= parse_flag(config, name, "zero-copy-write", &netcfg->zero_copy_write, defaults.zero_copy_write);
+	ret &= parse_flag(config, name, "rx-ring-v3", &netcfg->rx_ring_v3, defaults.rx_ring_v3);
+	ret &= parse_int(config, name, "rx-block-timeout", &netcfg->rx_block_timeout,
+		defaults.rx_block_timeout);
+	if (ret && netcfg->rx_block_timeout < 0)
+	{
+		logit(LOG_ERR, "%s: Invalid RX block timeout", name);
+		return FALSE;
+	}
+	ret &= parse_int(config, name, "tx-kick-frames", &netcfg->tx_kick_frames,
+		defaults.tx_kick_frames);
+	if (ret && netcfg->tx_kick_frames < 0)
+	{
+		logit(LOG_ERR, "%s: Invalid TX kick frame limit", name);
+		return FALSE;
+	}
+	ret &= parse_double(config, name, "tx-kick-delay", &tmp, defaults.tx_kick_delay);
+	if (ret && !delay_valid(tmp))
+	{
+		logit(LOG_ERR, "%s: Invalid TX kick delay", name);
+		return FALSE;
+	}
+	netcfg->tx_kick_delay = tmp * NSEC_PER_SEC;
+	ret &= parse_flag(config, name, "qdisc-bypass", &netcfg->qdisc_bypass, defaults.qdisc_bypass);
+	ret &= parse_int(config, name, "socket-busy-poll", &netcfg->socket_busy_poll, 0);
+	if (ret && netcfg->socket_busy_poll < 0)
+	{
+		logit(LOG_ERR, "%s: Invalid socket busy poll time", name);
+		return FALSE;
+	}
+	ret &= parse_flag(config, name, "prefer-busy-poll", &netcfg->prefer_busy_poll, FALSE);
+	ret &= parse_int(config, name, "rx-queues", &netcfg->rx_queues, 1);
+	if (ret && (netcfg->rx_queues < 1 || netcfg->rx_queues > MAX_RX_QUEUES))
+	{
+		logit(LOG_ERR, "%s: Invalid number of RX queues", name);
+		return FALSE;
+	}
+	ret &= parse_enum(config, name, "rx-fanout", rx_fanouts, &netcfg->rx_fanout,
+		RX_FANOUT_QUEUE);
+	ret &= parse_flag(config, name, "shared-socket", &netcfg->shared_socket,
+		defaults.shared_socket);
+
+	ret &= parse_enum(config, name, "transport", transports, &netcfg->transport,
+		TRANSPORT_PACKET);
+	if (ret && !transport_valid(name, netcfg->transport))
+		return FALSE;
+	ret &= parse_int(config, name, "xdp-queue", &netcfg->xdp_queue, 0);
+	if (ret && netcfg->xdp_queue < 0)
+	{
+		logit(LOG_ERR, "%s: Invalid XDP queue", name);
+		return FALSE;
+	}
+	ret &= parse_int(config, name, "xdp-frames", &netcfg->xdp_frames, DEF_XDP_FRAMES);
+	if (ret && (netcfg->xdp_frames < 64 || (netcfg->xdp_frames & (netcfg->xdp_frames - 1))))
+	{
+		logit(LOG_ERR, "%s: The number of XDP frames must be a power of 2 and at least 64", name);
+		return FALSE;
+	}
 
 	return ret;
 }
@@ -847,12 +1456,14 @@ static int validate_config(GKeyFile *config)
 
 	ret = parse_defaults(config);
 	ret &= parse_acls(config);
+	ret &= parse_qos_classes(config);
 
 	groups = g_key_file_get_groups(config, NULL);
 	for (i = 0; groups[i]; i++)
 	{
 		/* Skip special groups */
-		if (!strcmp(groups[i], GRP_DEFAULTS) || !strcmp(groups[i], GRP_ACLS))
+		if (!strcmp(groups[i], GRP_DEFAULTS) || !strcmp(groups[i], GRP_ACLS) ||
+				!strcmp(groups[i], GRP_QOS))
 			continue;
 
 		if (g_key_file_has_key(config, groups[i], "shelf", NULL))
@@ -865,6 +1476,15 @@ static int validate_config(GKeyFile *config)
 	}
 	g_strfreev(groups);
 
+	/* The worker threads are started only once */
+	if (ret && global_config && (defaults.worker_threads != oldcfg.worker_threads ||
+			defaults.worker_mode != oldcfg.worker_mode))
+	{
+		logit(LOG_WARNING, "Changing the worker thread settings requires a restart");
+		defaults.worker_threads = oldcfg.worker_threads;
+		defaults.worker_mode = oldcfg.worker_mode;
+	}
+
 	if (ret)
 		destroy_defaults(&oldcfg);
 	else
@@ -880,14 +1500,48 @@ int get_device_config(const char *name, struct device_config *devcfg)
 	return parse_device(global_config, name, devcfg);
 }
 
+/* Check if a device should be exported by this instance. Devices without an
+ * "instance" key belong to the daemon started without --instance */
+int is_local_device(const char *name)
+{
+	char *str;
+	int ret;
+
+	if (!g_key_file_has_key(global_config, name, "shelf", NULL))
+		return FALSE;
+
+	str = g_key_file_get_string(global_config, name, "instance", NULL);
+	if (str && instance_name)
+		ret = !strcmp(str, instance_name);
+	else
+		ret = !str && !instance_name;
+	g_free(str);
+	return ret;
+}
+
 int get_netif_config(const char *name, struct netif_config *netcfg)
 {
 	if (!g_key_file_has_group(global_config, name))
 	{
 		memset(netcfg, 0, sizeof(*netcfg));
 		netcfg->ring_size = defaults.ring_size;
+		netcfg->ring_auto_size = defaults.ring_auto_size;
+		netcfg->ring_min_size = defaults.ring_min_size;
+		netcfg->ring_max_size = defaults.ring_max_size;
 		netcfg->send_buf_size = defaults.send_buf_size;
 		netcfg->recv_buf_size = defaults.recv_buf_size;
+		netcfg->zero_copy_read = defaults.zero_copy_read;
+		netcfg->zero_copy_write = defaults.zero_copy_write;
+		netcfg->rx_ring_v3 = defaults.rx_ring_v3;
+		netcfg->rx_block_timeout = defaults.rx_block_timeout;
+		netcfg->tx_kick_frames = defaults.tx_kick_frames;
+		netcfg->tx_kick_delay = defaults.tx_kick_delay * NSEC_PER_SEC;
+		netcfg->qdisc_bypass = defaults.qdisc_bypass;
+		netcfg->rx_queues = 1;
+		netcfg->rx_fanout = RX_FANOUT_QUEUE;
+		netcfg->shared_socket = defaults.shared_socket;
+		netcfg->transport = TRANSPORT_PACKET;
+		netcfg->xdp_frames = DEF_XDP_FRAMES;
 		return TRUE;
 	}
 	return parse_netif(global_config, name, netcfg);
@@ -943,6 +1597,7 @@ static struct option longopts[] =
 	{ "help",	no_argument,		NULL, 'h' },
 	{ "debug",	no_argument,		NULL, 'd' },
 	{ "nofork",	no_argument,		NULL, 'n' },
+	{ "instance",	required_argument,	NULL, 'i' },
 	{ "version",	no_argument,		NULL, 'V' },
 	{ NULL }
 };
@@ -956,6 +1611,7 @@ static void usage(const char *prog, int error)
 	printf("\t-h, --help		This help text\n");
 	printf("\t-d, --debug		Debug mode: don't fork, log traffic to stdout\n");
 	printf("\t-n, --nofork		Don't fork to the background\n");
+	printf("\t-i name, --instance name	Export only the devices of this instance\n");
 	printf("\t-V, --version		Print the version number and exit\n");
 	exit(error);
 }
@@ -1015,7 +1671,7 @@ int main(int argc, char *const argv[])
 
 	while (1)
 	{
-		c = getopt_long(argc, argv, "c:hdnV", longopts, NULL);
+		c = getopt_long(argc, argv, "c:hdni:V", longopts, NULL);
 		if (c == -1)
 			break;
 
@@ -1033,6 +1689,14 @@ int main(int argc, char *const argv[])
 			case 'n':
 				nofork_flag++;
 				break;
+			case 'i':
+				if (!*optarg || strchr(optarg, '/'))
+				{
+					fprintf(stderr, "Invalid instance name '%s'\n", optarg);
+					exit(1);
+				}
+				instance_name = optarg;
+				break;
 			case 'V':
 				printf("%s\n", PACKAGE_STRING);
 				exit(0);
@@ -1079,7 +1743,11 @@ int main(int argc, char *const argv[])
 
 	if (!debug_flag)
 	{
-		openlog("ggaoed", LOG_PID, LOG_DAEMON);
+		/* The identity string must stay valid while syslog is in use */
+		if (instance_name)
+			openlog(g_strdup_printf("ggaoed-%s", instance_name), LOG_PID, LOG_DAEMON);
+		else
+			openlog("ggaoed", LOG_PID, LOG_DAEMON);
 		use_syslog = 1;
 	}
 
@@ -1095,10 +1763,12 @@ int main(int argc, char *const argv[])
 	/* Initialize subsystems. Order is important. */
 	mem_init();
 	event_init();
+	init_workers();
 	netmon_open();
 	setup_ifaces();
 	setup_devices();
 	ctl_init();
+	start_workers();
 
 	while (!exit_flag)
 	{
@@ -1107,17 +1777,21 @@ int main(int argc, char *const argv[])
 		if (reload_flag)
 		{
 			logit(LOG_INFO, "Reload request received");
+			pause_workers();
 			do_load_config(config_file, TRUE);
+			resume_workers();
 			reload_flag = 0;
 		}
 	}
 
+	stop_workers();
 	ctl_done();
 	netmon_close();
 	done_devices();
 	done_ifaces();
+	done_workers();
 	mem_done();
-	close(efd);
+	close(main_worker.efd);
 
 	if (dev_cache)
 		blkid_put_cache(dev_cache);
@@ -3,10 +3,16 @@
 
 #include <sys/uio.h>
 #include <libaio.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <syslog.h>
 
 #include <glib.h>
+#include <atomic_ops.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #include "aoe.h"
 
@@ -20,9 +26,20 @@
 #define SLOT_BCAST		0xff
 
 #define MAX_QUEUE_LEN		65535
+
+/* Max. scheduling weight of a device */
+#define MAX_WEIGHT		1000
 #define DEF_QUEUE_LEN		16
 
 #define DEF_RING_SIZE		(4 * 1024)
+#define DEF_RING_MIN_SIZE	256
+#define DEF_RING_MAX_SIZE	(32 * 1024)
+#define DEF_BLOCK_TIMEOUT	1
+#define DEF_XDP_FRAMES		2048
+#define DEF_URING_BUFFER_SIZE	(4 * 1024)
+
+/* Largest supported MTU */
+#define MAX_MTU			65536
 
 #define MAX_LBA28		0x0fffffffLL
 #define MAX_LBA48		0x0000ffffffffffffLL
@@ -30,6 +47,25 @@
 /* Max. number of I/O requests to merge in a single submission */
 #define MAX_MERGE		32
 
+/* Max. number of responses to send in a single sendmmsg() call */
+#define TX_BATCH		32
+
+/* Multipath: max. number of interfaces remembered per initiator */
+#define MAX_PATHS		8
+
+/* Max. number of responses an interface can hold while it is congested.
+ * Must be a power of 2 */
+#define DEFERRED_LEN		1024
+
+/* Max. number of event loop iterations to skip epoll while busy polling */
+#define BUSY_POLL_SPINS		16
+
+/* Max. number of worker threads */
+#define MAX_WORKERS		64
+
+/* Max. number of receive sockets of an interface */
+#define MAX_RX_QUEUES		64
+
 #define CONFIG_MAP_MAGIC	0x38a0bfae
 #define ACL_MAP_MAGIC		0xe92a716b
 
@@ -37,6 +73,49 @@
  * Data types
  */
 
+/* Storage I/O engines */
+enum io_engine
+{
+	IO_ENGINE_AIO,
+	IO_ENGINE_URING
+};
+
+/* Policies for ordering the queued I/O requests of a device */
+enum io_scheduler
+{
+	/* In arrival order */
+	IO_SCHED_FIFO,
+	/* By offset, with max_delay bounding the wait */
+	IO_SCHED_OFFSET,
+	/* By offset, reads first, with separate read/write deadlines */
+	IO_SCHED_DEADLINE
+};
+
+/* Network transports */
+enum transport
+{
+	TRANSPORT_PACKET,
+	TRANSPORT_XDP
+};
+
+/* How the kernel spreads packets between the receive sockets */
+enum rx_fanout
+{
+	/* By the RX queue of the NIC that received the packet */
+	RX_FANOUT_QUEUE,
+	/* By the CPU that processed the packet */
+	RX_FANOUT_CPU
+};
+
+/* Ways of using worker threads */
+enum worker_mode
+{
+	/* Every worker owns a subset of the devices */
+	WORKER_MODE_SHARD,
+	/* Like shard, but the responses are sent by a separate thread */
+	WORKER_MODE_PIPELINE
+};
+
 /* I/O event handler callback prototype */
 typedef void (*io_callback)(uint32_t events, void *data);
 
@@ -48,13 +127,37 @@ struct default_config
 	int			trace_io;
 	GPtrArray		*interfaces;
 	GPtrArray		*acls;
+	GPtrArray		*qos_classes;
 	int			mtu;
 	int			ring_size;
+	int			ring_auto_size;
+	int			ring_min_size;
+	int			ring_max_size;
 	int			send_buf_size;
 	int			recv_buf_size;
 	int			tx_ring_bug;
+	int			zero_copy_read;
+	int			zero_copy_write;
+	int			rx_ring_v3;
+	int			rx_block_timeout;
+	int			tx_kick_frames;
+	double			tx_kick_delay;
+	int			qdisc_bypass;
+	int			shared_socket;
 	double			max_delay;
 	double			merge_delay;
+	int			io_scheduler;
+	double			read_deadline;
+	double			write_deadline;
+	int			writes_starved;
+	int			initiator_quantum;
+	double			busy_poll;
+	int			worker_threads;
+	int			worker_mode;
+	int			io_engine;
+	int			uring_sqpoll;
+	int			uring_iopoll;
+	int			uring_buffer_size;
 	char			*pid_file;
 	char			*ctl_socket;
 	char			*statedir;
@@ -75,6 +178,27 @@ struct acl_map
 	union padded_addr	entries[255];
 };
 
+/* QoS limits. A zero rate means no limit */
+struct qos_limit
+{
+	/* Requests per second, and the number of requests that can be
+	 * saved up */
+	long			iops;
+	long			iops_burst;
+	/* Bytes per second, and the number of bytes that can be saved up */
+	long			bandwidth;
+	long			bandwidth_burst;
+};
+
+/* Named QoS class */
+struct qos_class
+{
+	char			*name;
+	struct qos_limit	limit;
+	/* Initiators the class applies to, NULL if it applies to all */
+	struct acl_map		*match;
+};
+
 /* Device configuration page */
 struct config_map
 {
@@ -101,6 +225,28 @@ struct device_stats
 	uint32_t		queue_over;
 	uint32_t		ata_err;
 	uint32_t		proto_err;
+	uint64_t		steered;
+	uint32_t		sched_expired;
+	uint32_t		sched_read_batches;
+	uint32_t		sched_write_batches;
+	uint32_t		sched_writes_starved;
+	uint32_t		qos_throttled;
+	struct timespec		qos_throttle_time;
+	uint64_t		run_visits;
+	struct timespec		run_time;
+	uint32_t		run_over_budget;
+};
+
+/* Per-initiator statistics of a device */
+struct initiator_stats
+{
+	union padded_addr	addr;
+	/* Number of requests waiting to be submitted */
+	uint32_t		queue_length;
+	/* Number of interfaces the initiator was seen on */
+	uint32_t		paths;
+	uint64_t		io_cnt;
+	uint64_t		io_bytes;
 };
 
 /* Network interface statistics */
@@ -117,6 +263,15 @@ struct netif_stats
 	uint32_t		dropped;
 	uint32_t		ignored;
 	uint32_t		broadcast;
+	uint64_t		tx_zero_copy;
+	uint64_t		rx_zero_copy;
+	uint32_t		rx_ring_max;
+	uint32_t		tx_ring_max;
+	uint64_t		tx_kick_frames;
+	uint32_t		tx_kick_max;
+	uint32_t		tx_kick_timer;
+	uint32_t		worker_queue_full;
+	uint32_t		rx_paused;
 };
 
 /* Device configuration */
@@ -127,12 +282,26 @@ struct device_config
 	unsigned		shelf;
 	unsigned		slot;
 	int			queue_length;
+	int			weight;
 	int			direct_io;
 	int			trace_io;
 	int			read_only;
 	int			broadcast;
+	int			multipath;
 	long			max_delay;
 	long			merge_delay;
+	int			io_scheduler;
+	long			read_deadline;
+	long			write_deadline;
+	int			writes_starved;
+	int			initiator_quantum;
+	/* Limits of the whole device */
+	struct qos_limit	qos;
+	/* Limits of the initiators. Items: struct qos_class */
+	GPtrArray		*qos_classes;
+	int			io_engine;
+	int			uring_sqpoll;
+	int			uring_iopoll;
 
 	/* Patterns of allowed interfaces */
 	GPtrArray		*iface_patterns;
@@ -147,8 +316,26 @@ struct netif_config
 {
 	int			mtu;
 	int			ring_size;
+	int			ring_auto_size;
+	int			ring_min_size;
+	int			ring_max_size;
 	int			send_buf_size;
 	int			recv_buf_size;
+	int			zero_copy_read;
+	int			zero_copy_write;
+	int			rx_ring_v3;
+	int			rx_block_timeout;
+	int			tx_kick_frames;
+	long			tx_kick_delay;
+	int			qdisc_bypass;
+	int			socket_busy_poll;
+	int			prefer_busy_poll;
+	int			rx_queues;
+	int			rx_fanout;
+	int			shared_socket;
+	int			transport;
+	int			xdp_queue;
+	int			xdp_frames;
 };
 
 /* Event handler context */
@@ -158,6 +345,112 @@ struct event_ctx
 	void			*data;
 };
 
+/* State of an event loop. The main thread has one too; it owns all the
+ * devices if there are no worker threads */
+struct worker_msg;
+struct worker
+{
+	unsigned		index;
+	pthread_t		thread;
+	int			efd;
+
+	/* eventfd for waking up the thread */
+	int			wake_fd;
+	struct event_ctx	wake_ctx;
+
+	/* Devices with requests to submit */
+	GQueue			active_devs;
+	/* Devices using polled I/O that have requests in flight */
+	GQueue			polled_devs;
+	/* Interfaces with responses to send. Items: struct worker_tx */
+	GQueue			active_tx;
+	/* Interfaces waiting for their socket to become writable.
+	 * Items: struct worker_tx */
+	GQueue			congested_tx;
+	struct event_ctx	tx_ctx;
+	/* Timer for retrying sockets whose device queue was full */
+	int			tx_timer_fd;
+	struct event_ctx	tx_timer_ctx;
+	int			tx_timer_armed;
+
+	/* Requests handed over by the main thread. The main thread only
+	 * moves the tail, the worker only moves the head */
+	struct worker_msg	*queue;
+	volatile AO_t		head;
+	volatile AO_t		tail;
+	/* Set while the thread may block waiting for events */
+	volatile AO_t		sleeping;
+	/* Producer only: entries were queued since the last wakeup */
+	int			kick;
+
+	/* Pipeline mode: the thread sending the responses of this worker */
+	struct worker		*tx_stage;
+	/* TX stage: the worker whose responses are sent */
+	struct worker		*owner;
+	/* TX stage: responses in transit. The owner adds them at the tail,
+	 * and frees them at the head once the stage has moved past them */
+	struct queue_item	**tx_queue;
+	AO_t			tx_head;
+	volatile AO_t		tx_sent;
+	volatile AO_t		tx_tail;
+};
+
+/* Token bucket state for enforcing QoS limits. Tokens are earned
+ * continuously, and may go negative if a request costs more than what is
+ * available */
+struct token_bucket
+{
+	/* Time tokens were last added */
+	struct timespec		last;
+	double			iops;
+	double			bytes;
+};
+
+/* Requests waiting to be submitted, either all requests of a device, or
+ * only those of one initiator */
+struct io_queue
+{
+	/* In arrival order, reads in the first queue and writes in the
+	 * second. Items: struct queue_item */
+	GQueue			deferred[2];
+	/* The same requests sorted by offset */
+	GSequence		*sorted[2];
+	/* End of the last submitted request */
+	unsigned long long	sweep_pos;
+	/* Deadline scheduler: read batches submitted while writes were
+	 * waiting */
+	int			write_starved;
+	/* Fairness: bytes the queue may still submit in the current round */
+	long			deficit;
+	/* Number of requests and bytes submitted */
+	uint64_t		io_cnt;
+	uint64_t		io_bytes;
+	/* QoS limits of the initiator, or NULL */
+	const struct qos_limit	*qos;
+	struct token_bucket	bucket;
+	/* Chaining non-empty queues for round-robin dispatch */
+	GList			chain;
+};
+
+/* Multipath: an interface an initiator was seen on */
+struct initiator_path
+{
+	struct netif		*iface;
+	/* When the last request arrived, in CLOCK_MONOTONIC seconds */
+	time_t			last_seen;
+};
+
+/* Initiator talking to a device */
+struct initiator
+{
+	gint64			mac;
+	/* Multipath: interfaces the initiator was seen on recently */
+	struct initiator_path	paths[MAX_PATHS];
+	unsigned		num_paths;
+	/* Fairness: requests of the initiator waiting to be submitted */
+	struct io_queue		queue;
+};
+
 /* Elements of a device's I/O queue */
 struct device;
 struct queue_item
@@ -177,6 +470,22 @@ struct queue_item
 	int			dynalloc: 1;
 	int			is_ata: 1;
 	int			is_write: 1;
+	int			tx_zero_copy: 1;
+	int			rx_zero_copy: 1;
+
+	/* TX ring frame reserved for the response if tx_zero_copy is set */
+	struct netif		*tx_iface;
+	unsigned		tx_frame;
+	/* RX ring frame holding the data if rx_zero_copy is set */
+	struct netif		*rx_iface;
+	unsigned		rx_frame;
+	/* Chaining zero-copy writes that have not been submitted yet */
+	GList			rx_held_link;
+
+	/* Links into the deferred queues of the device */
+	struct io_queue		*ioq;
+	GList			deferred_link;
+	GSequenceIter		*sorted_pos;
 
 	unsigned		hdrlen;
 	union
@@ -209,13 +518,23 @@ struct device
 	char			*name;
 	unsigned long long	size;
 	int			fd;
+	/* Required buffer alignment for direct I/O */
+	unsigned		dio_align;
 
 	int			io_stall: 1;
 	int			is_active: 1;
 	int			timer_armed: 1;
+	int			is_polled: 1;
+	int			is_throttled: 1;
 
 	/* Number of requests in flight */
 	int			queue_length;
+	/* Requests the device may still submit before the other active
+	 * devices get their turn */
+	long			run_credit;
+
+	/* The event loop owning the device */
+	struct worker		*worker;
 
 	int			event_fd;
 	int			timer_fd;
@@ -235,16 +554,38 @@ struct device
 
 	io_context_t		aio_ctx;
 
+#ifdef HAVE_LIBURING
+	struct io_uring		uring;
+	/* Max. number of submit slots in flight */
+	unsigned		uring_depth;
+	int			uring_ready: 1;
+	int			uring_fixed_file: 1;
+	int			uring_fixed_buf: 1;
+#endif
+
 	/* List of submitted I/O requests. Items: struct submit_slot */
 	GQueue			active;
-	/* List of requests that could not be submitted immediately */
-	GPtrArray		*deferred;
+	/* Requests that could not be submitted immediately. Initiators
+	 * have their own queues if fairness is enabled */
+	struct io_queue		queue;
+	/* Queues having requests, in round-robin order. Items: struct
+	 * io_queue */
+	GQueue			busy_queues;
+	/* Tokens for the QoS limits of the device */
+	struct token_bucket	qos_bucket;
+	/* Time requests started waiting for QoS tokens, or zero */
+	struct timespec		throttle_start;
 
 	/* Chaining devices for processing */
 	GList			chain;
+	/* Chaining devices with completions to poll for */
+	GList			poll_chain;
 
 	/* List of attached interfaces */
 	GPtrArray		*ifaces;
+	/* Initiators seen if multipath or fairness is enabled. Keys: MAC
+	 * addresses packed into a gint64, items: struct initiator */
+	GHashTable		*initiators;
 };
 
 /* ACL definition */
@@ -263,12 +604,71 @@ struct ring
 	unsigned		cnt;
 	/* The index of the next frame to use */
 	unsigned		idx;
+	/* TX: the oldest frame not yet reclaimed from the kernel, and the
+	 * number of frames between it and idx */
+	unsigned		tail;
+	unsigned		used;
 	/* Frame size in the ring buffer */
 	unsigned		frame_size;
 	/* Block size of the ring buffer */
 	unsigned		block_size;
 	/* Pointers to the individual frames */
 	void			**frames;
+	/* Frames reserved for zero-copy responses (TX), or number of
+	 * zero-copy write requests using the frame (RX) */
+	unsigned char		*reserved;
+	unsigned		reserved_cnt;
+};
+
+/* An additional receive socket of an interface. The sockets of an interface
+ * form a PACKET_FANOUT group */
+struct rx_queue
+{
+	struct netif		*iface;
+	int			fd;
+
+	struct event_ctx	event_ctx;
+
+	struct ring		ring;
+	/* The address and length of the mapped ring */
+	void			*ring_ptr;
+	unsigned		ring_len;
+};
+
+/* Transmit state of an interface in a worker thread */
+struct worker_tx
+{
+	struct netif		*iface;
+	/* Send-only socket private to the worker */
+	int			fd;
+	int			is_active;
+
+	struct queue_item	*batch[TX_BATCH];
+	unsigned		batch_len;
+
+	/* Responses waiting for the socket to become writable. A ring of
+	 * DEFERRED_LEN entries like the one in struct netif */
+	struct queue_item	**deferred;
+	unsigned		deferred_head;
+	unsigned		deferred_tail;
+	int			congested;
+	/* The last send failed because the queue of the device was full */
+	int			nobufs;
+	/* Set by the worker if receiving on the interface should pause */
+	volatile AO_t		rx_hold;
+	/* Responses queued for the socket, and responses that have left it.
+	 * In the pipeline mode the owner of the devices counts the former,
+	 * and the TX stage the latter */
+	AO_t			tx_queued;
+	volatile AO_t		tx_done;
+
+	/* Merged into the statistics of the interface on request */
+	struct netif_stats	stats;
+
+	/* Chaining interfaces with responses to send */
+	GList			chain;
+	/* Chaining congested interfaces */
+	GList			congested_chain;
 };
 
 /* State of a network interface */
@@ -281,7 +681,12 @@ struct netif
 
 	/* Flags */
 	int			congested: 1;
+	int			rx_paused: 1;
 	int			is_active: 1;
+	int			zero_copy_read: 1;
+	int			zero_copy_write: 1;
+	int			filter_partial: 1;
+	int			shared: 1;
 
 	struct netif_config	cfg;
 	struct netif_stats	stats;
@@ -298,14 +703,74 @@ struct netif
 	/* The length of the mapped area */
 	unsigned		ring_len;
 
+	/* TPACKET_V2 or TPACKET_V3 */
+	int			tp_version;
 	/* The length of the frame header in the rings */
 	int			tp_hdrlen;
+	/* Extra space reserved in front of received packets */
+	unsigned		rx_reserve;
+	/* The RX frame being processed, or -1 */
+	int			rx_frame;
+	/* Zero-copy writes that have not been submitted yet, in the order of
+	 * their RX frames. Items: struct queue_item */
+	GQueue			rx_held;
+
+	/* Requested size of the RX and TX rings, in bytes */
+	unsigned		rx_ring_size;
+	unsigned		tx_ring_size;
+	/* Automatic ring sizing: the overflow counters at the last check,
+	 * the peak ring usage since then, and the number of checks in a row
+	 * the rings were mostly empty */
+	uint32_t		last_rx_full;
+	uint32_t		last_tx_full;
+	unsigned		rx_peak;
+	unsigned		tx_peak;
+	unsigned		rx_quiet;
+	unsigned		tx_quiet;
+	int			resize_pending;
+	/* Attempts left to drain the rings for the pending resize. Receiving
+	 * and new zero-copy reservations stop while it is non-zero */
+	unsigned		resize_drain;
+
+	/* Fanout group ID, or -1 if the socket is not in a group */
+	int			fanout_id;
+	/* Receive sockets besides the main one */
+	struct rx_queue		*rxq;
+	unsigned		rxq_cnt;
 
 	/* Devices that can be accessed on this interface */
 	GPtrArray		*devices;
+	/* Devices indexed by shelf/slot */
+	GHashTable		*dev_map;
+	/* Lists of devices by shelf and by slot, for broadcasts */
+	GHashTable		*shelf_map;
+	GPtrArray		*slot_map[SLOT_BCAST];
+
+	/* Completed requests waiting to be sent. A ring of DEFERRED_LEN
+	 * entries; the indices are free-running */
+	struct queue_item	**deferred;
+	unsigned		deferred_head;
+	unsigned		deferred_tail;
+
+	/* Frames marked for sending since the last send() */
+	unsigned		tx_pending;
+	/* Running average of the frames sent by one send(), times
+	 * TX_KICK_AVG_SCALE */
+	unsigned		tx_kick_avg;
+	/* Timer for delaying send() */
+	int			timer_fd;
+	int			timer_armed;
+	struct event_ctx	timer_ctx;
 
-	/* Completed requests waiting to be sent */
-	GPtrArray		*deferred;
+	/* Responses queued for sendmmsg() if there is no ring buffer */
+	struct queue_item	*tx_batch[TX_BATCH];
+	unsigned		tx_batch_len;
+
+	/* AF_XDP socket state if the XDP transport is used */
+	struct xsk		*xsk;
+
+	/* Per-worker transmit state, indexed by worker number */
+	struct worker_tx	*wtx;
 
 	/* Chaining interfaces for processing */
 	GList			chain;
@@ -332,15 +797,46 @@ void invalidate_iface(int ifindex) INTERNAL;
 void setup_ifaces(void) INTERNAL;
 void done_ifaces(void) INTERNAL;
 void send_response(struct queue_item *q) INTERNAL;
+void defer_response(struct netif *iface, struct queue_item *q) INTERNAL;
+unsigned tx_backlog(const struct netif *iface) INTERNAL G_GNUC_PURE;
+void process_packet(struct netif *iface, void *packet, unsigned len,
+	const struct timespec *tv) INTERNAL;
 int match_acl(const struct acl_map *acls, const void *mac) INTERNAL G_GNUC_PURE;
 int add_one_acl(struct acl_map *acls, const struct ether_addr *addr) INTERNAL;
 void del_one_acl(struct acl_map *acls, const struct ether_addr *addr) INTERNAL;
 void run_ifaces(void) INTERNAL;
+int poll_ifaces(void) INTERNAL;
+int tx_reserve(struct queue_item *q, unsigned align) INTERNAL;
+void tx_release(struct queue_item *q) INTERNAL;
+int rx_hold(struct queue_item *q, unsigned align) INTERNAL;
+void rx_release(struct queue_item *q) INTERNAL;
+void rx_submitted(struct queue_item *q) INTERNAL;
+void update_filter(struct netif *iface) INTERNAL;
+void flush_worker_tx(struct worker *w) INTERNAL;
+void worker_tx_io(uint32_t events, void *data) INTERNAL;
+void worker_tx_timer(uint32_t events, void *data) INTERNAL;
+void update_rx_pause(void) INTERNAL;
+void merge_worker_stats(const struct netif *iface, struct netif_stats *stats) INTERNAL;
+void clear_worker_stats(struct netif *iface) INTERNAL;
+void index_device(struct netif *iface, struct device *dev) INTERNAL;
+void unindex_device(struct netif *iface, struct device *dev) INTERNAL;
+
+int xdp_clamp_mtu(int mtu) INTERNAL G_GNUC_CONST;
+int xdp_open(struct netif *iface, const struct netif_config *cfg, int *mtu) INTERNAL;
+void xdp_close(struct netif *iface) INTERNAL;
+void xdp_rx(struct netif *iface) INTERNAL;
+void xdp_tx(struct netif *iface, struct queue_item *q) INTERNAL;
+void xdp_kick(struct netif *iface) INTERNAL;
 
 void *alloc_packet(unsigned size) INTERNAL G_GNUC_MALLOC;
 void free_packet(void *buf, unsigned size) INTERNAL;
+int get_packet_arena(struct iovec *iov) INTERNAL;
+int packet_in_arena(const void *buf, unsigned size) INTERNAL G_GNUC_PURE;
+void *alloc_packet_area(size_t size) INTERNAL;
+void free_packet_area(void *ptr, size_t size) INTERNAL;
 void mem_init(void) INTERNAL;
 void mem_done(void) INTERNAL;
+void mem_thread_done(void) INTERNAL;
 
 void netmon_open(void) INTERNAL;
 void netmon_enumerate(void) INTERNAL;
@@ -348,7 +844,10 @@ void netmon_close(void) INTERNAL;
 
 void add_fd(int fd, struct event_ctx *ctx) INTERNAL;
 void del_fd(int fd) INTERNAL;
+void add_worker_fd(struct worker *w, int fd, struct event_ctx *ctx) INTERNAL;
+void del_worker_fd(struct worker *w, int fd) INTERNAL;
 void modify_fd(int fd, struct event_ctx *ctx, uint32_t events) INTERNAL;
+void watch_worker_fd(struct worker *w, int fd, struct event_ctx *ctx, uint32_t events) INTERNAL;
 
 void process_request(struct netif *iface, struct device *device,
 	void *buf, int len, const struct timespec *tv) INTERNAL;
@@ -358,12 +857,17 @@ void setup_devices(void) INTERNAL;
 void done_devices(void) INTERNAL;
 void drop_request(struct queue_item *q) INTERNAL;
 void run_devices(void) INTERNAL;
+int devices_runnable(const struct worker *w) INTERNAL;
+void poll_devices(void) INTERNAL;
 void send_advertisment(struct device *dev, struct netif *iface) INTERNAL;
+void forget_ring_frames(struct netif *iface) INTERNAL;
+int unshare_buffer(struct queue_item *q, const struct netif *iface) INTERNAL;
 
 int match_patternlist(const GPtrArray *list, const char *str) INTERNAL G_GNUC_PURE;
 void build_patternlist(GPtrArray *list, char **elements) INTERNAL;
 void free_patternlist(GPtrArray *list) INTERNAL;
 int get_device_config(const char *name, struct device_config *devcfg) INTERNAL;
+int is_local_device(const char *name) INTERNAL;
 void destroy_device_config(struct device_config *devcfg) INTERNAL;
 int get_netif_config(const char *name, struct netif_config *netcfg) INTERNAL;
 unsigned long long human_format(unsigned long long size, const char **unit) INTERNAL;
@@ -371,6 +875,21 @@ unsigned long long human_format(unsigned long long size, const char **unit) INTE
 void ctl_init(void) INTERNAL;
 void ctl_done(void) INTERNAL;
 
+void init_workers(void) INTERNAL;
+void start_workers(void) INTERNAL;
+void stop_workers(void) INTERNAL;
+void done_workers(void) INTERNAL;
+void pause_workers(void) INTERNAL;
+void resume_workers(void) INTERNAL;
+void run_workers(void) INTERNAL;
+struct worker *assign_worker(void) INTERNAL;
+void hand_over_request(struct netif *iface, struct device *dev, const void *buf,
+	unsigned len, const struct timespec *tv) INTERNAL;
+void forget_handed_over(struct netif *iface, struct device *dev) INTERNAL;
+int stage_response(struct queue_item *q) INTERNAL;
+void request_filter_refresh(void) INTERNAL;
+void request_rx_refresh(void) INTERNAL;
+
 /**********************************************************************
  * Global variables
  */
@@ -382,8 +901,12 @@ extern struct default_config defaults;
 extern struct timespec startup;
 
 extern GPtrArray *devices;
-extern GQueue active_devs;
 extern GPtrArray *ifaces;
 extern GQueue active_ifaces;
 
+extern struct worker main_worker;
+extern struct worker *workers;
+extern unsigned nworkers;
+extern __thread struct worker *current_worker;
+
 #endif /* GGAOED_H */
@@ -4,8 +4,13 @@
 
 #include "ggaoed.h"
 
+#include <atomic_ops.h>
+
+#include <sys/mman.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
 
 #include <glib.h>
 
@@ -19,13 +24,44 @@ static long page_size;
 /* Exponent of the page size */
 static unsigned page_shift;
 
-/* Valid packet sizes are between 1 (MTU=1500) and 4 (MTU=9000) pages */
-static GTrashStack *caches[4];
+/* Valid packet sizes are between 1 page (MTU=1500) and MAX_MTU, with a size
+ * class for every page count. The array is sized for the smallest page size
+ * Linux supports. Every event loop thread has its own caches */
+static __thread GTrashStack *caches[MAX_MTU / 4096];
+
+/* Pre-allocated area that I/O engines can register with the kernel. It is
+ * shared by the threads, so the used part only grows atomically */
+static void *arena;
+static size_t arena_size;
+static volatile AO_t arena_used;
+
+/* Packet areas given back by network transports, for re-use */
+static GSList *free_areas;
+
+struct packet_area
+{
+	void			*ptr;
+	size_t			size;
+};
 
 /**********************************************************************
  * Functions
  */
 
+/* Take a piece of the arena if there is enough left */
+static void *carve_arena(size_t size)
+{
+	AO_t used;
+
+	do
+	{
+		used = AO_load(&arena_used);
+		if (!arena || used + size > arena_size)
+			return NULL;
+	} while (!AO_compare_and_swap(&arena_used, used, used + size));
+	return arena + used;
+}
+
 void *alloc_packet(unsigned size)
 {
 	unsigned cache;
@@ -46,6 +82,11 @@ void *alloc_packet(unsigned size)
 	if (G_LIKELY(ptr))
 		return ptr;
 
+	/* Carve new buffers from the arena while it lasts */
+	ptr = carve_arena(size);
+	if (ptr)
+		return ptr;
+
 	ret = posix_memalign(&ptr, page_size, size);
 	if (ret)
 	{
@@ -70,19 +111,124 @@ void free_packet(void *buf, unsigned size)
 	g_trash_stack_push(&caches[cache], buf);
 }
 
+/* Return the area to be registered with I/O engines */
+int get_packet_arena(struct iovec *iov)
+{
+	if (!arena)
+		return FALSE;
+	iov->iov_base = arena;
+	iov->iov_len = arena_size;
+	return TRUE;
+}
+
+int packet_in_arena(const void *buf, unsigned size)
+{
+	return buf >= arena && buf + size <= arena + AO_load(&arena_used);
+}
+
+/* Allocate a page aligned area for packet buffers that a network transport
+ * shares with the kernel. The area is carved from the arena if possible so
+ * I/O engines can also access it directly */
+void *alloc_packet_area(size_t size)
+{
+	struct packet_area *area;
+	GSList *l;
+	void *ptr;
+
+	size = (size + page_size - 1) & ~((size_t)page_size - 1);
+
+	for (l = free_areas; l; l = l->next)
+	{
+		area = l->data;
+		if (area->size != size)
+			continue;
+		ptr = area->ptr;
+		free_areas = g_slist_delete_link(free_areas, l);
+		g_slice_free(struct packet_area, area);
+		return ptr;
+	}
+
+	ptr = carve_arena(size);
+	if (ptr)
+		return ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (ptr == MAP_FAILED)
+	{
+		logerr("Failed to allocate packet area");
+		return NULL;
+	}
+	return ptr;
+}
+
+void free_packet_area(void *ptr, size_t size)
+{
+	struct packet_area *area;
+
+	size = (size + page_size - 1) & ~((size_t)page_size - 1);
+	if (!packet_in_arena(ptr, size))
+	{
+		munmap(ptr, size);
+		return;
+	}
+
+	/* Memory carved from the arena can not be given back */
+	area = g_slice_new(struct packet_area);
+	area->ptr = ptr;
+	area->size = size;
+	free_areas = g_slist_prepend(free_areas, area);
+}
+
 void mem_init(void)
 {
 	page_size = sysconf(_SC_PAGESIZE);
 	for (page_shift = 0; 1l << page_shift < page_size; page_shift++)
 		/* Nothing */;
+
+	/* The arena is only backed by real memory when it gets used or when
+	 * it is registered with the kernel */
+	arena_size = (size_t)defaults.uring_buffer_size * 1024;
+	arena_size &= ~((size_t)page_size - 1);
+	if (!arena_size)
+		return;
+	arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (arena == MAP_FAILED)
+	{
+		logerr("Failed to allocate the packet buffer arena");
+		arena = NULL;
+		arena_size = 0;
+	}
 }
 
-void mem_done(void)
+/* Release the buffer caches of the calling thread */
+void mem_thread_done(void)
 {
 	unsigned i;
 	void *p;
 
 	for (i = 0; i < G_N_ELEMENTS(caches); i++)
 		while ((p = g_trash_stack_pop(&caches[i])))
-			free(p);
+			if (!packet_in_arena(p, 1))
+				free(p);
+}
+
+void mem_done(void)
+{
+	mem_thread_done();
+
+	while (free_areas)
+	{
+		g_slice_free(struct packet_area, free_areas->data);
+		free_areas = g_slist_delete_link(free_areas, free_areas);
+	}
+
+	if (arena)
+	{
+		munmap(arena, arena_size);
+		arena = NULL;
+		arena_size = 0;
+		AO_store(&arena_used, 0);
+	}
 }
@@ -193,6 +193,8 @@ static void netmon_read(uint32_t events G_GNUC_UNUSED, void *data G_GNUC_UNUSED)
 		return;
 	}
 
+	/* Interface changes touch the devices of the worker threads */
+	pause_workers();
 	for (msg = (struct nlmsghdr *)recvbuf; NLMSG_OK(msg, (unsigned)len);
 			msg = NLMSG_NEXT(msg, len))
 	{
@@ -203,6 +205,7 @@ static void netmon_read(uint32_t events G_GNUC_UNUSED, void *data G_GNUC_UNUSED)
 		else if (msg->nlmsg_type == RTM_DELLINK)
 			del_link(msg);
 	}
+	resume_workers();
 }
 
 void netmon_close(void)
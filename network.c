@@ -14,6 +14,8 @@
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/time.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +34,101 @@
 #define TP_STATUS_WRONG_FORMAT	0x4
 #endif /* PACKET_TX_RING */
 
+/* Added in kernel 3.8 */
+#ifndef PACKET_TX_HAS_OFF
+#define PACKET_TX_HAS_OFF	19
+#endif
+
+/* Added in kernel 3.14 */
+#ifndef PACKET_QDISC_BYPASS
+#define PACKET_QDISC_BYPASS	20
+#endif
+
+/* Added in kernel 3.1, 3.14 and 4.4 */
+#ifndef PACKET_FANOUT
+#define PACKET_FANOUT		18
+#define PACKET_FANOUT_CPU	2
+#endif
+#ifndef PACKET_FANOUT_QM
+#define PACKET_FANOUT_QM	5
+#endif
+#ifndef PACKET_FANOUT_FLAG_UNIQUEID
+#define PACKET_FANOUT_FLAG_UNIQUEID	0x2000
+#endif
+
+/* Added in kernel 3.11 and 5.11 */
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL		46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL	69
+#endif
+
+/* Alignment of zero-copy data inside the ring frames */
+#define ZERO_COPY_ALIGN		512
+
+/* Min. number of frames the initial ring block size should hold */
+#define RING_BLOCK_FRAMES	4
+
+/* TX frames have the same layout with TPACKET_V2 and V3, only the frame
+ * headers differ */
+#define TX_HDR(iface, h, field) (*((iface)->tp_version == TPACKET_V3 ? \
+	&((struct tpacket3_hdr *)(h))->field : &((struct tpacket2_hdr *)(h))->field))
+
+/* Offset of the network header in RX frames, not counting PACKET_RESERVE.
+ * This mirrors the calculation in the kernel */
+#define RX_NETOFF		TPACKET_ALIGN(TPACKET2_HDRLEN + 16)
+
+/* Key of the shelf/slot lookup table */
+#define DEV_KEY(shelf, slot)	GUINT_TO_POINTER((shelf) << 8 | (slot))
+
+/* Number of packets to receive/send in a single system call when there is
+ * no ring buffer */
+#define RX_BATCH		16
+
+/* Max. number of RX frames zero-copy writes may hold, as a fraction of
+ * the ring */
+#define RX_HOLD_RATIO		4
+
+/* Zero-copy writes that have not been submitted yet give back their frames
+ * when receiving gets within this fraction of the ring of them */
+#define RX_HOLD_MARGIN		8
+
+/* Nanoseconds to wait before retrying a worker socket whose device queue
+ * was full */
+#define WORKER_TX_BACKOFF	100000
+
+/* Receiving stops when this many responses wait for a congested interface,
+ * and restarts once fewer than DEFERRED_LOW are left */
+#define DEFERRED_HIGH		(DEFERRED_LEN / 2)
+#define DEFERRED_LOW		(DEFERRED_LEN / 8)
+
+/* The average number of frames sent by one send() is kept in units of
+ * 1/TX_KICK_AVG_SCALE frames, as a moving average with a weight of
+ * 1/TX_KICK_AVG_WEIGHT */
+#define TX_KICK_AVG_SCALE	16
+#define TX_KICK_AVG_WEIGHT	8
+
+/* tx-kick-delay only applies while send() carries at least this many
+ * frames on average */
+#define TX_KICK_DELAY_FRAMES	2
+
+/* Seconds between checking the sizes of automatically sized rings */
+#define RING_CHECK_INTERVAL	10
+
+/* Milliseconds between the attempts to drain the rings for a resize, and
+ * the number of attempts before giving up until the next check */
+#define RING_DRAIN_INTERVAL	10
+#define RING_DRAIN_TRIES	100
+
+/* A ring is idle if its peak usage is below this fraction of its size... */
+#define RING_IDLE_RATIO		8
+/* ...and it is halved after being idle for this many checks in a row */
+#define RING_SHRINK_CHECKS	6
+
+/* Max. number of interfaces the filter of the shared socket can exclude */
+#define SHARED_FILTER_MAX	255
+
 /**********************************************************************
  * Global variables
  */
@@ -41,26 +138,96 @@ GPtrArray *ifaces;
 
 GQueue active_ifaces;
 
+/* Pseudo-interface holding the socket shared by low-traffic interfaces */
+static struct netif *shared_iface;
+/* Interfaces using the shared socket, indexed by ifindex */
+static GHashTable *shared_map;
+/* Interfaces using the shared socket that wait for it to become writable */
+static GPtrArray *shared_congested;
+
+/* Timer for checking the sizes of automatically sized rings */
+static int resize_timer_fd = -1;
+static struct event_ctx resize_ctx;
+/* The resize timer runs at the faster rate of draining the rings */
+static int resize_draining;
+
 static void net_io(uint32_t events, void *data);
+static void rxq_io(uint32_t events, void *data);
+static void shared_io(uint32_t events, void *data);
+static void leave_shared(struct netif *iface);
 static void destroy_one_ring(struct netif *iface, int what);
+static void destroy_rx_queues(struct netif *iface);
+static void tx_flush(struct netif *iface);
+static void tx_kick(struct netif *iface);
+static void open_worker_tx(struct netif *iface);
+static void iface_timer(uint32_t events, void *data);
+static void pause_rx(struct netif *iface, int pause);
+static int rx_can_resume(const struct netif *iface);
 
 /**********************************************************************
  * Generic functions
  */
 
+static void free_dev_list(void *data)
+{
+	g_ptr_array_free(data, TRUE);
+}
+
 static void free_iface(struct netif *iface)
 {
-	unsigned i;
+	struct queue_item *q;
+	unsigned i, j;
+
+	if (nworkers)
+		forget_handed_over(iface, NULL);
+	for (i = 0; iface->wtx && i < nworkers; i++)
+	{
+		struct worker_tx *const wtx = &iface->wtx[i];
+		/* In the pipeline mode the TX stage does the sending */
+		struct worker *const w = workers[i].tx_stage ? workers[i].tx_stage : &workers[i];
+
+		for (j = 0; j < wtx->batch_len; j++)
+			drop_request(wtx->batch[j]);
+		if (wtx->is_active)
+			g_queue_unlink(&workers[i].active_tx, &wtx->chain);
+		/* The deferred responses always belong to the sender */
+		while (wtx->deferred_head != wtx->deferred_tail)
+		{
+			q = wtx->deferred[wtx->deferred_head++ & (DEFERRED_LEN - 1)];
+			drop_request(q);
+		}
+		if (wtx->congested)
+			g_queue_unlink(&w->congested_tx, &wtx->congested_chain);
+		g_free(wtx->deferred);
+		/* The sockets of shared interfaces belong to the shared socket */
+		if (wtx->fd != -1 && !iface->shared)
+			close(wtx->fd);
+	}
+	g_free(iface->wtx);
 
-	for (i = 0; i < iface->deferred->len; i++)
-		drop_request(g_ptr_array_index(iface->deferred, i));
-	if (iface->deferred->len)
-		g_ptr_array_remove_range(iface->deferred, 0, iface->deferred->len);
+	for (i = 0; i < iface->tx_batch_len; i++)
+		drop_request(iface->tx_batch[i]);
+	iface->tx_batch_len = 0;
+	while (iface->deferred_head != iface->deferred_tail)
+		drop_request(iface->deferred[iface->deferred_head++ & (DEFERRED_LEN - 1)]);
+	if (iface->is_active)
+		g_queue_unlink(&active_ifaces, &iface->chain);
+
+	if (iface->timer_fd != -1)
+	{
+		del_fd(iface->timer_fd);
+		close(iface->timer_fd);
+	}
 
-	if (iface->fd >= 0)
+	destroy_rx_queues(iface);
+	xdp_close(iface);
+	if (iface->shared)
+		leave_shared(iface);
+	else if (iface->fd >= 0)
 	{
 		if (iface->ring_ptr)
 		{
+			forget_ring_frames(iface);
 			munmap(iface->ring_ptr, iface->ring_len);
 			destroy_one_ring(iface, PACKET_RX_RING);
 			destroy_one_ring(iface, PACKET_TX_RING);
@@ -71,7 +238,12 @@ static void free_iface(struct netif *iface)
 	if (iface->devices->len)
 		netlog(iface, LOG_ERR, "Being destroyed but devices are still attached");
 	g_ptr_array_free(iface->devices, TRUE);
-	g_ptr_array_free(iface->deferred, TRUE);
+	g_hash_table_destroy(iface->dev_map);
+	g_hash_table_destroy(iface->shelf_map);
+	for (i = 0; i < G_N_ELEMENTS(iface->slot_map); i++)
+		if (iface->slot_map[i])
+			g_ptr_array_free(iface->slot_map[i], TRUE);
+	g_free(iface->deferred);
 	g_free(iface->name);
 	g_slice_free(struct netif, iface);
 }
@@ -79,17 +251,37 @@ static void free_iface(struct netif *iface)
 static struct netif *alloc_iface(int ifindex, const char *name)
 {
 	struct netif *iface;
+	unsigned i;
 
 	iface = g_slice_new0(struct netif);
 	iface->ifindex = ifindex;
 	iface->fd = -1;
+	iface->timer_fd = -1;
+	iface->rx_frame = -1;
+	iface->fanout_id = -1;
 	iface->name = g_strdup(name);
 	iface->event_ctx.callback = net_io;
 	iface->event_ctx.data = iface;
+	iface->timer_ctx.callback = iface_timer;
+	iface->timer_ctx.data = iface;
 	iface->devices = g_ptr_array_new();
-	iface->deferred = g_ptr_array_new();
+	iface->dev_map = g_hash_table_new(g_direct_hash, g_direct_equal);
+	iface->shelf_map = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+		NULL, free_dev_list);
+	iface->deferred = g_new(struct queue_item *, DEFERRED_LEN);
 	iface->chain.data = iface;
 
+	if (nworkers)
+		iface->wtx = g_new0(struct worker_tx, nworkers);
+	for (i = 0; i < nworkers; i++)
+	{
+		iface->wtx[i].iface = iface;
+		iface->wtx[i].fd = -1;
+		iface->wtx[i].deferred = g_new(struct queue_item *, DEFERRED_LEN);
+		iface->wtx[i].chain.data = &iface->wtx[i];
+		iface->wtx[i].congested_chain.data = &iface->wtx[i];
+	}
+
 	if (!get_netif_config(name, &iface->cfg))
 	{
 		free_iface(iface);
@@ -100,11 +292,11 @@ static struct netif *alloc_iface(int ifindex, const char *name)
 }
 
 /* Process a packet received from the network */
-static void process_packet(struct netif *iface, void *packet, unsigned len,
+void process_packet(struct netif *iface, void *packet, unsigned len,
 	const struct timespec *tv)
 {
 	const struct aoe_hdr *hdr = packet;
-	unsigned i, l, u, shelf, slot;
+	unsigned i, shelf, slot;
 	struct device *dev;
 
 	iface->stats.rx_bytes += len;
@@ -134,69 +326,164 @@ static void process_packet(struct netif *iface, void *packet, unsigned len,
 	shelf = hdr->shelf;
 	slot = hdr->slot;
 
-	/* Broadcast requests: do a linear scan */
+	/* Broadcast requests: use the per-shelf or per-slot lists */
 	if (G_UNLIKELY(shelf == htons(SHELF_BCAST) || slot == SLOT_BCAST))
 	{
-		int processed = FALSE;
+		const GPtrArray *list;
+
+		if (shelf == htons(SHELF_BCAST) && slot == SLOT_BCAST)
+			list = iface->devices;
+		else if (shelf == htons(SHELF_BCAST))
+			list = iface->slot_map[slot];
+		else
+			list = g_hash_table_lookup(iface->shelf_map, GUINT_TO_POINTER(shelf));
 
-		for (i = 0; i < iface->devices->len; i++)
+		if (list && list->len)
 		{
-			dev = g_ptr_array_index(iface->devices, i);
-			if ((shelf == htons(SHELF_BCAST) || dev->cfg.shelf == shelf) &&
-					(slot == SLOT_BCAST || dev->cfg.slot == slot))
-			{
-				process_request(iface, dev, packet, len, tv);
-				processed = TRUE;
-			}
-		}
-		if (processed)
+			for (i = 0; i < list->len; i++)
+				process_request(iface, g_ptr_array_index(list, i), packet, len, tv);
 			iface->stats.broadcast++;
+		}
 		else
 			iface->stats.ignored++;
 		return;
 	}
 
-	/* Not a broadcast: do a binary search */
-	l = 0;
-	u = iface->devices->len;
-	while (l < u)
+	dev = g_hash_table_lookup(iface->dev_map, DEV_KEY(shelf, slot));
+	if (dev)
+		return process_request(iface, dev, packet, len, tv);
+	iface->stats.ignored++;
+}
+
+/* Add a device to the shelf/slot lookup tables of the interface */
+void index_device(struct netif *iface, struct device *dev)
+{
+	const unsigned shelf = dev->cfg.shelf, slot = dev->cfg.slot;
+	GPtrArray *list;
+
+	/* If the address is duplicated, the first device wins */
+	if (!g_hash_table_lookup(iface->dev_map, DEV_KEY(shelf, slot)))
+		g_hash_table_insert(iface->dev_map, DEV_KEY(shelf, slot), dev);
+
+	list = g_hash_table_lookup(iface->shelf_map, GUINT_TO_POINTER(shelf));
+	if (!list)
 	{
-		i = (l + u) / 2;
-		dev = g_ptr_array_index(iface->devices, i);
+		list = g_ptr_array_new();
+		g_hash_table_insert(iface->shelf_map, GUINT_TO_POINTER(shelf), list);
+	}
+	g_ptr_array_add(list, dev);
 
-		if (dev->cfg.shelf < shelf || (dev->cfg.shelf == shelf &&
-				dev->cfg.slot < slot))
-			l = i + 1;
-		else if (dev->cfg.shelf > shelf || (dev->cfg.shelf == shelf &&
-				dev->cfg.slot > slot))
-			u = i;
-		else
-			return process_request(iface, dev, packet, len, tv);
+	if (!iface->slot_map[slot])
+		iface->slot_map[slot] = g_ptr_array_new();
+	g_ptr_array_add(iface->slot_map[slot], dev);
+}
+
+/* Remove a device from the lookup tables. Must be called before the
+ * shelf/slot of the device changes */
+void unindex_device(struct netif *iface, struct device *dev)
+{
+	const unsigned shelf = dev->cfg.shelf, slot = dev->cfg.slot;
+	struct device *other;
+	GPtrArray *list;
+	unsigned i;
+
+	list = g_hash_table_lookup(iface->shelf_map, GUINT_TO_POINTER(shelf));
+	if (list)
+	{
+		g_ptr_array_remove(list, dev);
+		if (!list->len)
+			g_hash_table_remove(iface->shelf_map, GUINT_TO_POINTER(shelf));
+	}
+
+	list = iface->slot_map[slot];
+	if (list)
+	{
+		g_ptr_array_remove(list, dev);
+		if (!list->len)
+		{
+			g_ptr_array_free(list, TRUE);
+			iface->slot_map[slot] = NULL;
+		}
+	}
+
+	if (g_hash_table_lookup(iface->dev_map, DEV_KEY(shelf, slot)) != dev)
+		return;
+	g_hash_table_remove(iface->dev_map, DEV_KEY(shelf, slot));
+
+	/* Let a device with a duplicate address take over */
+	list = g_hash_table_lookup(iface->shelf_map, GUINT_TO_POINTER(shelf));
+	for (i = 0; list && i < list->len; i++)
+	{
+		other = g_ptr_array_index(list, i);
+		if (other->cfg.slot == slot)
+		{
+			g_hash_table_insert(iface->dev_map, DEV_KEY(shelf, slot), other);
+			break;
+		}
 	}
-	iface->stats.ignored++;
 }
 
 /**********************************************************************
  * Memory mapped ring buffer handling
  */
 
-/* Receive packets from the network using a ringbuffer shared with the kernel */
-static void rx_ring(struct netif *iface)
+/* Account for the packets the kernel could not put into the ring */
+static void update_drops(struct netif *iface, int fd)
 {
-	unsigned cnt, was_drop;
+	struct tpacket_stats stats;
+	socklen_t len;
+
+	len = sizeof(stats);
+	if (!getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len))
+		iface->stats.dropped += stats.tp_drops;
+}
+
+/* The RX ring is strictly in order, so the kernel stops at the first frame
+ * still held by a write. Copy the data of the writes that wait to be
+ * submitted before receiving gets stuck behind their frames */
+static void unshare_held(struct netif *iface)
+{
+	struct ring *const ring = &iface->rx_ring;
+	struct queue_item *q;
+
+	while ((q = g_queue_peek_head(&iface->rx_held)))
+	{
+		if ((q->rx_frame + ring->cnt - ring->idx) % ring->cnt >= ring->cnt / RX_HOLD_MARGIN)
+			break;
+		if (!unshare_buffer(q, iface))
+			break;
+	}
+}
+
+/* Receive packets from the network using a ringbuffer shared with the kernel.
+ * Besides the main ring of the interface, this also serves the rings of the
+ * additional RX queues */
+static void rx_ring(struct netif *iface, struct ring *ring, int fd)
+{
+	unsigned cnt, idx, was_drop;
 	struct tpacket2_hdr *h;
 	struct timespec tv;
 	void *data;
 
 	was_drop = 0;
-	for (cnt = 0; cnt < iface->rx_ring.cnt; ++cnt)
+	for (cnt = 0; cnt < ring->cnt; ++cnt)
 	{
-		data = h = iface->rx_ring.frames[iface->rx_ring.idx];
+		idx = ring->idx;
+
+		if (iface->rx_held.head && ring == &iface->rx_ring)
+			unshare_held(iface);
+
+		/* The kernel can not go past a frame still used by a write
+		 * request, so there is nothing more to receive */
+		if (ring->reserved[idx])
+			break;
+
+		data = h = ring->frames[idx];
 		if (!h->tp_status)
 			break;
 
-		if (++iface->rx_ring.idx >= iface->rx_ring.cnt)
-			iface->rx_ring.idx = 0;
+		if (++ring->idx >= ring->cnt)
+			ring->idx = 0;
 
 		if (G_UNLIKELY(h->tp_snaplen < (int)sizeof(struct aoe_hdr)))
 		{
@@ -210,36 +497,166 @@ static void rx_ring(struct netif *iface)
 		tv.tv_sec = h->tp_sec;
 		tv.tv_nsec = h->tp_nsec;
 
+		was_drop |= h->tp_status & TP_STATUS_LOSING;
+
 		/* The AoE header also contains the ethernet header, so we have
 		 * start from h->tp_mac instead of h->tp_net */
+		if (ring == &iface->rx_ring)
+			iface->rx_frame = idx;
 		process_packet(iface, data + h->tp_mac, h->tp_snaplen, &tv);
-		was_drop |= h->tp_status & TP_STATUS_LOSING;
+		iface->rx_frame = -1;
+
+		/* Zero-copy writes give back the frame when they complete */
+		if (ring->reserved[idx])
+			continue;
 
 next:
 		h->tp_status = TP_STATUS_KERNEL;
 		/* Make sure other CPUs know about the status change */
 		AO_nop_full();
 	}
-	if (cnt >= iface->rx_ring.cnt)
+	if (cnt >= ring->cnt)
 		++iface->stats.rx_buffers_full;
+	if (cnt > iface->stats.rx_ring_max)
+		iface->stats.rx_ring_max = cnt;
+	if (cnt > iface->rx_peak)
+		iface->rx_peak = cnt;
 
 	if (was_drop)
+		update_drops(iface, fd);
+
+	++iface->stats.rx_runs;
+}
+
+/* Receive packets using a TPACKET_V3 ring, where the kernel hands over whole
+ * blocks of variable sized frames */
+static void rx_ring_v3(struct netif *iface, struct ring *ring, int fd)
+{
+	struct tpacket_block_desc *b;
+	unsigned cnt, i, was_drop;
+	struct tpacket3_hdr *h;
+	struct timespec tv;
+
+	was_drop = 0;
+	for (cnt = 0; cnt < ring->cnt; ++cnt)
 	{
-		struct tpacket_stats stats;
-		socklen_t len;
+		b = ring->frames[ring->idx];
+		if (!(b->hdr.bh1.block_status & TP_STATUS_USER))
+			break;
+
+		if (++ring->idx >= ring->cnt)
+			ring->idx = 0;
 
-		len = sizeof(stats);
-		if (!getsockopt(iface->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len))
-			iface->stats.dropped += stats.tp_drops;
+		h = (void *)b + b->hdr.bh1.offset_to_first_pkt;
+		for (i = 0; i < b->hdr.bh1.num_pkts; ++i,
+				h = (void *)h + h->tp_next_offset)
+		{
+			if (G_UNLIKELY(h->tp_snaplen < sizeof(struct aoe_hdr)))
+			{
+				netlog(iface, LOG_DEBUG, "Packet too short");
+				++iface->stats.dropped;
+				continue;
+			}
+
+			tv.tv_sec = h->tp_sec;
+			tv.tv_nsec = h->tp_nsec;
+			process_packet(iface, (void *)h + h->tp_mac, h->tp_snaplen, &tv);
+		}
+		was_drop |= b->hdr.bh1.block_status & TP_STATUS_LOSING;
+
+		/* The whole block is given back at once */
+		b->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		/* Make sure other CPUs know about the status change */
+		AO_nop_full();
 	}
+	if (cnt >= ring->cnt)
+		++iface->stats.rx_buffers_full;
+	if (cnt > iface->stats.rx_ring_max)
+		iface->stats.rx_ring_max = cnt;
+	if (cnt > iface->rx_peak)
+		iface->rx_peak = cnt;
+
+	if (was_drop)
+		update_drops(iface, fd);
 
 	++iface->stats.rx_runs;
 }
 
+/* Hand a frame over to the kernel for sending */
+static void tx_frame_ready(struct netif *iface, void *h)
+{
+	/* Make sure buffer writes are stable before we update the status */
+	AO_nop_write();
+	TX_HDR(iface, h, tp_status) = TP_STATUS_SEND_REQUEST;
+	/* Make sure other CPUs know about the status change */
+	AO_nop_full();
+
+	/* Do not let a large burst wait for the end of the event loop. The
+	 * limit follows the recent batch sizes, so a lightly loaded interface
+	 * kicks the kernel early */
+	++iface->tx_pending;
+	if (iface->cfg.tx_kick_frames && iface->tx_pending >=
+			CLAMP(iface->tx_kick_avg * 2 / TX_KICK_AVG_SCALE, 1,
+				(unsigned)iface->cfg.tx_kick_frames))
+		return tx_kick(iface);
+
+	if (!iface->is_active)
+	{
+		g_queue_push_tail_link(&active_ifaces, &iface->chain);
+		iface->is_active = TRUE;
+	}
+}
+
+/* Take back the frames the kernel has finished sending. The kernel sends
+ * the frames in ring order, so they are reclaimed in order as well */
+static void tx_reclaim(struct netif *iface)
+{
+	struct ring *const ring = &iface->tx_ring;
+	void *h;
+
+	while (ring->used)
+	{
+		/* Reserved frames are still being filled */
+		if (ring->reserved[ring->tail])
+			break;
+		h = ring->frames[ring->tail];
+		if (TX_HDR(iface, h, tp_status) != TP_STATUS_AVAILABLE &&
+				TX_HDR(iface, h, tp_status) != TP_STATUS_WRONG_FORMAT)
+			break;
+
+		if (++ring->tail >= ring->cnt)
+			ring->tail = 0;
+		--ring->used;
+	}
+}
+
+/* Allocate the next TX frame, returns -1 if the ring is full */
+static int tx_alloc_frame(struct netif *iface)
+{
+	struct ring *const ring = &iface->tx_ring;
+	unsigned idx;
+
+	if (ring->used >= ring->cnt)
+	{
+		tx_reclaim(iface);
+		if (ring->used >= ring->cnt)
+			return -1;
+	}
+
+	idx = ring->idx;
+	if (++ring->idx >= ring->cnt)
+		ring->idx = 0;
+	if (++ring->used > iface->stats.tx_ring_max)
+		iface->stats.tx_ring_max = ring->used;
+	if (ring->used > iface->tx_peak)
+		iface->tx_peak = ring->used;
+	return idx;
+}
+
 static void tx_ring(struct netif *iface, struct queue_item *q)
 {
-	struct tpacket2_hdr *h;
-	unsigned cnt;
+	void *h;
+	int idx;
 	void *data;
 
 	/* This may happen if the MTU changes while requests are
@@ -250,43 +667,30 @@ static void tx_ring(struct netif *iface, struct queue_item *q)
 		return;
 	}
 
-	for (cnt = 0; cnt < iface->tx_ring.cnt; ++cnt)
-	{
-		h = iface->tx_ring.frames[iface->tx_ring.idx++];
-		if (iface->tx_ring.idx >= iface->tx_ring.cnt)
-			iface->tx_ring.idx = 0;
-		if (h->tp_status == TP_STATUS_AVAILABLE ||
-				h->tp_status == TP_STATUS_WRONG_FORMAT)
-			break;
-
-	}
-	if (cnt >= iface->tx_ring.cnt)
+	idx = tx_alloc_frame(iface);
+	if (idx < 0)
 	{
 		++iface->stats.tx_buffers_full;
-		g_ptr_array_add(iface->deferred, q);
-		if (!iface->congested)
-		{
-			modify_fd(iface->fd, &iface->event_ctx, EPOLLIN | EPOLLOUT);
-			iface->congested = TRUE;
-		}
-		return;
+		return defer_response(iface, q);
 	}
+	h = iface->tx_ring.frames[idx];
 
 	/* Should not happen */
-	if (G_UNLIKELY(h->tp_status == TP_STATUS_WRONG_FORMAT))
+	if (G_UNLIKELY(TX_HDR(iface, h, tp_status) == TP_STATUS_WRONG_FORMAT))
 		netlog(iface, LOG_ERR, "Bad packet format on send");
 
 	/* Fill the frame */
 	data = (void *)h + iface->tp_hdrlen;
+	TX_HDR(iface, h, tp_mac) = iface->tp_hdrlen;
 	memcpy(data, &q->aoe_hdr, q->hdrlen);
-	h->tp_len = q->hdrlen;
+	TX_HDR(iface, h, tp_len) = q->hdrlen;
 	if (q->length)
 	{
 		memcpy(data + q->hdrlen, q->buf, q->length);
-		h->tp_len += q->length;
+		TX_HDR(iface, h, tp_len) += q->length;
 	}
 
-	iface->stats.tx_bytes += h->tp_len;
+	iface->stats.tx_bytes += TX_HDR(iface, h, tp_len);
 	++iface->stats.tx_cnt;
 	if (q->dev && G_UNLIKELY(q->dev->cfg.trace_io))
 		devlog(q->dev, LOG_DEBUG, "%s/%08x: Response sent",
@@ -295,125 +699,480 @@ static void tx_ring(struct netif *iface, struct queue_item *q)
 
 	drop_request(q);
 
-	/* Make sure buffer writes are stable before we update the status */
-	AO_nop_write();
-	h->tp_status = TP_STATUS_SEND_REQUEST;
-	/* Make sure other CPUs know about the status change */
-	AO_nop_full();
-
-	if (!iface->is_active)
-	{
-		g_queue_push_tail_link(&active_ifaces, &iface->chain);
-		iface->is_active = TRUE;
-	}
+	tx_frame_ready(iface, h);
 }
 
-/* Call send() for interfaces that have packets queued in the ring buffer */
-void run_ifaces(void)
+static void tx_unreserve(struct netif *iface, struct queue_item *q)
 {
-	GList *l;
-	int ret;
+	iface->tx_ring.reserved[q->tx_frame] = FALSE;
+	--iface->tx_ring.reserved_cnt;
+	q->tx_zero_copy = FALSE;
+	q->tx_iface = NULL;
+}
 
-	while ((l = g_queue_pop_head_link(&active_ifaces)))
+/* Reserve the next TX frame for the response of a read request, and let the
+ * data be read directly into it */
+int tx_reserve(struct queue_item *q, unsigned align)
+{
+	struct netif *const iface = q->iface;
+	struct ring *const ring = &iface->tx_ring;
+	void *h;
+	unsigned long data;
+	unsigned off;
+	int idx;
+
+	/* The rings belong to the main thread */
+	if (!iface->zero_copy_read || iface->congested || iface->resize_drain ||
+			current_worker != &main_worker)
+		return FALSE;
+
+	/* Leave enough frames for responses that cannot be zero-copy */
+	if (ring->reserved_cnt >= ring->cnt / 2)
+		return FALSE;
+
+	/* Shift the packet inside the frame so the data part satisfies the
+	 * alignment requirements of direct I/O. tx_alloc_frame() returns the
+	 * frame at ring->idx */
+	data = (unsigned long)ring->frames[ring->idx] + iface->tp_hdrlen + q->hdrlen;
+	off = iface->tp_hdrlen + ((align - data % align) % align);
+	if (off + q->hdrlen + q->length > ring->frame_size)
+		return FALSE;
+
+	idx = tx_alloc_frame(iface);
+	if (idx < 0)
+		return FALSE;
+	h = ring->frames[idx];
+
+	if (q->dynalloc)
 	{
-		struct netif *iface = l->data;
-
-		iface->is_active = FALSE;
-		ret = send(iface->fd, NULL, 0, MSG_DONTWAIT | MSG_NOSIGNAL);
-		if (ret == -1 && errno != EAGAIN)
-			neterr(iface, "Async write error");
-		else
-			++iface->stats.tx_runs;
+		free_packet(q->buf, q->bufsize);
+		q->dynalloc = FALSE;
 	}
+	q->buf = (void *)h + off + q->hdrlen;
+	q->tx_zero_copy = TRUE;
+	q->tx_iface = iface;
+	q->tx_frame = idx;
+
+	ring->reserved[idx] = TRUE;
+	++ring->reserved_cnt;
+	return TRUE;
 }
 
-static void setup_one_ring(struct netif *iface, unsigned ring_size, int mtu, int what)
+/* Give back a reserved frame without sending a response in it */
+void tx_release(struct queue_item *q)
 {
-	unsigned page_size, max_blocks;
-	struct tpacket_req req;
-	struct ring *ring;
-	const char *name;
-	int ret;
-
-	name = what == PACKET_RX_RING ? "RX" : "TX";
-	ring = what == PACKET_RX_RING ? &iface->rx_ring : &iface->tx_ring;
-
-	/* For RX, the frame looks like:
-	 * - struct tpacket2_hdr
-	 * - padding to 16-byte boundary (this is included in iface->tp_hdrlen)
-	 * - padding: 16 - sizeof(struct ether_hdr)
-	 * - raw packet
-	 * - padding to 16-byte boundary
-	 *
-	 * So the raw packet is aligned so that the data part starts on a
-	 * 16-byte boundary, not the packet header. This means we need an extra
-	 * 16 bytes for the frame size.
-	 *
-	 * The TX frame is simpler:
-	 * - struct tpacket2_hdr
-	 * - padding to 16-byte boundary (this is included in iface->tp_hdrlen)
-	 * - raw packet
-	 * - padding to 16-byte boundary */
-	ring->frame_size = TPACKET_ALIGN(iface->tp_hdrlen) + TPACKET_ALIGN(mtu);
-	if (what == PACKET_RX_RING)
-		ring->frame_size += TPACKET_ALIGNMENT;
-	if (what == PACKET_TX_RING && defaults.tx_ring_bug)
-	{
-		unsigned maxsect;
-
-		/* Kernel 2.6.31 has a bug and it requires a larger frame size
-		 * than what is in fact used */
-		maxsect = (mtu - sizeof(struct aoe_ata_hdr)) / 512;
-		ring->frame_size = TPACKET_ALIGN(sizeof(struct aoe_ata_hdr) +
-			maxsect * 512 + 576 + 32);
-	}
+	struct netif *const iface = q->tx_iface;
+	void *h;
 
-	req.tp_frame_size = ring->frame_size;
+	q->buf = NULL;
+	q->tx_zero_copy = FALSE;
 
-	/* The number of blocks is limited by the kernel implementation */
-	page_size = sysconf(_SC_PAGESIZE);
-	max_blocks = page_size / sizeof(void *);
+	/* The ring is already gone */
+	if (!iface)
+		return;
 
-	/* Start with a large block size and if that fails try to lower it */
-	req.tp_block_size = 64 * 1024;
+	h = iface->tx_ring.frames[q->tx_frame];
+	tx_unreserve(iface, q);
 
-	ret = -1;
-	while (req.tp_block_size > req.tp_frame_size && req.tp_block_size >= page_size)
-	{
-		req.tp_block_nr = ring_size / req.tp_block_size;
-		if (req.tp_block_nr > max_blocks)
-			req.tp_block_nr = max_blocks;
+	/* The kernel stops at the first frame not ready for sending, so the
+	 * frame can not just be abandoned. An empty frame is skipped by the
+	 * kernel since we have PACKET_LOSS set */
+	TX_HDR(iface, h, tp_len) = 0;
+	tx_frame_ready(iface, h);
+}
 
-		req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * req.tp_block_nr;
+/* Send a response whose data has been read into a reserved frame */
+static void tx_send_reserved(struct queue_item *q)
+{
+	struct netif *const iface = q->tx_iface;
+	void *h;
+	void *data;
 
-		ret = setsockopt(iface->fd, SOL_PACKET, what, &req, sizeof(req));
-		if (!ret)
-			break;
-		req.tp_block_size >>= 1;
-	}
-	if (ret)
+	/* The ring was re-allocated while the I/O was in progress */
+	if (!iface)
 	{
-		neterr(iface, "Failed to set up the %s ring buffer", name);
-		memset(ring, 0, sizeof(*ring));
+		q->tx_zero_copy = FALSE;
+		drop_request(q);
 		return;
 	}
 
-	ring->len = req.tp_block_size * req.tp_block_nr;
-	ring->block_size = req.tp_block_size;
-	ring->cnt = req.tp_frame_nr;
-	ring->frames = g_new0(void *, req.tp_frame_nr);
-}
-
-static void destroy_one_ring(struct netif *iface, int what)
-{
-	struct tpacket_req req;
-	struct ring *ring;
+	h = iface->tx_ring.frames[q->tx_frame];
+	tx_unreserve(iface, q);
 
-	ring = what == PACKET_RX_RING ? &iface->rx_ring : &iface->tx_ring;
+	/* The header goes right in front of the data */
+	data = q->buf - q->hdrlen;
+	memcpy(data, &q->aoe_hdr, q->hdrlen);
+	TX_HDR(iface, h, tp_len) = q->hdrlen + q->length;
+	TX_HDR(iface, h, tp_mac) = data - h;
 
-	memset(&req, 0, sizeof(req));
-	setsockopt(iface->fd, SOL_PACKET, what, &req, sizeof(req));
+	iface->stats.tx_bytes += TX_HDR(iface, h, tp_len);
+	++iface->stats.tx_cnt;
+	++iface->stats.tx_zero_copy;
+	if (q->dev && G_UNLIKELY(q->dev->cfg.trace_io))
+		devlog(q->dev, LOG_DEBUG, "%s/%08x: Response sent (zero-copy)",
+			ether_ntoa((struct ether_addr *)&q->aoe_hdr.addr.ether_dhost),
+			(uint32_t)ntohl(q->aoe_hdr.tag));
+
+	q->length = 0;
+	drop_request(q);
+
+	tx_frame_ready(iface, h);
+}
+
+/* Let a write request use the data in the RX frame being processed instead
+ * of copying it */
+int rx_hold(struct queue_item *q, unsigned align)
+{
+	struct netif *const iface = q->iface;
+	struct ring *const ring = &iface->rx_ring;
+	void *data;
+
+	if (!iface->zero_copy_write || iface->rx_frame < 0 || iface->resize_drain ||
+			current_worker != &main_worker)
+		return FALSE;
+
+	/* Do not let long-running writes starve the ring */
+	if (ring->reserved_cnt >= ring->cnt / RX_HOLD_RATIO ||
+			ring->reserved[iface->rx_frame] == 255)
+		return FALSE;
+
+	/* Direct I/O needs aligned buffers. This may fail if the packet
+	 * has an unexpected link-layer header */
+	data = q->buf + q->hdrlen;
+	if ((unsigned long)data % align)
+		return FALSE;
+
+	q->buf = data;
+	q->length -= q->hdrlen;
+	q->rx_zero_copy = TRUE;
+	q->rx_iface = iface;
+	q->rx_frame = iface->rx_frame;
+	q->rx_held_link.data = q;
+	g_queue_push_tail_link(&iface->rx_held, &q->rx_held_link);
+
+	++ring->reserved[iface->rx_frame];
+	++ring->reserved_cnt;
+	++iface->stats.rx_zero_copy;
+	return TRUE;
+}
+
+/* Called when a zero-copy write has been submitted, so its data can no
+ * longer be copied out of the RX frame */
+void rx_submitted(struct queue_item *q)
+{
+	if (!q->rx_held_link.data)
+		return;
+	g_queue_unlink(&q->rx_iface->rx_held, &q->rx_held_link);
+	q->rx_held_link.data = NULL;
+}
+
+/* Called when a zero-copy write no longer needs the RX frame */
+void rx_release(struct queue_item *q)
+{
+	struct netif *const iface = q->rx_iface;
+	struct tpacket2_hdr *h;
+
+	q->buf = NULL;
+	q->rx_zero_copy = FALSE;
+
+	/* The ring is already gone */
+	if (!iface)
+		return;
+	rx_submitted(q);
+	q->rx_iface = NULL;
+
+	--iface->rx_ring.reserved_cnt;
+	if (--iface->rx_ring.reserved[q->rx_frame])
+		return;
+
+	/* rx_ring() will give back the frame if it is still processing it */
+	if (iface->rx_frame == (int)q->rx_frame)
+		return;
+
+	h = iface->rx_ring.frames[q->rx_frame];
+	h->tp_status = TP_STATUS_KERNEL;
+	/* Make sure other CPUs know about the status change */
+	AO_nop_full();
+}
+
+/* Call send() for interfaces that have packets queued in the ring buffer, and
+ * flush the queued responses of interfaces without a ring buffer */
+void run_ifaces(void)
+{
+	GList *l;
+
+	while ((l = g_queue_pop_head_link(&active_ifaces)))
+	{
+		struct netif *iface = l->data;
+
+		iface->is_active = FALSE;
+		if (iface->xsk)
+		{
+			xdp_kick(iface);
+			continue;
+		}
+		if (!iface->tx_ring.frames)
+		{
+			tx_flush(iface);
+			continue;
+		}
+		if (!iface->tx_pending || iface->timer_armed)
+			continue;
+
+		/* Wait a little for more frames if recent send() calls
+		 * could batch multiple frames, i.e. the interface is busy */
+		if (iface->cfg.tx_kick_delay && iface->timer_fd != -1 &&
+				iface->tx_kick_avg >= TX_KICK_DELAY_FRAMES * TX_KICK_AVG_SCALE)
+		{
+			struct itimerspec new, old;
+
+			memset(&new, 0, sizeof(new));
+			new.it_value.tv_nsec = iface->cfg.tx_kick_delay;
+			if (timerfd_settime(iface->timer_fd, 0, &new, &old))
+				neterr(iface, "Failed to arm timer");
+			else
+			{
+				iface->timer_armed = TRUE;
+				continue;
+			}
+		}
+		tx_kick(iface);
+	}
+}
+
+/* Check if the kernel has handed over the next frame of an RX ring */
+static int rx_pending(const struct netif *iface, const struct ring *ring)
+{
+	struct tpacket_block_desc *b;
+	struct tpacket2_hdr *h;
+
+	if (!ring->frames)
+		return FALSE;
+
+	if (iface->tp_version == TPACKET_V3)
+	{
+		b = ring->frames[ring->idx];
+		if (!(b->hdr.bh1.block_status & TP_STATUS_USER))
+			return FALSE;
+	}
+	else
+	{
+		h = ring->frames[ring->idx];
+		if (ring->reserved[ring->idx] || !h->tp_status)
+			return FALSE;
+	}
+
+	/* Make sure the frame contents are read after the status */
+	AO_nop_read();
+	return TRUE;
+}
+
+/* Look for received packets in the RX rings without entering the kernel.
+ * Returns the number of rings that had packets waiting */
+int poll_ifaces(void)
+{
+	struct netif *iface;
+	unsigned i, j;
+	int cnt;
+
+	cnt = 0;
+	for (i = 0; i < ifaces->len; i++)
+	{
+		iface = g_ptr_array_index(ifaces, i);
+		if (iface->rx_paused)
+			continue;
+		if (rx_pending(iface, &iface->rx_ring))
+		{
+			net_io(EPOLLIN, iface);
+			++cnt;
+		}
+		for (j = 0; j < iface->rxq_cnt; j++)
+		{
+			if (!rx_pending(iface, &iface->rxq[j].ring))
+				continue;
+			rxq_io(EPOLLIN, &iface->rxq[j]);
+			++cnt;
+		}
+	}
+	if (shared_iface && rx_pending(shared_iface, &shared_iface->rx_ring))
+	{
+		shared_io(EPOLLIN, shared_iface);
+		++cnt;
+	}
+	return cnt;
+}
+
+/* Tell the kernel to send the frames marked in the TX ring */
+static void tx_kick(struct netif *iface)
+{
+	struct itimerspec new, old;
+	int ret;
+
+	ret = send(iface->fd, NULL, 0, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (ret == -1 && errno != EAGAIN)
+		neterr(iface, "Async write error");
+	else
+		++iface->stats.tx_runs;
+
+	iface->stats.tx_kick_frames += iface->tx_pending;
+	if (iface->tx_pending > iface->stats.tx_kick_max)
+		iface->stats.tx_kick_max = iface->tx_pending;
+	iface->tx_kick_avg += iface->tx_pending * (TX_KICK_AVG_SCALE / TX_KICK_AVG_WEIGHT) -
+		iface->tx_kick_avg / TX_KICK_AVG_WEIGHT;
+	iface->tx_pending = 0;
+
+	if (iface->timer_armed)
+	{
+		memset(&new, 0, sizeof(new));
+		timerfd_settime(iface->timer_fd, 0, &new, &old);
+		iface->timer_armed = FALSE;
+	}
+
+	/* Keep the occupancy statistics meaningful */
+	tx_reclaim(iface);
+}
+
+/* timerfd callback for delayed send() */
+static void iface_timer(uint32_t events G_GNUC_UNUSED, void *data)
+{
+	struct netif *const iface = data;
+	uint64_t expires;
+	int ret;
+
+	ret = read(iface->timer_fd, &expires, sizeof(expires));
+	if (ret == -1)
+	{
+		if (errno != EAGAIN)
+			neterr(iface, "Timer read");
+		return;
+	}
+
+	iface->timer_armed = FALSE;
+	++iface->stats.tx_kick_timer;
+	if (iface->tx_pending && iface->tx_ring.frames)
+		tx_kick(iface);
+}
+
+static void setup_one_ring(struct netif *iface, int fd, struct ring *ring,
+	const struct netif_config *cfg, unsigned ring_size, int mtu, int zero_copy,
+	int what)
+{
+	unsigned page_size, max_blocks;
+	struct tpacket_req3 req;
+	socklen_t reqlen;
+	const char *name;
+	int ret;
+
+	name = what == PACKET_RX_RING ? "RX" : "TX";
+
+	/* For RX, the frame looks like:
+	 * - struct tpacket2_hdr
+	 * - padding to 16-byte boundary (this is included in iface->tp_hdrlen)
+	 * - padding: 16 - sizeof(struct ether_hdr)
+	 * - raw packet
+	 * - padding to 16-byte boundary
+	 *
+	 * So the raw packet is aligned so that the data part starts on a
+	 * 16-byte boundary, not the packet header. This means we need an extra
+	 * 16 bytes for the frame size.
+	 *
+	 * The TX frame is simpler:
+	 * - struct tpacket2_hdr
+	 * - padding to 16-byte boundary (this is included in iface->tp_hdrlen)
+	 * - raw packet
+	 * - padding to 16-byte boundary
+	 *
+	 * For zero-copy reads the TX frame also needs some slack so the data
+	 * part of the packet can be aligned for direct I/O.
+	 *
+	 * With TPACKET_V3 the RX frames are packed into the blocks, so the frame
+	 * size is only the upper limit. */
+	ring->frame_size = TPACKET_ALIGN(iface->tp_hdrlen) + TPACKET_ALIGN(mtu);
+	if (what == PACKET_RX_RING)
+		ring->frame_size += TPACKET_ALIGNMENT;
+	if (what == PACKET_TX_RING && defaults.tx_ring_bug)
+	{
+		unsigned maxsect;
+
+		/* Kernel 2.6.31 has a bug and it requires a larger frame size
+		 * than what is in fact used */
+		maxsect = (mtu - sizeof(struct aoe_ata_hdr)) / 512;
+		ring->frame_size = TPACKET_ALIGN(sizeof(struct aoe_ata_hdr) +
+			maxsect * 512 + 576 + 32);
+	}
+	if (what == PACKET_TX_RING && zero_copy)
+		ring->frame_size += ZERO_COPY_ALIGN;
+	/* With zero-copy writes the start of the frames must be aligned, and
+	 * iface->rx_reserve places the data part on an aligned boundary */
+	if (what == PACKET_RX_RING && zero_copy)
+		ring->frame_size = (RX_NETOFF + iface->rx_reserve + mtu +
+			ZERO_COPY_ALIGN - 1) & ~(ZERO_COPY_ALIGN - 1);
+
+	memset(&req, 0, sizeof(req));
+	req.tp_frame_size = ring->frame_size;
+	reqlen = sizeof(struct tpacket_req);
+	if (iface->tp_version == TPACKET_V3)
+	{
+		reqlen = sizeof(req);
+		if (what == PACKET_RX_RING)
+			req.tp_retire_blk_tov = cfg->rx_block_timeout;
+	}
+
+	/* The number of blocks is limited by the kernel implementation */
+	page_size = sysconf(_SC_PAGESIZE);
+	max_blocks = page_size / sizeof(void *);
+
+	/* Start with a large block size and if that fails try to lower it.
+	 * Blocks should hold a few frames even with jumbo frames */
+	req.tp_block_size = 64 * 1024;
+	while (req.tp_block_size < RING_BLOCK_FRAMES * req.tp_frame_size)
+		req.tp_block_size <<= 1;
+
+	ret = -1;
+	while (req.tp_block_size > req.tp_frame_size && req.tp_block_size >= page_size)
+	{
+		req.tp_block_nr = ring_size / req.tp_block_size;
+		if (req.tp_block_nr > max_blocks)
+			req.tp_block_nr = max_blocks;
+
+		req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * req.tp_block_nr;
+
+		ret = setsockopt(fd, SOL_PACKET, what, &req, reqlen);
+		if (!ret)
+			break;
+		req.tp_block_size >>= 1;
+	}
+	if (ret)
+	{
+		neterr(iface, "Failed to set up the %s ring buffer", name);
+		memset(ring, 0, sizeof(*ring));
+		return;
+	}
+
+	ring->len = req.tp_block_size * req.tp_block_nr;
+	ring->block_size = req.tp_block_size;
+	ring->cnt = req.tp_frame_nr;
+	/* TPACKET_V3 RX rings are processed a block at a time */
+	if (iface->tp_version == TPACKET_V3 && what == PACKET_RX_RING)
+	{
+		ring->frame_size = req.tp_block_size;
+		ring->cnt = req.tp_block_nr;
+	}
+	ring->frames = g_new0(void *, ring->cnt);
+	ring->reserved = g_new0(unsigned char, ring->cnt);
+}
+
+static void destroy_one_ring(struct netif *iface, int what)
+{
+	struct tpacket_req3 req;
+	struct ring *ring;
+
+	ring = what == PACKET_RX_RING ? &iface->rx_ring : &iface->tx_ring;
+
+	memset(&req, 0, sizeof(req));
+	setsockopt(iface->fd, SOL_PACKET, what, &req, sizeof(req));
 	g_free(ring->frames);
+	g_free(ring->reserved);
 	memset(ring, 0, sizeof(*ring));
 }
 
@@ -432,37 +1191,75 @@ static void setup_frames(struct ring *ring, void *data)
 			ring->frames[cnt++] = data + i * ring->block_size + j * ring->frame_size;
 }
 
+/* Keep an automatically sized ring within the configured limits */
+static unsigned clamp_ring_size(const struct netif_config *cfg, unsigned size)
+{
+	if (size < (unsigned)cfg->ring_min_size * 1024)
+		size = cfg->ring_min_size * 1024;
+	if (size > (unsigned)cfg->ring_max_size * 1024)
+		size = cfg->ring_max_size * 1024;
+	return size;
+}
+
 /* Allocate and map the shared ring buffer */
-static void setup_rings(struct netif *iface, unsigned size, int mtu)
+static void setup_rings(struct netif *iface, const struct netif_config *cfg, int mtu)
 {
+	const unsigned size = cfg->ring_size;
+	int ret, val, loss, has_off, reserve;
 	const char *unit;
 	socklen_t len;
-	int ret, val;
 
 	/* The function can be called on MTU change, so destroy the previous ring
 	 * if any */
+	iface->zero_copy_read = FALSE;
+	iface->zero_copy_write = FALSE;
 	if (iface->ring_ptr)
 	{
+		forget_ring_frames(iface);
 		munmap(iface->ring_ptr, iface->ring_len);
 		iface->ring_ptr = NULL;
 		iface->ring_len = 0;
 		destroy_one_ring(iface, PACKET_RX_RING);
 		destroy_one_ring(iface, PACKET_TX_RING);
+		iface->tx_pending = 0;
 	}
 
 	if (!size)
 		return;
 
-	/* We want version 2 ring buffers to avoid 64-bit uncleanness */
-	val = TPACKET_V2;
-	ret = setsockopt(iface->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val));
-	if (ret)
+	/* The RX and TX rings share the requested size, unless they are sized
+	 * automatically and have already been adjusted */
+	if (!cfg->ring_auto_size || !iface->rx_ring_size)
+		iface->rx_ring_size = iface->tx_ring_size = size * 1024 / 2;
+	if (cfg->ring_auto_size)
 	{
-		neterr(iface, "Failed to set version 2 ring buffer format");
-		return;
+		iface->rx_ring_size = clamp_ring_size(cfg, iface->rx_ring_size);
+		iface->tx_ring_size = clamp_ring_size(cfg, iface->tx_ring_size);
 	}
 
+	/* We want at least version 2 ring buffers to avoid 64-bit uncleanness */
 	val = TPACKET_V2;
+	if (cfg->rx_ring_v3)
+	{
+		val = TPACKET_V3;
+		ret = setsockopt(iface->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val));
+		if (ret)
+		{
+			neterr(iface, "Failed to set version 3 ring buffer format");
+			val = TPACKET_V2;
+		}
+	}
+	if (val == TPACKET_V2)
+	{
+		ret = setsockopt(iface->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val));
+		if (ret)
+		{
+			neterr(iface, "Failed to set version 2 ring buffer format");
+			return;
+		}
+	}
+	iface->tp_version = val;
+
 	len = sizeof(val);
 	ret = getsockopt(iface->fd, SOL_PACKET, PACKET_HDRLEN, &val, &len);
 	if (ret)
@@ -477,11 +1274,42 @@ static void setup_rings(struct netif *iface, unsigned size, int mtu)
 	ret = setsockopt(iface->fd, SOL_PACKET, PACKET_LOSS, &val, sizeof(val));
 	if (ret)
 		neterr(iface, "Failed to set packet drop mode");
+	loss = !ret;
+
+	/* Zero-copy reads place the packet at varying offsets inside the
+	 * TX frames */
+	has_off = FALSE;
+	if (cfg->zero_copy_read && loss)
+	{
+		val = 1;
+		ret = setsockopt(iface->fd, SOL_PACKET, PACKET_TX_HAS_OFF, &val, sizeof(val));
+		if (ret)
+			neterr(iface, "Failed to enable zero-copy reads");
+		has_off = !ret;
+	}
+
+	/* Zero-copy writes need the data part of the received packets to be
+	 * aligned, so shift the packets inside the RX frames */
+	reserve = 0;
+	if (cfg->zero_copy_write && iface->tp_version == TPACKET_V2)
+	{
+		val = RX_NETOFF - ETH_HLEN + sizeof(struct aoe_ata_hdr);
+		reserve = (ZERO_COPY_ALIGN - val % ZERO_COPY_ALIGN) % ZERO_COPY_ALIGN;
+	}
+	if ((unsigned)reserve != iface->rx_reserve)
+	{
+		ret = setsockopt(iface->fd, SOL_PACKET, PACKET_RESERVE, &reserve, sizeof(reserve));
+		if (ret)
+			neterr(iface, "Failed to set the RX frame headroom");
+		else
+			iface->rx_reserve = reserve;
+	}
 
-	/* The RX and TX rings share the memory mapped area, so give
-	 * half the requested size to each */
-	setup_one_ring(iface, size * 1024 / 2, mtu, PACKET_RX_RING);
-	setup_one_ring(iface, size * 1024 / 2, mtu, PACKET_TX_RING);
+	/* The RX and TX rings share the memory mapped area */
+	setup_one_ring(iface, iface->fd, &iface->rx_ring, cfg, iface->rx_ring_size, mtu,
+		reserve > 0 && iface->rx_reserve == (unsigned)reserve, PACKET_RX_RING);
+	setup_one_ring(iface, iface->fd, &iface->tx_ring, cfg, iface->tx_ring_size, mtu,
+		has_off, PACKET_TX_RING);
 
 	/* Both rings must be mapped using a single mmap() call */
 	iface->ring_len = iface->rx_ring.len + iface->tx_ring.len;
@@ -491,184 +1319,1360 @@ static void setup_rings(struct netif *iface, unsigned size, int mtu)
 		MAP_SHARED, iface->fd, 0);
 	if (iface->ring_ptr == MAP_FAILED)
 	{
-		neterr(iface, "Failed to mmap the ring buffer");
-		destroy_one_ring(iface, PACKET_RX_RING);
-		destroy_one_ring(iface, PACKET_TX_RING);
-		iface->ring_ptr = NULL;
-		iface->ring_len = 0;
+		neterr(iface, "Failed to mmap the ring buffer");
+		destroy_one_ring(iface, PACKET_RX_RING);
+		destroy_one_ring(iface, PACKET_TX_RING);
+		iface->ring_ptr = NULL;
+		iface->ring_len = 0;
+		return;
+	}
+
+	len = 0;
+	if (iface->rx_ring.len)
+	{
+		setup_frames(&iface->rx_ring, iface->ring_ptr);
+		len = iface->rx_ring.len;
+		iface->zero_copy_write = reserve > 0 &&
+			iface->rx_reserve == (unsigned)reserve;
+	}
+	if (iface->tx_ring.len)
+	{
+		setup_frames(&iface->tx_ring, iface->ring_ptr + len);
+		iface->zero_copy_read = has_off;
+	}
+
+	len = human_format(iface->ring_len, &unit);
+	if (iface->tp_version == TPACKET_V3)
+		netlog(iface, LOG_INFO, "Set up %u %s ring buffer (%u RX blocks/%u TX packets)",
+			len, unit, iface->rx_ring.cnt, iface->tx_ring.cnt);
+	else
+		netlog(iface, LOG_INFO, "Set up %u %s ring buffer (%u RX/%u TX packets)",
+			len, unit, iface->rx_ring.cnt, iface->tx_ring.cnt);
+}
+
+/**********************************************************************
+ * Multiple RX queues
+ */
+
+/* Receive packets arriving on an additional RX queue */
+static void rxq_io(uint32_t events G_GNUC_UNUSED, void *data)
+{
+	struct rx_queue *const rxq = data;
+
+	/* The socket may have been set up after receiving was paused */
+	if (G_UNLIKELY(rxq->iface->rx_paused))
+	{
+		modify_fd(rxq->fd, &rxq->event_ctx, 0);
+		return;
+	}
+
+	if (rxq->iface->tp_version == TPACKET_V3)
+		rx_ring_v3(rxq->iface, &rxq->ring, rxq->fd);
+	else
+		rx_ring(rxq->iface, &rxq->ring, rxq->fd);
+}
+
+/* Add a socket to the fanout group of the interface. The first socket lets
+ * the kernel pick an ID that is not used by anyone else, so other processes
+ * listening on the same interface are not affected */
+static int join_fanout(struct netif *iface, int fd, int mode)
+{
+	socklen_t len;
+	int val;
+
+	mode = mode == RX_FANOUT_CPU ? PACKET_FANOUT_CPU : PACKET_FANOUT_QM;
+	if (iface->fanout_id < 0)
+		val = (mode | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+	else
+		val = mode << 16 | iface->fanout_id;
+	if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &val, sizeof(val)))
+		return -1;
+
+	if (iface->fanout_id < 0)
+	{
+		len = sizeof(val);
+		if (getsockopt(fd, SOL_PACKET, PACKET_FANOUT, &val, &len))
+			return -1;
+		iface->fanout_id = val & 0xffff;
+	}
+	return 0;
+}
+
+static void close_rx_queue(struct rx_queue *rxq)
+{
+	if (rxq->ring_ptr)
+		munmap(rxq->ring_ptr, rxq->ring_len);
+	g_free(rxq->ring.frames);
+	g_free(rxq->ring.reserved);
+	close(rxq->fd);
+	memset(rxq, 0, sizeof(*rxq));
+	rxq->fd = -1;
+}
+
+/* Open an additional receive socket with its own ring buffer */
+static int open_rx_queue(struct netif *iface, struct rx_queue *rxq,
+	const struct netif_config *cfg, int mtu)
+{
+	static struct sock_filter drop_all = BPF_STMT(BPF_RET+BPF_K, 0);
+	struct sockaddr_ll sa;
+	struct sock_fprog prog;
+	int val;
+
+	rxq->iface = iface;
+	rxq->event_ctx.callback = rxq_io;
+	rxq->event_ctx.data = rxq;
+
+	rxq->fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_AOE));
+	if (rxq->fd == -1)
+	{
+		neterr(iface, "Failed to allocate a socket for an RX queue");
+		return -1;
+	}
+
+	/* The frames are parsed the same way as on the main socket */
+	val = iface->tp_version;
+	if (setsockopt(rxq->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val)))
+	{
+		neterr(iface, "Failed to set the ring buffer format of an RX queue");
+		goto error;
+	}
+
+	setup_one_ring(iface, rxq->fd, &rxq->ring, cfg, iface->rx_ring_size, mtu,
+		FALSE, PACKET_RX_RING);
+	if (!rxq->ring.frames)
+		goto error;
+	rxq->ring_len = rxq->ring.len;
+	rxq->ring_ptr = mmap(NULL, rxq->ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED, rxq->fd, 0);
+	if (rxq->ring_ptr == MAP_FAILED)
+	{
+		neterr(iface, "Failed to mmap the ring buffer of an RX queue");
+		rxq->ring_ptr = NULL;
+		goto error;
+	}
+	setup_frames(&rxq->ring, rxq->ring_ptr);
+
+	/* A socket can only join the group after binding, so it must not
+	 * take packets until then or they would be processed twice */
+	prog.filter = &drop_all;
+	prog.len = 1;
+	if (setsockopt(rxq->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
+	{
+		neterr(iface, "Failed to set up the socket filter of an RX queue");
+		goto error;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sll_family = AF_PACKET;
+	sa.sll_protocol = htons(ETH_P_AOE);
+	sa.sll_ifindex = iface->ifindex;
+	if (bind(rxq->fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+	{
+		neterr(iface, "bind() failed for an RX queue");
+		goto error;
+	}
+
+	if (join_fanout(iface, rxq->fd, cfg->rx_fanout))
+	{
+		neterr(iface, "Failed to join the fanout group");
+		goto error;
+	}
+
+	add_fd(rxq->fd, &rxq->event_ctx);
+	return 0;
+
+error:
+	close_rx_queue(rxq);
+	return -1;
+}
+
+static void destroy_rx_queues(struct netif *iface)
+{
+	unsigned i;
+
+	for (i = 0; i < iface->rxq_cnt; i++)
+	{
+		del_fd(iface->rxq[i].fd);
+		close_rx_queue(&iface->rxq[i]);
+	}
+	g_free(iface->rxq);
+	iface->rxq = NULL;
+	iface->rxq_cnt = 0;
+}
+
+/* (Re-)create the additional receive sockets. All sockets of the interface
+ * are put into a fanout group, so the kernel spreads the incoming packets
+ * between their rings instead of copying them to all */
+static void setup_rx_queues(struct netif *iface, const struct netif_config *cfg, int mtu)
+{
+	unsigned i;
+
+	destroy_rx_queues(iface);
+	if (cfg->rx_queues < 2)
+		return;
+
+	if (iface->xsk)
+		return netlog(iface, LOG_WARNING, "RX queues are not supported "
+			"with the XDP transport");
+	if (!iface->rx_ring.frames)
+		return netlog(iface, LOG_WARNING, "RX queues need a ring buffer");
+
+	/* The main socket stays in the group until it is closed */
+	if (iface->fanout_id < 0 && join_fanout(iface, iface->fd, cfg->rx_fanout))
+		return neterr(iface, "Failed to set up the fanout group");
+
+	iface->rxq = g_new0(struct rx_queue, cfg->rx_queues - 1);
+	for (i = 0; i < (unsigned)cfg->rx_queues - 1; i++)
+	{
+		if (open_rx_queue(iface, &iface->rxq[iface->rxq_cnt], cfg, mtu))
+			break;
+		++iface->rxq_cnt;
+	}
+
+	/* The new sockets need the real filter */
+	update_filter(iface);
+
+	netlog(iface, LOG_INFO, "Receiving on %u sockets, spread by %s",
+		iface->rxq_cnt + 1, cfg->rx_fanout == RX_FANOUT_CPU ? "CPU" : "RX queue");
+}
+
+/**********************************************************************
+ * Automatic ring sizing
+ */
+
+/* Double the size of a ring that has overflowed since the last check, and
+ * halve it if it has been mostly empty for a while */
+static unsigned adjust_ring_size(const struct netif_config *cfg, unsigned size,
+	const struct ring *ring, int overflow, unsigned peak, unsigned *quiet)
+{
+	if (overflow)
+	{
+		*quiet = 0;
+		size *= 2;
+	}
+	else if (peak < ring->cnt / RING_IDLE_RATIO)
+	{
+		if (++*quiet >= RING_SHRINK_CHECKS)
+		{
+			*quiet = 0;
+			size /= 2;
+		}
+	}
+	else
+		*quiet = 0;
+	return clamp_ring_size(cfg, size);
+}
+
+/* Stop draining the rings of an interface, and restart receiving unless
+ * something else still holds it back */
+static void end_drain(struct netif *iface)
+{
+	iface->resize_drain = 0;
+	if (iface->rx_paused && rx_can_resume(iface))
+		pause_rx(iface, FALSE);
+}
+
+/* Try to finish a pending resize. Nothing new is received and no frame is
+ * reserved while draining, so the frames in use are released as the
+ * kernel sends the queued responses and the running requests complete */
+static void drain_rings(struct netif *iface)
+{
+	unsigned i;
+
+	pause_workers();
+
+	/* Hand the queued frames to the kernel, and process what has been
+	 * received before receiving was paused */
+	if (iface->tx_pending)
+		tx_kick(iface);
+	else
+		tx_reclaim(iface);
+	if (iface->tp_version == TPACKET_V3)
+		rx_ring_v3(iface, &iface->rx_ring, iface->fd);
+	else
+		rx_ring(iface, &iface->rx_ring, iface->fd);
+	for (i = 0; i < iface->rxq_cnt; i++)
+	{
+		if (iface->tp_version == TPACKET_V3)
+			rx_ring_v3(iface, &iface->rxq[i].ring, iface->rxq[i].fd);
+		else
+			rx_ring(iface, &iface->rxq[i].ring, iface->rxq[i].fd);
+	}
+
+	if (!iface->rx_ring.reserved_cnt && !iface->tx_ring.reserved_cnt &&
+			!iface->tx_ring.used)
+	{
+		iface->resize_pending = FALSE;
+		netlog(iface, LOG_INFO, "Resizing the rings (RX: %u KiB, TX: %u KiB)",
+			iface->rx_ring_size / 1024, iface->tx_ring_size / 1024);
+		setup_rings(iface, &iface->cfg, iface->mtu);
+		setup_rx_queues(iface, &iface->cfg, iface->mtu);
+		end_drain(iface);
+	}
+	else if (!--iface->resize_drain)
+	{
+		/* Do not keep the interface deaf; the next check tries again */
+		netlog(iface, LOG_INFO, "Frames still in use, postponing the resize of the rings");
+		end_drain(iface);
+	}
+
+	resume_workers();
+}
+
+/* Re-size the rings of an interface if the traffic asks for it. The rings
+ * can only be re-created when no frame is in use by a request or by the
+ * kernel, so receiving is paused until drain_rings() gets there */
+static void check_ring_size(struct netif *iface)
+{
+	unsigned rx, tx;
+	int rx_full, tx_full;
+
+	/* Clearing the statistics also resets the counters */
+	rx_full = iface->stats.rx_buffers_full > iface->last_rx_full;
+	tx_full = iface->stats.tx_buffers_full > iface->last_tx_full;
+	iface->last_rx_full = iface->stats.rx_buffers_full;
+	iface->last_tx_full = iface->stats.tx_buffers_full;
+
+	rx = adjust_ring_size(&iface->cfg, iface->rx_ring_size, &iface->rx_ring,
+		rx_full, iface->rx_peak, &iface->rx_quiet);
+	tx = adjust_ring_size(&iface->cfg, iface->tx_ring_size, &iface->tx_ring,
+		tx_full, iface->tx_peak, &iface->tx_quiet);
+	iface->rx_peak = iface->tx_peak = 0;
+
+	if (rx != iface->rx_ring_size || tx != iface->tx_ring_size)
+	{
+		iface->rx_ring_size = rx;
+		iface->tx_ring_size = tx;
+		iface->resize_pending = TRUE;
+	}
+	if (!iface->resize_pending)
+		return;
+
+	iface->resize_drain = RING_DRAIN_TRIES;
+	if (!iface->rx_paused)
+		pause_rx(iface, TRUE);
+	drain_rings(iface);
+}
+
+/* Arm the resize timer for the periodic checks, or for the quicker retries
+ * while some rings are being drained */
+static int arm_resize_timer(int drain)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (drain)
+		its.it_value.tv_nsec = its.it_interval.tv_nsec = RING_DRAIN_INTERVAL * 1000000;
+	else
+		its.it_value.tv_sec = its.it_interval.tv_sec = RING_CHECK_INTERVAL;
+	if (timerfd_settime(resize_timer_fd, 0, &its, NULL))
+		return -1;
+	resize_draining = drain;
+	return 0;
+}
+
+/* timerfd callback for the ring size checks */
+static void resize_timer(uint32_t events G_GNUC_UNUSED, void *data G_GNUC_UNUSED)
+{
+	struct netif *iface;
+	uint64_t expires;
+	unsigned i;
+	int drain;
+
+	if (read(resize_timer_fd, &expires, sizeof(expires)) == -1)
+	{
+		if (errno != EAGAIN)
+			logerr("Resize timer read");
+		return;
+	}
+
+	drain = FALSE;
+	for (i = 0; i < ifaces->len; i++)
+	{
+		iface = g_ptr_array_index(ifaces, i);
+		if (!iface->cfg.ring_auto_size || !iface->ring_ptr)
+		{
+			/* The configuration has changed under the drain */
+			if (iface->resize_drain)
+				end_drain(iface);
+			continue;
+		}
+
+		if (!resize_draining)
+			check_ring_size(iface);
+		else if (iface->resize_drain)
+			drain_rings(iface);
+		if (iface->resize_drain)
+			drain = TRUE;
+	}
+
+	if (drain != resize_draining && arm_resize_timer(drain))
+		logerr("Failed to re-arm the resize timer");
+}
+
+/* Start the periodic ring size checks if they are not running yet */
+static void start_resize_timer(void)
+{
+	if (resize_timer_fd != -1)
+		return;
+
+	resize_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (resize_timer_fd == -1)
+		return logerr("Failed to create timerfd, automatic ring sizing disabled");
+
+	if (arm_resize_timer(FALSE))
+	{
+		logerr("Failed to arm the resize timer");
+		close(resize_timer_fd);
+		resize_timer_fd = -1;
+		return;
+	}
+
+	resize_ctx.callback = resize_timer;
+	add_fd(resize_timer_fd, &resize_ctx);
+}
+
+/**********************************************************************
+ * Shared socket
+ */
+
+/* Receive the packets arriving on the shared socket, and hand them to the
+ * interface they came from */
+static void rx_shared(void)
+{
+	struct ring *const ring = &shared_iface->rx_ring;
+	struct tpacket2_hdr *h;
+	struct sockaddr_ll *sll;
+	struct netif *iface;
+	struct timespec tv;
+	unsigned cnt;
+
+	for (cnt = 0; cnt < ring->cnt; ++cnt)
+	{
+		h = ring->frames[ring->idx];
+		if (!h->tp_status)
+			break;
+
+		if (++ring->idx >= ring->cnt)
+			ring->idx = 0;
+
+		/* The kernel puts the link-level address after the header */
+		sll = (void *)h + TPACKET_ALIGN(sizeof(*h));
+		iface = g_hash_table_lookup(shared_map, GINT_TO_POINTER(sll->sll_ifindex));
+		if (!iface)
+			goto next;
+
+		if (G_UNLIKELY(h->tp_snaplen < sizeof(struct aoe_hdr) ||
+				h->tp_snaplen < h->tp_len))
+		{
+			netlog(iface, LOG_DEBUG, "Packet too short or does not fit the shared ring");
+			++iface->stats.dropped;
+			goto next;
+		}
+
+		tv.tv_sec = h->tp_sec;
+		tv.tv_nsec = h->tp_nsec;
+		process_packet(iface, (void *)h + h->tp_mac, h->tp_snaplen, &tv);
+
+next:
+		h->tp_status = TP_STATUS_KERNEL;
+		/* Make sure other CPUs know about the status change */
+		AO_nop_full();
+	}
+	if (cnt >= ring->cnt)
+		++shared_iface->stats.rx_buffers_full;
+}
+
+static void shared_io(uint32_t events, void *data G_GNUC_UNUSED)
+{
+	GPtrArray *congested;
+	unsigned i;
+
+	/* Interfaces that are still congested add themselves back */
+	if (events & EPOLLOUT)
+	{
+		congested = shared_congested;
+		shared_congested = g_ptr_array_new();
+		for (i = 0; i < congested->len; i++)
+			net_io(EPOLLOUT, g_ptr_array_index(congested, i));
+		g_ptr_array_free(congested, TRUE);
+
+		if (!shared_congested->len)
+			modify_fd(shared_iface->fd, &shared_iface->event_ctx, EPOLLIN);
+	}
+
+	if (events & EPOLLIN)
+		rx_shared();
+}
+
+/* Wait for the shared socket to become writable */
+static void congest_shared(struct netif *iface)
+{
+	g_ptr_array_add(shared_congested, iface);
+	if (shared_congested->len == 1)
+		modify_fd(shared_iface->fd, &shared_iface->event_ctx, EPOLLIN | EPOLLOUT);
+}
+
+/* Keep the packets of the interfaces that have sockets of their own away
+ * from the shared socket */
+static void update_shared_filter(void)
+{
+	struct sock_filter insns[SHARED_FILTER_MAX + 3];
+	struct sock_fprog prog;
+	struct netif *iface;
+	unsigned i, n;
+
+	if (!shared_iface)
+		return;
+
+	n = 0;
+	insns[n++] = (struct sock_filter)BPF_STMT(BPF_LD+BPF_W+BPF_ABS,
+		SKF_AD_OFF + SKF_AD_IFINDEX);
+	for (i = 0; i < ifaces->len; i++)
+	{
+		iface = g_ptr_array_index(ifaces, i);
+		if (iface->shared || iface->fd == -1)
+			continue;
+
+		/* Let userspace sort it out if there are too many */
+		if (n > SHARED_FILTER_MAX)
+		{
+			netlog(shared_iface, LOG_NOTICE, "Too many dedicated interfaces "
+				"to filter");
+			setsockopt(shared_iface->fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+			return;
+		}
+		insns[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K,
+			iface->ifindex, 0, 0);
+	}
+	insns[n] = (struct sock_filter)BPF_STMT(BPF_RET+BPF_K, -1);
+	insns[n + 1] = (struct sock_filter)BPF_STMT(BPF_RET+BPF_K, 0);
+
+	/* Point the matches to the final reject */
+	for (i = 1; i < n; i++)
+		insns[i].jt = n - i;
+
+	prog.filter = insns;
+	prog.len = n + 2;
+	if (setsockopt(shared_iface->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
+		neterr(shared_iface, "Failed to set up the socket filter");
+}
+
+static void free_shared(struct netif *s)
+{
+	unsigned i;
+
+	for (i = 0; s->wtx && i < nworkers; i++)
+		if (s->wtx[i].fd != -1)
+			close(s->wtx[i].fd);
+	g_free(s->wtx);
+
+	if (s->ring_ptr)
+		munmap(s->ring_ptr, s->ring_len);
+	g_free(s->rx_ring.frames);
+	g_free(s->rx_ring.reserved);
+	if (s->fd != -1)
+		close(s->fd);
+	g_free(s->name);
+	g_slice_free(struct netif, s);
+}
+
+/* Create the shared socket. It is not bound to any interface, and only has
+ * an RX ring; responses are sent using sendmmsg() with the address of the
+ * interface */
+static int open_shared(void)
+{
+	struct netif_config cfg;
+	struct sockaddr_ll sa;
+	const char *unit;
+	struct netif *s;
+	socklen_t len;
+	unsigned i;
+	int val;
+
+	if (!defaults.ring_size)
+	{
+		logit(LOG_ERR, "net/shared: The shared socket needs a ring buffer");
+		return -1;
+	}
+
+	s = g_slice_new0(struct netif);
+	s->name = g_strdup("shared");
+	s->timer_fd = -1;
+	s->rx_frame = -1;
+	s->fanout_id = -1;
+	s->event_ctx.callback = shared_io;
+	s->event_ctx.data = s;
+
+	/* The frames have to hold the largest packet of any interface */
+	s->mtu = defaults.mtu ? defaults.mtu : ETH_DATA_LEN;
+
+	s->fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_AOE));
+	if (s->fd == -1)
+	{
+		neterr(s, "Failed to allocate network socket");
+		goto error;
+	}
+
+	val = TPACKET_V2;
+	if (setsockopt(s->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val)))
+	{
+		neterr(s, "Failed to set version 2 ring buffer format");
+		goto error;
+	}
+	s->tp_version = val;
+
+	len = sizeof(val);
+	if (getsockopt(s->fd, SOL_PACKET, PACKET_HDRLEN, &val, &len))
+	{
+		neterr(s, "Failed to determine the header length of the ring buffer");
+		goto error;
+	}
+	s->tp_hdrlen = TPACKET_ALIGN(val);
+
+	/* There is no TX ring, so the RX ring may have all the space */
+	memset(&cfg, 0, sizeof(cfg));
+	setup_one_ring(s, s->fd, &s->rx_ring, &cfg, defaults.ring_size * 1024, s->mtu,
+		FALSE, PACKET_RX_RING);
+	if (!s->rx_ring.frames)
+		goto error;
+	s->ring_len = s->rx_ring.len;
+	s->ring_ptr = mmap(NULL, s->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+	if (s->ring_ptr == MAP_FAILED)
+	{
+		neterr(s, "Failed to mmap the ring buffer");
+		s->ring_ptr = NULL;
+		goto error;
+	}
+	setup_frames(&s->rx_ring, s->ring_ptr);
+
+	/* Install the filter before packets start to arrive */
+	shared_iface = s;
+	update_shared_filter();
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sll_family = AF_PACKET;
+	sa.sll_protocol = htons(ETH_P_AOE);
+	if (bind(s->fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+	{
+		neterr(s, "bind() failed");
+		shared_iface = NULL;
+		goto error;
+	}
+	add_fd(s->fd, &s->event_ctx);
+
+	if (nworkers)
+		s->wtx = g_new0(struct worker_tx, nworkers);
+	for (i = 0; i < nworkers; i++)
+	{
+		s->wtx[i].iface = s;
+		s->wtx[i].fd = -1;
+	}
+	open_worker_tx(s);
+
+	shared_map = g_hash_table_new(g_direct_hash, g_direct_equal);
+	shared_congested = g_ptr_array_new();
+
+	val = human_format(s->ring_len, &unit);
+	netlog(s, LOG_INFO, "Set up %d %s ring buffer (%u packets, MTU: %d)",
+		val, unit, s->rx_ring.cnt, s->mtu);
+	return 0;
+
+error:
+	free_shared(s);
+	return -1;
+}
+
+/* Let an interface use the shared socket */
+static int join_shared(struct netif *iface)
+{
+	unsigned i;
+
+	if (!shared_iface && open_shared())
+		return -1;
+
+	iface->fd = shared_iface->fd;
+	iface->shared = TRUE;
+	for (i = 0; i < nworkers; i++)
+		iface->wtx[i].fd = shared_iface->wtx[i].fd;
+	g_hash_table_insert(shared_map, GINT_TO_POINTER(iface->ifindex), iface);
+	return 0;
+}
+
+/* Called when an interface using the shared socket goes away. The socket is
+ * closed when the last interface leaves */
+static void leave_shared(struct netif *iface)
+{
+	g_hash_table_remove(shared_map, GINT_TO_POINTER(iface->ifindex));
+	g_ptr_array_remove(shared_congested, iface);
+	iface->fd = -1;
+	iface->shared = FALSE;
+
+	if (g_hash_table_size(shared_map))
+		return;
+
+	netlog(shared_iface, LOG_DEBUG, "Shutting down");
+	del_fd(shared_iface->fd);
+	free_shared(shared_iface);
+	shared_iface = NULL;
+	g_hash_table_destroy(shared_map);
+	shared_map = NULL;
+	g_ptr_array_free(shared_congested, TRUE);
+	shared_congested = NULL;
+}
+
+/**********************************************************************
+ * Traditional socket I/O
+ */
+
+/* Receive packets from the network using recvmmsg() */
+static void rx_recvmmsg(struct netif *iface)
+{
+	struct mmsghdr msgs[RX_BATCH];
+	struct iovec iov[RX_BATCH];
+	unsigned cnt, i, nbufs;
+	int ret, len;
+
+	/* Receive into fewer buffers if memory is tight */
+	for (i = 0; i < RX_BATCH; i++)
+	{
+		iov[i].iov_base = alloc_packet(iface->mtu);
+		if (G_UNLIKELY(!iov[i].iov_base))
+			break;
+		iov[i].iov_len = iface->mtu;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	nbufs = i;
+	if (!nbufs)
+		return;
+
+	/* Limit the number of requests to process before giving back
+	 * control to other tasks */
+#define MAX_LOOP 64
+	for (cnt = 0; cnt < MAX_LOOP; cnt += ret)
+	{
+		ret = recvmmsg(iface->fd, msgs, nbufs, MSG_DONTWAIT | MSG_TRUNC, NULL);
+		if (ret < 0)
+		{
+			ret = 0;
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			neterr(iface, "Read error");
+			del_fd(iface->fd);
+			close(iface->fd);
+			iface->fd = -1;
+			break;
+		}
+
+		for (i = 0; i < (unsigned)ret; i++)
+		{
+			len = msgs[i].msg_len;
+			if (G_UNLIKELY(len < (int)sizeof(struct aoe_hdr)))
+			{
+				netlog(iface, LOG_DEBUG, "Packet too short");
+				iface->stats.dropped++;
+				continue;
+			}
+			if (G_UNLIKELY(len > iface->mtu))
+			{
+				netlog(iface, LOG_ERR, "Received packet size (%d) is larger than "
+					"the configured MTU", len);
+				iface->stats.dropped++;
+				continue;
+			}
+			process_packet(iface, iov[i].iov_base, len, NULL);
+		}
+
+		/* The socket has been drained */
+		if ((unsigned)ret < nbufs)
+			break;
+	}
+
+	++iface->stats.rx_runs;
+
+	for (i = 0; i < nbufs; i++)
+		free_packet(iov[i].iov_base, iface->mtu);
+}
+
+/* Fill in the message headers for sending a batch of responses. The
+ * destination address is needed if the socket is not bound to the interface */
+static void build_mmsg(struct queue_item *const *batch, unsigned n,
+	struct mmsghdr *msgs, struct iovec (*iov)[3], struct sockaddr_ll *sa)
+{
+	static const char zeroes[ETH_ZLEN];
+	struct msghdr *msg;
+	struct queue_item *q;
+	unsigned i, len;
+
+	for (i = 0; i < n; i++)
+	{
+		q = batch[i];
+		msg = &msgs[i].msg_hdr;
+		memset(msg, 0, sizeof(*msg));
+		msg->msg_iov = iov[i];
+		if (sa)
+		{
+			msg->msg_name = sa;
+			msg->msg_namelen = sizeof(*sa);
+		}
+
+		iov[i][0].iov_base = &q->aoe_hdr;
+		iov[i][0].iov_len = len = q->hdrlen;
+		msg->msg_iovlen++;
+
+		if (q->length)
+		{
+			iov[i][msg->msg_iovlen].iov_base = q->buf;
+			iov[i][msg->msg_iovlen++].iov_len = q->length;
+			len += q->length;
+		}
+
+		/* If the frame is too small then it must be padded. On real
+		 * networks this is not neccessary but virtual interfaces tend
+		 * to "forget" the padding and that can make clients unhappy */
+		if (len < ETH_ZLEN)
+		{
+			iov[i][msg->msg_iovlen].iov_base = (void *)zeroes;
+			iov[i][msg->msg_iovlen++].iov_len = ETH_ZLEN - len;
+		}
+	}
+}
+
+/* Account for a response that has been sent */
+static void tx_sent(struct netif_stats *stats, struct queue_item *q, unsigned len)
+{
+	stats->tx_bytes += len;
+	++stats->tx_cnt;
+	if (q->dev && G_UNLIKELY(q->dev->cfg.trace_io))
+		devlog(q->dev, LOG_DEBUG, "%s/%08x: Response sent",
+			ether_ntoa((struct ether_addr *)&q->aoe_hdr.addr.ether_dhost),
+			(uint32_t)ntohl(q->aoe_hdr.tag));
+}
+
+/* Send the queued responses using sendmmsg() */
+static void tx_flush(struct netif *iface)
+{
+	struct mmsghdr msgs[TX_BATCH];
+	struct iovec iov[TX_BATCH][3];
+	struct sockaddr_ll sa;
+	unsigned i, n;
+	int ret, failed;
+
+	n = iface->tx_batch_len;
+	iface->tx_batch_len = 0;
+	if (!n)
+		return;
+
+	/* The shared socket is not bound to any interface */
+	if (iface->shared)
+	{
+		memset(&sa, 0, sizeof(sa));
+		sa.sll_family = AF_PACKET;
+		sa.sll_protocol = htons(ETH_P_AOE);
+		sa.sll_ifindex = iface->ifindex;
+	}
+
+	build_mmsg(iface->tx_batch, n, msgs, iov, iface->shared ? &sa : NULL);
+	failed = FALSE;
+	ret = sendmmsg(iface->fd, msgs, n, MSG_DONTWAIT);
+	if (ret == -1)
+	{
+		/* ENOBUFS means the device queue is full, that is congestion
+		 * just like EAGAIN */
+		if (errno != EAGAIN && errno != ENOBUFS)
+		{
+			neterr(iface, "Write error");
+			failed = TRUE;
+		}
+		ret = 0;
+	}
+	++iface->stats.tx_runs;
+
+	for (i = 0; i < (unsigned)ret; i++)
+	{
+		tx_sent(&iface->stats, iface->tx_batch[i], msgs[i].msg_len);
+		drop_request(iface->tx_batch[i]);
+	}
+
+	/* sendmmsg() only reports an error if the first message could not be
+	 * sent; drop that one and retry the rest */
+	if (failed)
+		drop_request(iface->tx_batch[i++]);
+	else if (i < n)
+		++iface->stats.tx_buffers_full;
+
+	/* The rest has to wait until the socket becomes writable */
+	for (; i < n; i++)
+		defer_response(iface, iface->tx_batch[i]);
+}
+
+/* Queue a response to be sent by run_ifaces() */
+static void tx_queue(struct netif *iface, struct queue_item *q)
+{
+	iface->tx_batch[iface->tx_batch_len++] = q;
+	if (iface->tx_batch_len >= TX_BATCH)
+		return tx_flush(iface);
+
+	if (!iface->is_active)
+	{
+		g_queue_push_tail_link(&active_ifaces, &iface->chain);
+		iface->is_active = TRUE;
+	}
+}
+
+/**********************************************************************
+ * Worker thread support
+ */
+
+/* Send responses through the socket of a worker thread. Returns the number
+ * of responses the socket has taken; a response that failed with an error
+ * other than congestion counts as taken. The requests taken are freed if
+ * reclaim is set; the TX stage of the pipeline mode leaves freeing the
+ * requests of the owner to the owner */
+static unsigned worker_send(struct worker_tx *wtx, struct queue_item **items, unsigned n,
+	int reclaim)
+{
+	struct mmsghdr msgs[TX_BATCH];
+	struct iovec iov[TX_BATCH][3];
+	struct sockaddr_ll sa;
+	unsigned i;
+	int ret;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sll_family = AF_PACKET;
+	sa.sll_protocol = htons(ETH_P_AOE);
+	sa.sll_ifindex = wtx->iface->ifindex;
+
+	build_mmsg(items, n, msgs, iov, &sa);
+	ret = sendmmsg(wtx->fd, msgs, n, MSG_DONTWAIT);
+	++wtx->stats.tx_runs;
+	wtx->nobufs = ret == -1 && errno == ENOBUFS;
+	if (ret == -1)
+	{
+		if (errno == EAGAIN || errno == ENOBUFS)
+			return 0;
+		/* Only the first message has failed */
+		neterr(wtx->iface, "Write error");
+		if (reclaim)
+			drop_request(items[0]);
+		ret = 1;
+	}
+	else
+	{
+		for (i = 0; i < (unsigned)ret; i++)
+		{
+			tx_sent(&wtx->stats, items[i], msgs[i].msg_len);
+			if (reclaim)
+				drop_request(items[i]);
+		}
+	}
+
+	AO_store_release(&wtx->tx_done, wtx->tx_done + ret);
+	return ret;
+}
+
+/* Wait until a congested socket of a worker thread can take more. ENOBUFS
+ * means the queue of the device is full while the socket stays writable,
+ * so EPOLLOUT would fire again at once; such sockets are retried after a
+ * short delay instead */
+static void watch_worker_tx(struct worker *w, struct worker_tx *wtx)
+{
+	struct itimerspec its;
+
+	if (!wtx->nobufs || w->tx_timer_fd == -1)
+		return watch_worker_fd(w, wtx->fd, &w->tx_ctx, EPOLLOUT | EPOLLONESHOT);
+	if (w->tx_timer_armed)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_nsec = WORKER_TX_BACKOFF;
+	if (timerfd_settime(w->tx_timer_fd, 0, &its, NULL))
+	{
+		logerr("Worker %u: failed to arm the TX timer", w->index);
+		return watch_worker_fd(w, wtx->fd, &w->tx_ctx, EPOLLOUT | EPOLLONESHOT);
+	}
+	w->tx_timer_armed = TRUE;
+}
+
+/* Copy a response the TX stage has to hold on to, so the owner can free the
+ * request meanwhile. Returns NULL if there is no memory */
+static struct queue_item *copy_response(const struct queue_item *q)
+{
+	struct queue_item *copy;
+
+	copy = g_slice_new0(struct queue_item);
+	copy->iface = q->iface;
+	copy->hdrlen = q->hdrlen;
+	memcpy(&copy->aoe_hdr, &q->aoe_hdr, q->hdrlen);
+	if (q->length)
+	{
+		copy->buf = alloc_packet(q->length);
+		if (!copy->buf)
+		{
+			g_slice_free(struct queue_item, copy);
+			return NULL;
+		}
+		memcpy(copy->buf, q->buf, q->length);
+		copy->bufsize = q->length;
+		copy->length = q->length;
+		copy->dynalloc = TRUE;
+	}
+	return copy;
+}
+
+/* Queue a response of a worker thread until its socket becomes writable.
+ * The TX stage queues a copy, so a congested interface does not keep the
+ * owner from freeing the responses of the other interfaces */
+static void worker_defer(struct worker_tx *wtx, struct queue_item *q)
+{
+	struct worker *const w = current_worker;
+	unsigned len = wtx->deferred_tail - wtx->deferred_head;
+
+	if (w->owner && len < DEFERRED_LEN)
+		q = copy_response(q);
+	if (G_UNLIKELY(len >= DEFERRED_LEN || !q))
+	{
+		++wtx->stats.dropped;
+		AO_store_release(&wtx->tx_done, wtx->tx_done + 1);
+		if (!w->owner)
+			drop_request(q);
 		return;
 	}
 
-	len = 0;
-	if (iface->rx_ring.len)
+	if (!wtx->congested)
 	{
-		setup_frames(&iface->rx_ring, iface->ring_ptr);
-		len = iface->rx_ring.len;
+		wtx->congested = TRUE;
+		g_queue_push_tail_link(&w->congested_tx, &wtx->congested_chain);
+		watch_worker_tx(w, wtx);
 	}
-	if (iface->tx_ring.len)
-		setup_frames(&iface->tx_ring, iface->ring_ptr + len);
 
-	len = human_format(iface->ring_len, &unit);
-	netlog(iface, LOG_INFO, "Set up %u %s ring buffer (%u RX/%u TX packets)",
-		len, unit, iface->rx_ring.cnt, iface->tx_ring.cnt);
+	wtx->deferred[wtx->deferred_tail++ & (DEFERRED_LEN - 1)] = q;
+	/* Receiving belongs to the main thread, so ask it to pause */
+	if (len + 1 >= DEFERRED_HIGH && !wtx->rx_hold && !wtx->iface->shared)
+	{
+		AO_store_release(&wtx->rx_hold, TRUE);
+		request_rx_refresh();
+	}
 }
 
-/**********************************************************************
- * Traditional single-packet I/O
- */
-
-/* Receive packets from the network using recvfrom() */
-static void rx_recvfrom(struct netif *iface)
+/* Send the responses a worker thread has queued for an interface. What the
+ * socket does not take waits until it becomes writable */
+static void worker_flush(struct worker_tx *wtx)
 {
-	unsigned cnt;
-	void *packet;
-	int len;
+	unsigned i, n;
 
-	packet = alloc_packet(iface->mtu);
+	n = wtx->batch_len;
+	wtx->batch_len = 0;
+	if (!n)
+		return;
 
-	/* Limit the number of requests to process before giving back
-	 * control to other tasks */
-#define MAX_LOOP 64
-	for (cnt = 0; cnt < MAX_LOOP; cnt++)
+	i = worker_send(wtx, wtx->batch, n, !current_worker->owner);
+	if (i < n)
+		++wtx->stats.tx_buffers_full;
+	for (; i < n; i++)
+		worker_defer(wtx, wtx->batch[i]);
+}
+
+/* Try to send the deferred responses of a worker thread. Returns FALSE if
+ * the socket is still congested */
+static int worker_retry(struct worker_tx *wtx)
+{
+	struct queue_item *items[TX_BATCH];
+	unsigned i, n, sent;
+
+	while (wtx->deferred_head != wtx->deferred_tail)
 	{
-		len = recvfrom(iface->fd, packet, iface->mtu,
-			MSG_DONTWAIT | MSG_TRUNC, NULL, NULL);
-		if (len < 0)
+		n = MIN(wtx->deferred_tail - wtx->deferred_head, TX_BATCH);
+		for (i = 0; i < n; i++)
+			items[i] = wtx->deferred[(wtx->deferred_head + i) & (DEFERRED_LEN - 1)];
+		sent = worker_send(wtx, items, n, TRUE);
+		wtx->deferred_head += sent;
+		if (sent < n)
 		{
-			if (errno == EINTR)
-				continue;
-			if (errno == EAGAIN)
-				break;
-			neterr(iface, "Read error");
-			del_fd(iface->fd);
-			close(iface->fd);
-			iface->fd = -1;
+			++wtx->stats.tx_buffers_full;
 			break;
 		}
+	}
 
-		if (G_UNLIKELY(len < (int)sizeof(struct aoe_hdr)))
-		{
-			netlog(iface, LOG_DEBUG, "Packet too short");
-			iface->stats.dropped++;
-			continue;
-		}
-		if (G_UNLIKELY(len > iface->mtu))
+	if (wtx->rx_hold && wtx->deferred_tail - wtx->deferred_head < DEFERRED_LOW)
+	{
+		AO_store_release(&wtx->rx_hold, FALSE);
+		request_rx_refresh();
+	}
+	return wtx->deferred_head == wtx->deferred_tail;
+}
+
+/* Event handler callback of the worker threads, called when a congested
+ * socket becomes writable or the retry timer expires */
+void worker_tx_io(uint32_t events G_GNUC_UNUSED, void *data)
+{
+	struct worker *const w = data;
+	struct worker_tx *wtx;
+	GQueue congested;
+	GList *l;
+
+	congested = w->congested_tx;
+	g_queue_init(&w->congested_tx);
+	while ((l = g_queue_pop_head_link(&congested)))
+	{
+		wtx = l->data;
+		if (worker_retry(wtx))
 		{
-			netlog(iface, LOG_ERR, "Received packet size (%d) is larger than "
-				"the configured MTU", len);
-			iface->stats.dropped++;
+			wtx->congested = FALSE;
 			continue;
 		}
-		process_packet(iface, packet, len, NULL);
+		g_queue_push_tail_link(&w->congested_tx, l);
+		watch_worker_tx(w, wtx);
 	}
+}
 
-	++iface->stats.rx_runs;
+/* timerfd callback for retrying the sockets whose device queue was full */
+void worker_tx_timer(uint32_t events, void *data)
+{
+	struct worker *const w = data;
+	uint64_t expires;
+
+	if (read(w->tx_timer_fd, &expires, sizeof(expires)) == -1)
+	{
+		if (errno != EAGAIN)
+			logerr("Worker %u: TX timer read", w->index);
+		return;
+	}
 
-	free_packet(packet, iface->mtu);
+	w->tx_timer_armed = FALSE;
+	worker_tx_io(events, w);
 }
 
-static void tx_sendmsg(struct netif *iface, struct queue_item *q)
+/* Queue a response to be sent by the current worker thread */
+static void worker_queue(struct queue_item *q)
 {
-	static char zeroes[ETH_ZLEN];
-	struct iovec iov[3];
-	struct msghdr msg;
-	unsigned len;
-	int ret;
-
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_iov = iov;
+	struct worker *const w = current_worker;
+	struct worker_tx *const wtx = &q->iface->wtx[w->index];
 
-	iov[0].iov_base = &q->aoe_hdr;
-	iov[0].iov_len = len = q->hdrlen;
-	msg.msg_iovlen++;
+	/* Pipeline mode: the TX stage does the sending */
+	if (w->tx_stage)
+	{
+		if (stage_response(q))
+			++wtx->tx_queued;
+		return;
+	}
 
-	if (q->length)
+	if (wtx->fd == -1)
 	{
-		iov[msg.msg_iovlen].iov_base = q->buf;
-		iov[msg.msg_iovlen++].iov_len = q->length;
-		len += q->length;
+		if (!w->owner)
+			drop_request(q);
+		else
+			AO_store_release(&wtx->tx_done, wtx->tx_done + 1);
+		return;
 	}
+	if (!w->owner)
+		++wtx->tx_queued;
+
+	/* Keep the order of the responses */
+	if (wtx->congested)
+		return worker_defer(wtx, q);
+
+	wtx->batch[wtx->batch_len++] = q;
+	if (wtx->batch_len >= TX_BATCH)
+		return worker_flush(wtx);
 
-	/* If the frame is too small then it must be padded. On real networks
-	 * this is not neccessary but virtual interfaces tend to "forget" the
-	 * padding and that can make clients unhappy */
-	if (len < ETH_ZLEN)
+	if (!wtx->is_active)
 	{
-		iov[msg.msg_iovlen].iov_base = zeroes;
-		iov[msg.msg_iovlen++].iov_len = ETH_ZLEN - len;
+		g_queue_push_tail_link(&w->active_tx, &wtx->chain);
+		wtx->is_active = TRUE;
 	}
+}
+
+/* Send everything the worker thread has queued */
+void flush_worker_tx(struct worker *w)
+{
+	GList *l;
 
-	ret = sendmsg(iface->fd, &msg, MSG_DONTWAIT);
-	if (ret != -1)
+	while ((l = g_queue_pop_head_link(&w->active_tx)))
 	{
-		iface->stats.tx_bytes += ret;
-		++iface->stats.tx_cnt;
-		if (q->dev && G_UNLIKELY(q->dev->cfg.trace_io))
-			devlog(q->dev, LOG_DEBUG, "%s/%08x: Response sent",
-				ether_ntoa((struct ether_addr *)&q->aoe_hdr.addr.ether_dhost),
-				(uint32_t)ntohl(q->aoe_hdr.tag));
-		drop_request(q);
-		return;
+		struct worker_tx *wtx = l->data;
+
+		wtx->is_active = FALSE;
+		worker_flush(wtx);
 	}
+}
 
-	if (errno == EAGAIN)
+/* Open the send-only sockets of the worker threads */
+static void open_worker_tx(struct netif *iface)
+{
+	unsigned i;
+	int fd;
+
+	for (i = 0; i < nworkers; i++)
 	{
-		++iface->stats.tx_buffers_full;
-		g_ptr_array_add(iface->deferred, q);
-		if (!iface->congested)
+		if (iface->wtx[i].fd != -1)
+			continue;
+
+		/* Protocol 0: the socket does not receive anything */
+		fd = socket(PF_PACKET, SOCK_RAW, 0);
+		if (fd == -1)
 		{
-			modify_fd(iface->fd, &iface->event_ctx, EPOLLIN | EPOLLOUT);
-			iface->congested = TRUE;
+			neterr(iface, "Failed to allocate socket for worker %u", i);
+			continue;
 		}
+		iface->wtx[i].fd = fd;
 	}
-	else
+}
+
+/* Add the transmit statistics of the worker threads */
+void merge_worker_stats(const struct netif *iface, struct netif_stats *stats)
+{
+	unsigned i;
+
+	for (i = 0; iface->wtx && i < nworkers; i++)
 	{
-		neterr(iface, "Write error");
-		drop_request(q);
+		const struct netif_stats *const ws = &iface->wtx[i].stats;
+
+		stats->tx_cnt += ws->tx_cnt;
+		stats->tx_bytes += ws->tx_bytes;
+		stats->tx_runs += ws->tx_runs;
+		stats->tx_buffers_full += ws->tx_buffers_full;
+		stats->dropped += ws->dropped;
 	}
 }
 
+void clear_worker_stats(struct netif *iface)
+{
+	unsigned i;
+
+	for (i = 0; iface->wtx && i < nworkers; i++)
+		memset(&iface->wtx[i].stats, 0, sizeof(iface->wtx[i].stats));
+}
+
 /**********************************************************************
  * Generic I/O handling
  */
 
+/* Update the events the socket of the interface is polled for. shared_io()
+ * takes care of the shared socket */
+static void update_iface_events(struct netif *iface)
+{
+	uint32_t events = 0;
+
+	if (iface->shared)
+		return;
+	if (!iface->rx_paused)
+		events |= EPOLLIN;
+	if (iface->congested)
+		events |= EPOLLOUT;
+	modify_fd(iface->fd, &iface->event_ctx, events);
+}
+
+/* Stop or restart receiving on an interface. While receiving is paused,
+ * new requests wait in the kernel's buffers, and once those fill up the
+ * initiators see losses and slow down */
+static void pause_rx(struct netif *iface, int pause)
+{
+	unsigned i;
+
+	iface->rx_paused = pause;
+	if (pause)
+		++iface->stats.rx_paused;
+	update_iface_events(iface);
+	for (i = 0; i < iface->rxq_cnt; i++)
+		modify_fd(iface->rxq[i].fd, &iface->rxq[i].event_ctx, pause ? 0 : EPOLLIN);
+}
+
+/* Check if a worker thread has asked to pause receiving because too many
+ * of its responses wait for the interface */
+static int workers_congested(const struct netif *iface)
+{
+	unsigned i;
+
+	for (i = 0; iface->wtx && i < nworkers; i++)
+		if (AO_load_acquire(&iface->wtx[i].rx_hold))
+			return TRUE;
+	return FALSE;
+}
+
+/* Check if receiving can restart: few enough responses wait for the
+ * interface, and neither a worker thread nor a ring resize holds it back */
+static int rx_can_resume(const struct netif *iface)
+{
+	return iface->deferred_tail - iface->deferred_head < DEFERRED_LOW &&
+		!workers_congested(iface) && !iface->resize_drain;
+}
+
+/* Follow the requests of the worker threads to pause or restart receiving */
+void update_rx_pause(void)
+{
+	struct netif *iface;
+	unsigned i;
+	int hold;
+
+	for (i = 0; i < ifaces->len; i++)
+	{
+		iface = g_ptr_array_index(ifaces, i);
+		if (iface->fd == -1 || iface->shared)
+			continue;
+
+		hold = workers_congested(iface);
+		if (hold && !iface->rx_paused)
+			pause_rx(iface, TRUE);
+		else if (iface->rx_paused && rx_can_resume(iface))
+			pause_rx(iface, FALSE);
+	}
+}
+
+/* Add a response to the tail of the deferred queue */
+static void push_deferred(struct netif *iface, struct queue_item *q)
+{
+	unsigned len = iface->deferred_tail - iface->deferred_head;
+
+	if (G_UNLIKELY(len >= DEFERRED_LEN))
+	{
+		++iface->stats.dropped;
+		drop_request(q);
+		return;
+	}
+
+	iface->deferred[iface->deferred_tail++ & (DEFERRED_LEN - 1)] = q;
+	if (len + 1 >= DEFERRED_HIGH && !iface->rx_paused && !iface->shared)
+		pause_rx(iface, TRUE);
+}
+
 /* Network I/O event handler callback */
 static void net_io(uint32_t events, void *data)
 {
 	struct netif *iface = data;
-	unsigned i;
 
 	if (events & EPOLLOUT)
 	{
+		/* send_response() puts the response back to the tail of the
+		 * queue if the interface becomes congested again */
 		iface->congested = FALSE;
-		for (i = 0; i < iface->deferred->len; i++)
-		{
-			struct queue_item *q;
-
-			q = g_ptr_array_index(iface->deferred, i);
-			send_response(q);
-			if (iface->congested)
-			{
-				/* send_response() adds the request to
-				 * the end of the deferred queue when it
-				 * sets the congested flag, so we must
-				 * remove the duplicate entry here */
-				++i;
-				break;
-			}
-		}
-		g_ptr_array_remove_range(iface->deferred, 0, i);
+		while (!iface->congested && iface->deferred_head != iface->deferred_tail)
+			send_response(iface->deferred[iface->deferred_head++ & (DEFERRED_LEN - 1)]);
 
-		if (!iface->deferred->len)
-			modify_fd(iface->fd, &iface->event_ctx, EPOLLIN);
+		if (iface->rx_paused && rx_can_resume(iface))
+			pause_rx(iface, FALSE);
+		else if (!iface->congested)
+			update_iface_events(iface);
 	}
 
 	if (events & EPOLLIN)
 	{
-		if (iface->rx_ring.frames)
-			rx_ring(iface);
+		/* The socket may have been set up after receiving was paused */
+		if (G_UNLIKELY(iface->rx_paused))
+			return update_iface_events(iface);
+
+		if (iface->xsk)
+			xdp_rx(iface);
+		else if (iface->rx_ring.frames && iface->tp_version == TPACKET_V3)
+			rx_ring_v3(iface, &iface->rx_ring, iface->fd);
+		else if (iface->rx_ring.frames)
+			rx_ring(iface, &iface->rx_ring, iface->fd);
 		else
-			rx_recvfrom(iface);
+			rx_recvmmsg(iface);
 	}
 }
 
@@ -676,22 +2680,78 @@ void send_response(struct queue_item *q)
 {
 	struct netif *const iface = q->iface;
 
-	if (!iface || iface->fd == -1)
+	if (!iface)
 	{
 		drop_request(q);
 		return;
 	}
 
-	if (iface->congested)
+	/* Worker threads use their own sockets */
+	if (current_worker != &main_worker)
+		return worker_queue(q);
+
+	if (iface->fd == -1)
 	{
-		g_ptr_array_add(iface->deferred, q);
+		drop_request(q);
 		return;
 	}
 
-	if (iface->tx_ring.frames)
+	/* The frame of a zero-copy response is already reserved, so it does
+	 * not have to wait for the congestion to clear */
+	if (q->tx_zero_copy)
+		return tx_send_reserved(q);
+
+	if (iface->congested)
+		return push_deferred(iface, q);
+
+	if (iface->xsk)
+		xdp_tx(iface, q);
+	else if (iface->tx_ring.frames)
 		tx_ring(iface, q);
 	else
-		tx_sendmsg(iface, q);
+		tx_queue(iface, q);
+}
+
+/* Queue a response until the interface becomes writable again */
+void defer_response(struct netif *iface, struct queue_item *q)
+{
+	if (!iface->congested)
+	{
+		iface->congested = TRUE;
+		if (iface->shared)
+			congest_shared(iface);
+		else
+			update_iface_events(iface);
+	}
+	push_deferred(iface, q);
+}
+
+/* Estimate how many responses are waiting to be sent on the interface, as
+ * seen by the current thread. Used to pick the least busy path when a
+ * device has multipath enabled. Returns G_MAXUINT if the interface cannot
+ * send */
+unsigned tx_backlog(const struct netif *iface)
+{
+	const struct worker *const w = current_worker;
+
+	if (w != &main_worker)
+	{
+		const struct worker_tx *const wtx = &iface->wtx[w->index];
+
+		if (wtx->fd == -1)
+			return G_MAXUINT;
+		/* Batched, deferred, and in the pipeline mode also those still
+		 * on the way to the TX stage */
+		return wtx->tx_queued - AO_load(&wtx->tx_done);
+	}
+
+	if (iface->fd == -1 && !iface->xsk)
+		return G_MAXUINT;
+	if (iface->congested)
+		return iface->tx_ring.cnt + iface->deferred_tail - iface->deferred_head;
+	if (iface->tx_ring.frames)
+		return iface->tx_ring.used;
+	return iface->tx_batch_len;
 }
 
 static int dev_sort(const void *a, const void *b)
@@ -713,35 +2773,179 @@ static void attach_new_devices(struct netif *iface)
 {
 	g_ptr_array_foreach(devices, attach_device, iface);
 	g_ptr_array_sort(iface->devices, dev_sort);
+	update_filter(iface);
 }
 
-static void setup_filter(struct netif *iface)
+/* Classic BPF program builder used by update_filter() */
+struct filter_builder
+{
+	struct sock_filter	insns[BPF_MAXINSNS];
+	unsigned		len;
+	/* Jumps to the end of the current device block */
+	unsigned		fixups[BPF_MAXINSNS];
+	unsigned		fixup_cnt;
+	int			overflow;
+};
+
+/* How much of the request validation is done by the filter */
+enum filter_level
+{
+	FILTER_HEADER,
+	FILTER_ADDRESS,
+	FILTER_ACL
+};
+
+static unsigned emit(struct filter_builder *fb, unsigned code, unsigned jt,
+	unsigned jf, uint32_t k)
 {
-	static struct sock_filter filter[] =
+	if (fb->len >= BPF_MAXINSNS)
 	{
-		/* Load the type into register */
-		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
-		/* Does it match AoE (0x88a2)? */
-		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x88a2, 0, 4),
-		/* Load the flags into register */
-		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 14),
-		/* Check to see if the Resp flag is set */
-		BPF_STMT(BPF_ALU+BPF_AND+BPF_K, (1 << 3)),
-		/* Yes, goto INVALID */
-		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0, 0, 1),
-		/* VALID: return -1 (allow the packet to be read) */
-		BPF_STMT(BPF_RET+BPF_K, -1),
-		/* INVALID: return 0 (ignore the packet) */
-		BPF_STMT(BPF_RET+BPF_K, 0),
-	};
-	static struct sock_fprog prog =
+		fb->overflow = TRUE;
+		return fb->len - 1;
+	}
+	fb->insns[fb->len] = (struct sock_filter)BPF_JUMP(code, k, jt, jf);
+	return fb->len++;
+}
+
+/* Jump to the next device block */
+static void emit_next(struct filter_builder *fb)
+{
+	unsigned idx;
+
+	idx = emit(fb, BPF_JMP+BPF_JA, 0, 0, 0);
+	if (!fb->overflow)
+		fb->fixups[fb->fixup_cnt++] = idx;
+}
+
+/* Check the source address against an ACL. If must_match is set, the packet
+ * is rejected if the address is not in the list, otherwise it is rejected if
+ * the address is in the list */
+static void emit_acl(struct filter_builder *fb, const struct acl_map *acls,
+	int must_match)
+{
+	const unsigned char *a;
+	unsigned i;
+
+	for (i = 0; i < acls->length; i++)
+	{
+		a = acls->entries[i].e.ether_addr_octet;
+
+		emit(fb, BPF_LD+BPF_W+BPF_ABS, 0, 0, 6);
+		emit(fb, BPF_JMP+BPF_JEQ+BPF_K, 0, 3,
+			(uint32_t)a[0] << 24 | a[1] << 16 | a[2] << 8 | a[3]);
+		emit(fb, BPF_LD+BPF_H+BPF_ABS, 0, 0, 10);
+		emit(fb, BPF_JMP+BPF_JEQ+BPF_K, 0, 1, a[4] << 8 | a[5]);
+		/* Match: skip the rest of the list, or reject */
+		if (must_match)
+			emit(fb, BPF_JMP+BPF_JA, 0, 0, 5 * (acls->length - i - 1) + 1);
+		else
+			emit_next(fb);
+	}
+	/* No match */
+	if (must_match)
+		emit_next(fb);
+}
+
+static void build_filter(struct filter_builder *fb, const struct netif *iface,
+	enum filter_level level)
+{
+	const struct device *dev;
+	unsigned i, j;
+
+	fb->len = 0;
+	fb->overflow = FALSE;
+
+	/* Does the type match AoE (0x88a2)? */
+	emit(fb, BPF_LD+BPF_H+BPF_ABS, 0, 0, 12);
+	emit(fb, BPF_JMP+BPF_JEQ+BPF_K, 1, 0, ETH_P_AOE);
+	emit(fb, BPF_RET+BPF_K, 0, 0, 0);
+	/* Ignore responses */
+	emit(fb, BPF_LD+BPF_B+BPF_ABS, 0, 0, 14);
+	emit(fb, BPF_JMP+BPF_JSET+BPF_K, 0, 1, 1 << 3);
+	emit(fb, BPF_RET+BPF_K, 0, 0, 0);
+	/* Check the protocol version */
+	emit(fb, BPF_ALU+BPF_RSH+BPF_K, 0, 0, 4);
+	emit(fb, BPF_JMP+BPF_JEQ+BPF_K, 1, 0, AOE_VERSION);
+	emit(fb, BPF_RET+BPF_K, 0, 0, 0);
+
+	if (level == FILTER_HEADER)
+	{
+		emit(fb, BPF_RET+BPF_K, 0, 0, -1);
+		return;
+	}
+
+	for (i = 0; i < iface->devices->len && !fb->overflow; i++)
 	{
-		.filter = filter,
-		.len = G_N_ELEMENTS(filter)
-	};
+		dev = g_ptr_array_index(iface->devices, i);
+		fb->fixup_cnt = 0;
+
+		/* Check the shelf & slot, allowing broadcasts */
+		emit(fb, BPF_LD+BPF_H+BPF_ABS, 0, 0, 16);
+		emit(fb, BPF_JMP+BPF_JEQ+BPF_K, 2, 0, ntohs(dev->cfg.shelf));
+		emit(fb, BPF_JMP+BPF_JEQ+BPF_K, 1, 0, SHELF_BCAST);
+		emit_next(fb);
+		emit(fb, BPF_LD+BPF_B+BPF_ABS, 0, 0, 18);
+		emit(fb, BPF_JMP+BPF_JEQ+BPF_K, 2, 0, dev->cfg.slot);
+		emit(fb, BPF_JMP+BPF_JEQ+BPF_K, 1, 0, SLOT_BCAST);
+		emit_next(fb);
+
+		/* Same checks as in process_request() */
+		if (level == FILTER_ACL)
+		{
+			if (dev->cfg.accept)
+				emit_acl(fb, dev->cfg.accept, TRUE);
+			if (dev->cfg.deny)
+				emit_acl(fb, dev->cfg.deny, FALSE);
+			if (dev->mac_mask->length)
+				emit_acl(fb, dev->mac_mask, TRUE);
+		}
+
+		/* VALID: return -1 (allow the packet to be read) */
+		emit(fb, BPF_RET+BPF_K, 0, 0, -1);
+
+		for (j = 0; j < fb->fixup_cnt; j++)
+			fb->insns[fb->fixups[j]].k = fb->len - fb->fixups[j] - 1;
+	}
+
+	/* No device wants the packet */
+	emit(fb, BPF_RET+BPF_K, 0, 0, 0);
+}
+
+/* Re-generate the socket filter so that the kernel drops the packets that
+ * no attached device would accept. Must be called whenever the list of
+ * attached devices or their ACLs change */
+void update_filter(struct netif *iface)
+{
+	static struct filter_builder fb;
+	struct sock_fprog prog;
+	enum filter_level level;
+	unsigned i;
+
+	/* The shared socket has a filter of its own */
+	if (iface->fd == -1 || iface->xsk || iface->shared)
+		return;
 
+	/* Fall back to less specific filters if the program gets too long */
+	for (level = FILTER_ACL; level > FILTER_HEADER; level--)
+	{
+		build_filter(&fb, iface, level);
+		if (!fb.overflow)
+			break;
+	}
+	if (level == FILTER_HEADER)
+		build_filter(&fb, iface, level);
+	if (level < FILTER_ACL && !iface->filter_partial)
+		netlog(iface, LOG_NOTICE, "Too many devices or ACL entries, "
+			"some checks are done in userspace only");
+	iface->filter_partial = level < FILTER_ACL;
+
+	prog.filter = fb.insns;
+	prog.len = fb.len;
 	if (setsockopt(iface->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
 		neterr(iface, "Failed to set up the socket filter");
+	for (i = 0; i < iface->rxq_cnt; i++)
+		if (setsockopt(iface->rxq[i].fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
+			neterr(iface, "Failed to set up the socket filter of RX queue %u", i + 1);
 }
 
 /* Setting SO_SNDBUF/SO_RCVBUF is just advisory, so report the real value being
@@ -768,6 +2972,55 @@ static void set_buffer(struct netif *iface, int what, int size)
 		what == SO_SNDBUF ? "send" : "receive", ret, unit);
 }
 
+/* Let transmitted frames go straight to the driver */
+static void set_qdisc_bypass(struct netif *iface, int enable)
+{
+	unsigned i;
+
+	if (setsockopt(iface->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &enable, sizeof(enable)))
+		neterr(iface, "Failed to %s qdisc bypass", enable ? "enable" : "disable");
+
+	for (i = 0; iface->wtx && i < nworkers; i++)
+		if (iface->wtx[i].fd != -1 && setsockopt(iface->wtx[i].fd, SOL_PACKET,
+				PACKET_QDISC_BYPASS, &enable, sizeof(enable)))
+			neterr(iface, "Failed to %s qdisc bypass for worker %u",
+				enable ? "enable" : "disable", i);
+}
+
+/* Set a busy polling related socket option */
+static void set_busy_poll(struct netif *iface, int what, int val)
+{
+	if (setsockopt(iface->fd, SOL_SOCKET, what, &val, sizeof(val)))
+		neterr(iface, "Failed to set %s", what == SO_BUSY_POLL ?
+			"SO_BUSY_POLL" : "SO_PREFER_BUSY_POLL");
+}
+
+/* Create or destroy the timer used for delaying send() */
+static void setup_kick_timer(struct netif *iface, const struct netif_config *cfg)
+{
+	if (cfg->tx_kick_delay && iface->timer_fd == -1)
+	{
+		iface->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (iface->timer_fd == -1)
+			neterr(iface, "Failed to create timerfd, tx-kick-delay disabled");
+		else
+			add_fd(iface->timer_fd, &iface->timer_ctx);
+	}
+	if (!cfg->tx_kick_delay && iface->timer_fd != -1)
+	{
+		del_fd(iface->timer_fd);
+		close(iface->timer_fd);
+		iface->timer_fd = -1;
+		/* Make sure to push out any frames that may be pending */
+		if (iface->timer_armed)
+		{
+			iface->timer_armed = FALSE;
+			if (iface->tx_pending && iface->tx_ring.frames)
+				tx_kick(iface);
+		}
+	}
+}
+
 /* Validate an interface when it is found */
 void validate_iface(const char *name, int ifindex, int mtu, const char *macaddr)
 {
@@ -822,11 +3075,37 @@ void validate_iface(const char *name, int ifindex, int mtu, const char *macaddr)
 	if (!get_netif_config(iface->name, &newcfg))
 		newcfg = iface->cfg;
 
-	/* Clamp the MTU if the configuration says so */
+	/* Clamp the MTU if the configuration says so. Some virtual devices
+	 * have an MTU larger than what the buffers are able to hold */
 	if (newcfg.mtu && mtu > newcfg.mtu)
 		mtu = newcfg.mtu;
+	if (mtu > MAX_MTU)
+		mtu = MAX_MTU;
 
-	if (iface->fd == -1)
+	if (iface->fd == -1 && newcfg.transport == TRANSPORT_XDP)
+	{
+		if (xdp_open(iface, &newcfg, &mtu))
+			return invalidate_iface(ifindex);
+		iface->mtu = mtu;
+
+		netlog(iface, LOG_INFO, "XDP listener started on queue %d (MTU: %d)",
+			newcfg.xdp_queue, mtu);
+		open_worker_tx(iface);
+		update_shared_filter();
+
+		/* We _are_ using the OS default at this point */
+		iface->cfg.socket_busy_poll = 0;
+		iface->cfg.prefer_busy_poll = FALSE;
+	}
+	else if (iface->fd == -1 && newcfg.shared_socket && !join_shared(iface))
+	{
+		if (mtu > shared_iface->mtu)
+			mtu = shared_iface->mtu;
+		iface->mtu = mtu;
+
+		netlog(iface, LOG_INFO, "Listening on the shared socket (MTU: %d)", mtu);
+	}
+	else if (iface->fd == -1)
 	{
 		struct sockaddr_ll sa;
 
@@ -839,7 +3118,7 @@ void validate_iface(const char *name, int ifindex, int mtu, const char *macaddr)
 
 		/* Set up the ring buffer before binding the socket to avoid
 		 * packets ending up in the normal receive buffer */
-		setup_rings(iface, newcfg.ring_size, mtu);
+		setup_rings(iface, &newcfg, mtu);
 		iface->mtu = mtu;
 
 		memset(&sa, 0, sizeof(sa));
@@ -853,21 +3132,69 @@ void validate_iface(const char *name, int ifindex, int mtu, const char *macaddr)
 			return invalidate_iface(ifindex);
 		}
 
-		setup_filter(iface);
+		update_filter(iface);
 		add_fd(iface->fd, &iface->event_ctx);
 
 		netlog(iface, LOG_INFO, "Listener started (MTU: %d)", mtu);
+		setup_rx_queues(iface, &newcfg, mtu);
+		open_worker_tx(iface);
+		update_shared_filter();
 
 		/* We _are_ using the OS default at this point */
 		iface->cfg.send_buf_size = 0;
 		iface->cfg.recv_buf_size = 0;
+		iface->cfg.qdisc_bypass = FALSE;
+		iface->cfg.socket_busy_poll = 0;
+		iface->cfg.prefer_busy_poll = FALSE;
 	}
 	else
 	{
-		/* If either the MTU or the ring buffer size changes, we have
+		/* The socket type can not be changed on the fly */
+		if (newcfg.transport != iface->cfg.transport ||
+				newcfg.xdp_queue != iface->cfg.xdp_queue ||
+				newcfg.xdp_frames != iface->cfg.xdp_frames ||
+				newcfg.shared_socket != iface->cfg.shared_socket)
+		{
+			netlog(iface, LOG_WARNING, "Changing the transport "
+				"requires a restart");
+			newcfg.transport = iface->cfg.transport;
+			newcfg.xdp_queue = iface->cfg.xdp_queue;
+			newcfg.xdp_frames = iface->cfg.xdp_frames;
+			newcfg.shared_socket = iface->cfg.shared_socket;
+		}
+
+		/* Sockets can not leave a fanout group, so the mode is fixed
+		 * once the group exists */
+		if (iface->fanout_id >= 0 && newcfg.rx_fanout != iface->cfg.rx_fanout)
+		{
+			netlog(iface, LOG_WARNING, "Changing the RX fanout mode "
+				"requires a restart");
+			newcfg.rx_fanout = iface->cfg.rx_fanout;
+		}
+
+		/* If either the MTU or the ring buffer layout changes, we have
 		 * to destroy & re-allocate the ring buffer */
-		if (iface->mtu != mtu || newcfg.ring_size != iface->cfg.ring_size)
-			setup_rings(iface, newcfg.ring_size, mtu);
+		if (iface->xsk)
+			mtu = xdp_clamp_mtu(mtu);
+		else if (iface->shared)
+		{
+			if (mtu > shared_iface->mtu)
+				mtu = shared_iface->mtu;
+		}
+		else if (iface->mtu != mtu || newcfg.ring_size != iface->cfg.ring_size ||
+				newcfg.zero_copy_read != iface->cfg.zero_copy_read ||
+				newcfg.zero_copy_write != iface->cfg.zero_copy_write ||
+				newcfg.rx_ring_v3 != iface->cfg.rx_ring_v3 ||
+				newcfg.rx_block_timeout != iface->cfg.rx_block_timeout ||
+				newcfg.ring_auto_size != iface->cfg.ring_auto_size ||
+				newcfg.ring_min_size != iface->cfg.ring_min_size ||
+				newcfg.ring_max_size != iface->cfg.ring_max_size)
+		{
+			setup_rings(iface, &newcfg, mtu);
+			setup_rx_queues(iface, &newcfg, mtu);
+		}
+		else if (newcfg.rx_queues != iface->cfg.rx_queues)
+			setup_rx_queues(iface, &newcfg, mtu);
 
 		/* If the MTU has changed, tell it to the initiators */
 		if (iface->mtu != mtu)
@@ -881,6 +3208,31 @@ void validate_iface(const char *name, int ifindex, int mtu, const char *macaddr)
 	}
 
 
+	/* XDP sockets have no socket buffers */
+	if (iface->xsk)
+		newcfg.send_buf_size = newcfg.recv_buf_size = 0;
+
+	/* The options of the shared socket are not per-interface */
+	if (iface->shared)
+	{
+		newcfg.send_buf_size = newcfg.recv_buf_size = 0;
+		newcfg.qdisc_bypass = FALSE;
+		newcfg.socket_busy_poll = 0;
+		newcfg.prefer_busy_poll = FALSE;
+		newcfg.tx_kick_delay = 0;
+		newcfg.rx_queues = 1;
+	}
+
+	if (!iface->xsk && newcfg.qdisc_bypass != iface->cfg.qdisc_bypass)
+		set_qdisc_bypass(iface, newcfg.qdisc_bypass);
+	if (newcfg.socket_busy_poll != iface->cfg.socket_busy_poll)
+		set_busy_poll(iface, SO_BUSY_POLL, newcfg.socket_busy_poll);
+	if (newcfg.prefer_busy_poll != iface->cfg.prefer_busy_poll)
+		set_busy_poll(iface, SO_PREFER_BUSY_POLL, newcfg.prefer_busy_poll);
+	setup_kick_timer(iface, &newcfg);
+	if (newcfg.ring_auto_size && iface->ring_ptr)
+		start_resize_timer();
+
 	if (newcfg.send_buf_size &&
 			newcfg.send_buf_size != iface->cfg.send_buf_size)
 		set_buffer(iface, SO_SNDBUF, newcfg.send_buf_size * 1024);
@@ -918,6 +3270,7 @@ void invalidate_iface(int ifindex)
 		detach_device(iface, g_ptr_array_index(iface->devices, 0));
 
 	free_iface(iface);
+	update_shared_filter();
 }
 
 void setup_ifaces(void)
@@ -953,4 +3306,11 @@ void done_ifaces(void)
 		invalidate_iface(iface->ifindex);
 	}
 	g_ptr_array_free(ifaces, TRUE);
+
+	if (resize_timer_fd != -1)
+	{
+		del_fd(resize_timer_fd);
+		close(resize_timer_fd);
+		resize_timer_fd = -1;
+	}
 }
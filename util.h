@@ -1,8 +1,11 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <string.h>
 #include <time.h>
 
+#include <glib.h>
+
 #define NSEC_PER_SEC	1000000000
 
 static inline void timespec_sub(const struct timespec *a,
@@ -29,4 +32,21 @@ static inline void timespec_add(const struct timespec *a,
 	}
 }
 
+/* Derive the per-instance variant of a file name: "ggaoed.sock" becomes
+ * "ggaoed-name.sock" */
+static inline char *instance_path(const char *path, const char *instance)
+{
+	const char *base, *ext;
+
+	if (!instance)
+		return g_strdup(path);
+
+	base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	ext = strrchr(base, '.');
+	if (!ext || ext == base)
+		return g_strdup_printf("%s-%s", path, instance);
+	return g_strdup_printf("%.*s-%s%s", (int)(ext - path), path, instance, ext);
+}
+
 #endif /* UTIL_H */
@@ -0,0 +1,779 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "ggaoed.h"
+
+#include <atomic_ops.h>
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <glib.h>
+
+/* Number of requests a worker's input queue can hold. Must be a power of 2 */
+#define WORKER_QUEUE_LEN	256
+
+/* Largest request that can be handed over to a worker without using the
+ * overflow buffer of the slot */
+#define WORKER_MSG_DATA		9216
+
+/* Max. number of handed over requests to process before looking at
+ * other events */
+#define WORKER_BATCH		64
+
+/* Number of responses that can be in transit between a worker and its TX
+ * stage. Must be a power of 2 */
+#define TX_STAGE_LEN		1024
+
+/**********************************************************************
+ * Data structures
+ */
+
+/* A request handed over to a worker thread */
+struct worker_msg
+{
+	struct netif		*iface;
+	/* NULL if the device was detached from the interface since */
+	struct device		*dev;
+	struct timespec		tv;
+	/* Zero for advertisements */
+	unsigned		len;
+	unsigned char		data[WORKER_MSG_DATA];
+	/* Requests longer than data[] are copied here. Allocated by the main
+	 * thread on first use, MAX_MTU bytes */
+	unsigned char		*big;
+};
+
+/**********************************************************************
+ * Global variables
+ */
+
+/* Event loop state of the main thread */
+struct worker main_worker;
+
+/* The event loop the current thread is running */
+__thread struct worker *current_worker = &main_worker;
+
+/* The worker threads */
+struct worker *workers;
+unsigned nworkers;
+
+/* All threads, including the TX stages of the pipeline mode */
+static struct worker **threads;
+static unsigned nthreads;
+
+/* The worker the next new device will be assigned to */
+static unsigned next_worker;
+
+/* Stopping the worker threads while the main thread changes shared state */
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+static volatile AO_t pause_flag;
+/* Number of workers waiting for pause_flag to clear. Protected by pause_lock */
+static unsigned parked;
+/* Nesting level of pause_workers(), main thread only */
+static unsigned pause_depth;
+
+static volatile AO_t stop_flag;
+
+/* Set by workers if the socket filters have to be rebuilt */
+static volatile AO_t filter_refresh;
+/* Set by workers if receiving has to be paused or restarted */
+static volatile AO_t rx_refresh;
+
+/**********************************************************************
+ * Functions
+ */
+
+static void wake_worker(struct worker *w)
+{
+	eventfd_t val = 1;
+
+	if (write(w->wake_fd, &val, sizeof(val)) != sizeof(val))
+		logerr("Failed to wake up worker %u", w->index);
+}
+
+/* Wakeup event handler callback */
+static void worker_wakeup(uint32_t events G_GNUC_UNUSED, void *data)
+{
+	struct worker *const w = data;
+	eventfd_t val;
+
+	if (read(w->wake_fd, &val, sizeof(val)) == -1 && errno != EAGAIN)
+		logerr("Worker %u: wakeup read", w->index);
+}
+
+static int init_worker(struct worker *w, unsigned index)
+{
+	w->index = index;
+	w->tx_timer_fd = -1;
+	w->wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (w->wake_fd == -1)
+	{
+		logerr("Failed to create eventfd for worker %u", index);
+		return -1;
+	}
+	w->wake_ctx.callback = worker_wakeup;
+	w->wake_ctx.data = w;
+	add_worker_fd(w, w->wake_fd, &w->wake_ctx);
+	w->tx_ctx.callback = worker_tx_io;
+	w->tx_ctx.data = w;
+
+	/* Without the timer congested sockets are only retried when they
+	 * become writable */
+	w->tx_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (w->tx_timer_fd == -1)
+		logerr("Failed to create timerfd for worker %u", index);
+	else
+	{
+		w->tx_timer_ctx.callback = worker_tx_timer;
+		w->tx_timer_ctx.data = w;
+		add_worker_fd(w, w->tx_timer_fd, &w->tx_timer_ctx);
+	}
+	return 0;
+}
+
+/* Set up the worker state. The threads are started later by start_workers(),
+ * after the devices have been assigned */
+void init_workers(void)
+{
+	unsigned i;
+
+	if (!defaults.worker_threads)
+		return;
+
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+#endif
+
+	/* The main thread is woken up when the socket filters need a refresh */
+	if (init_worker(&main_worker, 0))
+	{
+		exit_flag = 1;
+		return;
+	}
+
+	workers = g_new0(struct worker, defaults.worker_threads);
+	threads = g_new0(struct worker *, 2 * defaults.worker_threads);
+	for (i = 0; i < (unsigned)defaults.worker_threads; i++)
+	{
+		struct worker *const w = &workers[i];
+
+		w->efd = epoll_create(32);
+		if (w->efd == -1)
+		{
+			logerr("Failed to create the epoll fd for worker %u", i);
+			exit_flag = 1;
+			break;
+		}
+		w->queue = g_new0(struct worker_msg, WORKER_QUEUE_LEN);
+		++nworkers;
+		if (init_worker(w, i))
+		{
+			exit_flag = 1;
+			break;
+		}
+		threads[nthreads++] = w;
+
+		if (defaults.worker_mode != WORKER_MODE_PIPELINE)
+			continue;
+
+		/* The TX stage only waits for new responses and for congested
+		 * sockets to become writable */
+		w->tx_stage = g_new0(struct worker, 1);
+		w->tx_stage->owner = w;
+		w->tx_stage->tx_queue = g_new(struct queue_item *, TX_STAGE_LEN);
+		w->tx_stage->wake_fd = -1;
+		w->tx_stage->tx_timer_fd = -1;
+		w->tx_stage->efd = epoll_create(8);
+		if (w->tx_stage->efd == -1)
+		{
+			logerr("Failed to create the epoll fd for TX stage %u", i);
+			exit_flag = 1;
+			break;
+		}
+		if (init_worker(w->tx_stage, i))
+		{
+			exit_flag = 1;
+			break;
+		}
+		threads[nthreads++] = w->tx_stage;
+	}
+}
+
+static void park_worker(void)
+{
+	pthread_mutex_lock(&pause_lock);
+	++parked;
+	pthread_cond_broadcast(&pause_cond);
+	while (AO_load_acquire(&pause_flag))
+		pthread_cond_wait(&pause_cond, &pause_lock);
+	--parked;
+	pthread_mutex_unlock(&pause_lock);
+}
+
+/* Process the requests handed over by the main thread. Returns the new
+ * head of the queue; the slots can not be reused until the responses
+ * referencing them are sent */
+static AO_t drain_queue(struct worker *w)
+{
+	struct worker_msg *msg;
+	AO_t head, tail;
+
+	head = w->head;
+	tail = AO_load_acquire(&w->tail);
+	if (tail - head > WORKER_BATCH)
+		tail = head + WORKER_BATCH;
+
+	for (; head != tail; head++)
+	{
+		msg = &w->queue[head & (WORKER_QUEUE_LEN - 1)];
+		if (!msg->dev)
+			continue;
+		if (msg->len)
+			process_request(msg->iface, msg->dev,
+				msg->len > WORKER_MSG_DATA ? msg->big : msg->data,
+				msg->len, &msg->tv);
+		else
+			send_advertisment(msg->dev, msg->iface);
+	}
+	return head;
+}
+
+/* Free the responses the TX stage is done with */
+static void reclaim_responses(struct worker *w)
+{
+	struct worker *const stage = w->tx_stage;
+	AO_t head, sent;
+
+	head = stage->tx_head;
+	sent = AO_load_acquire(&stage->tx_sent);
+	for (; head != sent; head++)
+		drop_request(stage->tx_queue[head & (TX_STAGE_LEN - 1)]);
+	stage->tx_head = head;
+}
+
+/* Wake up a thread if it went to sleep without seeing the new entries of
+ * its queue */
+static void kick_thread(struct worker *w)
+{
+	if (!w->kick)
+		return;
+	w->kick = FALSE;
+	/* Pairs with the barrier before going to sleep */
+	AO_nop_full();
+	if (AO_load(&w->sleeping))
+		wake_worker(w);
+}
+
+/* Check if the responses of the worker are all freed */
+static int stage_idle(const struct worker *w)
+{
+	return !w->tx_stage || AO_load(&w->tx_stage->tx_sent) == w->tx_stage->tx_head;
+}
+
+/* A dead thread must not hold up pause_workers() */
+static void thread_died(void)
+{
+	if (AO_load_acquire(&stop_flag))
+		return;
+	pthread_mutex_lock(&pause_lock);
+	++parked;
+	pthread_cond_broadcast(&pause_cond);
+	pthread_mutex_unlock(&pause_lock);
+}
+
+static void *worker_main(void *data)
+{
+	struct worker *const w = data;
+	struct epoll_event events[16];
+	struct event_ctx *ctx;
+	int ret, i, timeout;
+	AO_t head;
+
+	current_worker = w;
+
+	while (!AO_load_acquire(&stop_flag))
+	{
+		if (AO_load_acquire(&pause_flag))
+			park_worker();
+
+		/* Announce going to sleep before the last look at the queue,
+		 * so run_workers() can not miss waking us up */
+		timeout = 0;
+		if (!devices_runnable(w) && !w->polled_devs.head)
+		{
+			AO_store(&w->sleeping, 1);
+			AO_nop_full();
+			if (AO_load(&w->tail) == w->head && stage_idle(w))
+				timeout = -1;
+		}
+
+		ret = epoll_wait(w->efd, events, G_N_ELEMENTS(events), timeout);
+		AO_store(&w->sleeping, 0);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			logerr("Worker %u: epoll_wait() failed", w->index);
+			exit_flag = 1;
+			wake_worker(&main_worker);
+			break;
+		}
+		for (i = 0; i < ret; i++)
+		{
+			ctx = events[i].data.ptr;
+			ctx->callback(events[i].events, ctx->data);
+		}
+
+		head = drain_queue(w);
+
+		if (w->polled_devs.head)
+			poll_devices();
+		if (w->active_devs.head)
+			run_devices();
+		if (w->active_tx.head)
+			flush_worker_tx(w);
+		if (w->tx_stage)
+		{
+			reclaim_responses(w);
+			kick_thread(w->tx_stage);
+		}
+
+		AO_store_release(&w->head, head);
+	}
+
+	thread_died();
+	mem_thread_done();
+	return NULL;
+}
+
+/* Main loop of a TX stage: send the responses of the owner */
+static void *stage_main(void *data)
+{
+	struct worker *const stage = data;
+	struct worker *const w = stage->owner;
+	struct epoll_event events[16];
+	struct event_ctx *ctx;
+	struct queue_item *q;
+	int ret, i, timeout;
+	AO_t sent, tail;
+
+	current_worker = stage;
+	sent = stage->tx_sent;
+
+	while (!AO_load_acquire(&stop_flag))
+	{
+		if (AO_load_acquire(&pause_flag))
+			park_worker();
+
+		timeout = 0;
+		if (AO_load_acquire(&stage->tx_tail) == sent)
+		{
+			AO_store(&stage->sleeping, 1);
+			AO_nop_full();
+			if (AO_load(&stage->tx_tail) == sent)
+				timeout = -1;
+		}
+
+		ret = epoll_wait(stage->efd, events, G_N_ELEMENTS(events), timeout);
+		AO_store(&stage->sleeping, 0);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			logerr("TX stage %u: epoll_wait() failed", stage->index);
+			exit_flag = 1;
+			wake_worker(&main_worker);
+			break;
+		}
+		for (i = 0; i < ret; i++)
+		{
+			ctx = events[i].data.ptr;
+			ctx->callback(events[i].events, ctx->data);
+		}
+
+		tail = AO_load_acquire(&stage->tx_tail);
+		for (; sent != tail; sent++)
+		{
+			q = stage->tx_queue[sent & (TX_STAGE_LEN - 1)];
+			/* The interface may have gone away */
+			if (q->iface)
+				send_response(q);
+		}
+		if (stage->active_tx.head)
+			flush_worker_tx(stage);
+
+		/* Let the owner free the requests. Responses waiting for a
+		 * congested socket have been copied */
+		if (stage->tx_sent != sent)
+		{
+			AO_store_release(&stage->tx_sent, sent);
+			AO_nop_full();
+			if (AO_load(&w->sleeping))
+				wake_worker(w);
+		}
+	}
+
+	thread_died();
+	mem_thread_done();
+	return NULL;
+}
+
+/* Sleep until another thread wakes up the current one. The wakeup is
+ * consumed, but the caller is about to look at everything it could mean */
+static void wait_wakeup(struct worker *w)
+{
+	struct pollfd pfd;
+
+	pfd.fd = w->wake_fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, -1) == 1)
+		worker_wakeup(pfd.revents, w);
+}
+
+/* Pass a response from a worker to its TX stage. If the stage falls behind,
+ * the worker sleeps until the stage has sent some responses. Returns FALSE
+ * if the response was dropped */
+int stage_response(struct queue_item *q)
+{
+	struct worker *const w = current_worker;
+	struct worker *const stage = w->tx_stage;
+	AO_t tail;
+
+	tail = stage->tx_tail;
+	while (tail - stage->tx_head >= TX_STAGE_LEN)
+	{
+		reclaim_responses(w);
+		if (tail - stage->tx_head < TX_STAGE_LEN)
+			break;
+		/* Do not wait for a stage that has been paused or died */
+		if (AO_load_acquire(&pause_flag) || AO_load(&stop_flag) || exit_flag)
+		{
+			drop_request(q);
+			return FALSE;
+		}
+		stage->kick = TRUE;
+		kick_thread(stage);
+
+		/* Pairs with the barrier after the stage publishes tx_sent */
+		AO_store(&w->sleeping, 1);
+		AO_nop_full();
+		if (AO_load(&stage->tx_sent) == stage->tx_head)
+			wait_wakeup(w);
+		AO_store(&w->sleeping, 0);
+	}
+
+	stage->tx_queue[tail & (TX_STAGE_LEN - 1)] = q;
+	AO_store_release(&stage->tx_tail, tail + 1);
+	stage->kick = TRUE;
+	return TRUE;
+}
+
+/* Start the worker threads, and pin them to different CPUs. The first
+ * allowed CPU is left for the main thread */
+void start_workers(void)
+{
+	sigset_t all, old;
+	cpu_set_t allowed, cpu;
+	unsigned i, j, ncpus;
+	int cpus[CPU_SETSIZE];
+	int ret;
+
+	if (!nworkers || exit_flag)
+		return;
+
+	ncpus = 0;
+	if (!sched_getaffinity(0, sizeof(allowed), &allowed))
+		for (i = 0; i < CPU_SETSIZE; i++)
+			if (CPU_ISSET(i, &allowed))
+				cpus[ncpus++] = i;
+
+	/* Signals are handled by the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (i = 0; i < nthreads; i++)
+	{
+		struct worker *const w = threads[i];
+
+		ret = pthread_create(&w->thread, NULL, w->owner ? stage_main : worker_main, w);
+		if (ret)
+		{
+			logit(LOG_ERR, "Failed to start %s %u: %s", w->owner ? "TX stage" : "worker",
+				w->index, strerror(ret));
+			exit_flag = 1;
+			break;
+		}
+
+		if (ncpus < 2)
+			continue;
+		j = cpus[(i + 1) % ncpus];
+		CPU_ZERO(&cpu);
+		CPU_SET(j, &cpu);
+		ret = pthread_setaffinity_np(w->thread, sizeof(cpu), &cpu);
+		if (ret)
+			logit(LOG_WARNING, "Failed to pin %s %u to CPU %u: %s",
+				w->owner ? "TX stage" : "worker", w->index, j, strerror(ret));
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	logit(LOG_INFO, "Started %u worker threads%s", nworkers,
+		defaults.worker_mode == WORKER_MODE_PIPELINE ? " with TX stages" : "");
+
+	/* Threads that could not be started are treated as dead */
+	if (i < nthreads)
+	{
+		pthread_mutex_lock(&pause_lock);
+		parked += nthreads - i;
+		pthread_mutex_unlock(&pause_lock);
+		while (i < nthreads)
+			threads[i++]->thread = 0;
+	}
+}
+
+/* Wait for the worker threads to exit. Their state is kept around until
+ * done_workers(), so the devices can be shut down normally */
+void stop_workers(void)
+{
+	unsigned i;
+
+	if (!nworkers)
+		return;
+
+	AO_store_release(&stop_flag, 1);
+	for (i = 0; i < nthreads; i++)
+	{
+		if (!threads[i]->thread)
+			continue;
+		wake_worker(threads[i]);
+		pthread_join(threads[i]->thread, NULL);
+	}
+}
+
+void done_workers(void)
+{
+	unsigned i, j;
+
+	for (i = 0; i < nworkers; i++)
+	{
+		struct worker *const stage = workers[i].tx_stage;
+
+		close(workers[i].wake_fd);
+		if (workers[i].tx_timer_fd != -1)
+			close(workers[i].tx_timer_fd);
+		close(workers[i].efd);
+		for (j = 0; j < WORKER_QUEUE_LEN; j++)
+			if (workers[i].queue[j].big)
+				free_packet(workers[i].queue[j].big, MAX_MTU);
+		g_free(workers[i].queue);
+		if (stage)
+		{
+			if (stage->wake_fd != -1)
+				close(stage->wake_fd);
+			if (stage->tx_timer_fd != -1)
+				close(stage->tx_timer_fd);
+			if (stage->efd != -1)
+				close(stage->efd);
+			g_free(stage->tx_queue);
+			g_free(stage);
+		}
+	}
+	g_free(workers);
+	workers = NULL;
+	nworkers = 0;
+	g_free(threads);
+	threads = NULL;
+	nthreads = 0;
+
+	if (main_worker.wake_ctx.callback)
+	{
+		del_fd(main_worker.wake_fd);
+		close(main_worker.wake_fd);
+		if (main_worker.tx_timer_fd != -1)
+		{
+			del_fd(main_worker.tx_timer_fd);
+			close(main_worker.tx_timer_fd);
+		}
+	}
+}
+
+/* Stop the worker threads while the main thread changes data they use.
+ * Calls can be nested */
+void pause_workers(void)
+{
+	unsigned i;
+
+	if (!nworkers || pause_depth++)
+		return;
+
+	pthread_mutex_lock(&pause_lock);
+	AO_store_release(&pause_flag, 1);
+	for (i = 0; i < nthreads; i++)
+		if (threads[i]->thread)
+			wake_worker(threads[i]);
+	while (parked < nthreads)
+		pthread_cond_wait(&pause_cond, &pause_lock);
+	pthread_mutex_unlock(&pause_lock);
+}
+
+void resume_workers(void)
+{
+	if (!nworkers || --pause_depth)
+		return;
+
+	pthread_mutex_lock(&pause_lock);
+	AO_store_release(&pause_flag, 0);
+	pthread_cond_broadcast(&pause_cond);
+	pthread_mutex_unlock(&pause_lock);
+}
+
+/* Called by the main event loop after each iteration */
+void run_workers(void)
+{
+	unsigned i;
+
+	if (AO_load_acquire(&filter_refresh))
+	{
+		AO_store(&filter_refresh, 0);
+		AO_nop_full();
+		/* The owners of the devices change the ACLs in place */
+		pause_workers();
+		for (i = 0; i < ifaces->len; i++)
+			update_filter(g_ptr_array_index(ifaces, i));
+		resume_workers();
+	}
+
+	if (AO_load_acquire(&rx_refresh))
+	{
+		AO_store(&rx_refresh, 0);
+		AO_nop_full();
+		update_rx_pause();
+	}
+
+	for (i = 0; i < nworkers; i++)
+		kick_thread(&workers[i]);
+}
+
+/* Pick the owner of a new device */
+struct worker *assign_worker(void)
+{
+	if (!nworkers)
+		return &main_worker;
+	return &workers[next_worker++ % nworkers];
+}
+
+/* Pass a request to the worker owning the device. Called by the main thread
+ * only. Advertisements are passed with a zero length */
+void hand_over_request(struct netif *iface, struct device *dev, const void *buf,
+	unsigned len, const struct timespec *tv)
+{
+	struct worker *const w = dev->worker;
+	struct worker_msg *msg;
+	unsigned char *data;
+	AO_t tail;
+
+	tail = w->tail;
+	if (G_UNLIKELY(tail - AO_load_acquire(&w->head) >= WORKER_QUEUE_LEN))
+	{
+		++iface->stats.worker_queue_full;
+		return;
+	}
+
+	msg = &w->queue[tail & (WORKER_QUEUE_LEN - 1)];
+	data = msg->data;
+	if (G_UNLIKELY(len > WORKER_MSG_DATA))
+	{
+		if (!msg->big)
+			msg->big = alloc_packet(MAX_MTU);
+		if (G_UNLIKELY(len > MAX_MTU || !msg->big))
+		{
+			++iface->stats.dropped;
+			return;
+		}
+		data = msg->big;
+	}
+
+	msg->iface = iface;
+	msg->dev = dev;
+	msg->len = len;
+	if (tv)
+		msg->tv = *tv;
+	else
+		clock_gettime(CLOCK_REALTIME, &msg->tv);
+	if (len)
+		memcpy(data, buf, len);
+
+	AO_store_release(&w->tail, tail + 1);
+	w->kick = TRUE;
+}
+
+/* Forget the state of a device that is being detached from an interface,
+ * or of an interface that is going away if dev is NULL. The workers must be
+ * paused */
+void forget_handed_over(struct netif *iface, struct device *dev)
+{
+	struct worker_msg *msg;
+	struct worker *stage;
+	struct queue_item *q;
+	unsigned j;
+	AO_t i;
+
+	for (j = 0; j < nworkers; j++)
+	{
+		const struct worker *const w = &workers[j];
+
+		if (dev && dev->worker != w)
+			continue;
+
+		for (i = w->head; dev && i != w->tail; i++)
+		{
+			msg = &w->queue[i & (WORKER_QUEUE_LEN - 1)];
+			if (msg->iface == iface && msg->dev == dev)
+				msg->dev = NULL;
+		}
+
+		/* Responses in transit to the TX stage */
+		stage = w->tx_stage;
+		if (!stage)
+			continue;
+		for (i = stage->tx_head; i != stage->tx_tail; i++)
+		{
+			q = stage->tx_queue[i & (TX_STAGE_LEN - 1)];
+			if (q->iface != iface)
+				continue;
+			if (!dev)
+				q->iface = NULL;
+			else if (q->dev == dev)
+			{
+				q->dev = NULL;
+				--dev->queue_length;
+			}
+		}
+	}
+}
+
+/* Ask the main thread to rebuild the socket filters */
+void request_filter_refresh(void)
+{
+	AO_store_release(&filter_refresh, 1);
+	wake_worker(&main_worker);
+}
+
+/* Ask the main thread to pause or restart receiving on the interfaces,
+ * according to the rx_hold flags of the workers */
+void request_rx_refresh(void)
+{
+	AO_store_release(&rx_refresh, 1);
+	wake_worker(&main_worker);
+}
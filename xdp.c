@@ -0,0 +1,621 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "ggaoed.h"
+
+#ifdef HAVE_LINUX_IF_XDP_H
+
+#include <atomic_ops.h>
+
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/ethernet.h>
+#include <netinet/ether.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifndef AF_XDP
+#define AF_XDP			44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP			283
+#endif
+
+/* Size of a UMEM frame. Frames can not span pages */
+#define XSK_FRAME_SIZE		4096
+
+/* The kernel reserves this much headroom in front of received packets */
+#ifndef XDP_PACKET_HEADROOM
+#define XDP_PACKET_HEADROOM	256
+#endif
+
+/* Minimal number of entries in the XSKMAP */
+#define XSK_MAP_SIZE		64
+
+/**********************************************************************
+ * Data structures
+ */
+
+/* A ring shared with the kernel */
+struct xsk_ring
+{
+	uint32_t		*producer;
+	uint32_t		*consumer;
+	uint32_t		*flags;
+	void			*desc;
+	/* Number of entries, must be a power of 2 */
+	uint32_t		size;
+
+	void			*map;
+	size_t			map_len;
+};
+
+/* State of an AF_XDP socket */
+struct xsk
+{
+	/* The XDP program and the socket map it uses */
+	int			prog_fd;
+	int			map_fd;
+	int			attached: 1;
+	/* The socket is registered with the event loop */
+	int			registered: 1;
+
+	/* The packet buffer area registered with the kernel */
+	void			*umem;
+	size_t			umem_len;
+
+	struct xsk_ring		rx;
+	struct xsk_ring		tx;
+	struct xsk_ring		fill;
+	struct xsk_ring		comp;
+
+	/* UMEM frames available for sending */
+	uint64_t		*free_frames;
+	unsigned		free_cnt;
+};
+
+/**********************************************************************
+ * XDP program handling
+ */
+
+#define INSN(c, d, s, o, i) \
+	{ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) }
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int create_map(struct netif *iface, int queue)
+{
+	union bpf_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = queue < XSK_MAP_SIZE ? XSK_MAP_SIZE : queue + 1;
+
+	fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (fd == -1)
+		neterr(iface, "Failed to create the XDP socket map");
+	return fd;
+}
+
+/* Load a program that redirects AoE frames to the socket bound to the
+ * receiving queue, and lets everything else through to the network stack */
+static int load_prog(struct netif *iface, int map_fd)
+{
+	struct bpf_insn prog[] =
+	{
+		/* r6 = ctx */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		/* r2 = ctx->data, r3 = ctx->data_end */
+		INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data), 0),
+		INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end), 0),
+		/* Is the ethernet header complete? If not, goto PASS */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+		INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH_HLEN),
+		INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 8, 0),
+		/* Does the type match AoE (0x88a2)? If not, goto PASS */
+		INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2, 12, 0),
+		INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 6, htons(ETH_P_AOE)),
+		/* return bpf_redirect_map(map, ctx->rx_queue_index, XDP_PASS) */
+		INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0),
+		INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+		INSN(0, 0, 0, 0, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		/* PASS: return XDP_PASS */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	static const char license[] = "GPL";
+	union bpf_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (unsigned long)prog;
+	attr.insn_cnt = G_N_ELEMENTS(prog);
+	attr.license = (unsigned long)license;
+
+	fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd == -1)
+		neterr(iface, "Failed to load the XDP program");
+	return fd;
+}
+
+static void add_attr(struct nlmsghdr *hdr, struct nlattr *nest, int type,
+	const void *data, unsigned len)
+{
+	struct nlattr *nla;
+
+	nla = (void *)nest + NLA_ALIGN(nest->nla_len);
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	memcpy((void *)nla + NLA_HDRLEN, data, len);
+	nest->nla_len = NLA_ALIGN(nest->nla_len) + NLA_ALIGN(nla->nla_len);
+	hdr->nlmsg_len = NLMSG_ALIGN(hdr->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+}
+
+/* Attach or detach (prog_fd == -1) the XDP program in generic mode */
+static int set_link_xdp(struct netif *iface, int prog_fd)
+{
+	struct
+	{
+		struct nlmsghdr		hdr;
+		struct ifinfomsg	ifi;
+		char			attrs[64];
+	} req;
+	struct
+	{
+		struct nlmsghdr		hdr;
+		struct nlmsgerr		err;
+	} ack;
+	struct nlattr *nest;
+	uint32_t flags;
+	int fd, ret;
+
+	memset(&req, 0, sizeof(req));
+	req.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.hdr.nlmsg_type = RTM_SETLINK;
+	req.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = iface->ifindex;
+
+	nest = (void *)&req + NLMSG_ALIGN(req.hdr.nlmsg_len);
+	nest->nla_type = NLA_F_NESTED | IFLA_XDP;
+	nest->nla_len = NLA_HDRLEN;
+	req.hdr.nlmsg_len = NLMSG_ALIGN(req.hdr.nlmsg_len) + NLA_HDRLEN;
+
+	/* Generic mode works with every driver, including veth */
+	flags = XDP_FLAGS_SKB_MODE;
+	if (prog_fd != -1)
+		flags |= XDP_FLAGS_UPDATE_IF_NOEXIST;
+	add_attr(&req.hdr, nest, IFLA_XDP_FD, &prog_fd, sizeof(prog_fd));
+	add_attr(&req.hdr, nest, IFLA_XDP_FLAGS, &flags, sizeof(flags));
+
+	fd = socket(PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd == -1)
+	{
+		neterr(iface, "Failed to open netlink socket");
+		return -1;
+	}
+
+	ret = send(fd, &req, req.hdr.nlmsg_len, 0);
+	if (ret != -1)
+		ret = recv(fd, &ack, sizeof(ack), 0);
+	close(fd);
+	if (ret == -1)
+	{
+		neterr(iface, "Failed to talk to the kernel");
+		return -1;
+	}
+
+	if (ack.hdr.nlmsg_type == NLMSG_ERROR && ack.err.error)
+	{
+		errno = -ack.err.error;
+		neterr(iface, "Failed to %s the XDP program",
+			prog_fd == -1 ? "detach" : "attach");
+		return -1;
+	}
+	return 0;
+}
+
+/**********************************************************************
+ * Socket setup
+ */
+
+static int map_ring(struct netif *iface, struct xsk_ring *ring,
+	const struct xdp_ring_offset *off, unsigned desc_size, off_t pgoff)
+{
+	int fd = iface->fd;
+
+	ring->map_len = off->desc + ring->size * desc_size;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (ring->map == MAP_FAILED)
+	{
+		neterr(iface, "Failed to map an XDP ring");
+		ring->map = NULL;
+		return -1;
+	}
+
+	ring->producer = ring->map + off->producer;
+	ring->consumer = ring->map + off->consumer;
+	ring->flags = ring->map + off->flags;
+	ring->desc = ring->map + off->desc;
+	return 0;
+}
+
+static void unmap_ring(struct xsk_ring *ring)
+{
+	if (ring->map)
+		munmap(ring->map, ring->map_len);
+	ring->map = NULL;
+}
+
+static int setup_xsk_rings(struct netif *iface, struct xsk *xsk)
+{
+	struct xdp_mmap_offsets off;
+	socklen_t len;
+
+	if (setsockopt(iface->fd, SOL_XDP, XDP_UMEM_FILL_RING, &xsk->fill.size, sizeof(uint32_t)) ||
+			setsockopt(iface->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &xsk->comp.size, sizeof(uint32_t)) ||
+			setsockopt(iface->fd, SOL_XDP, XDP_RX_RING, &xsk->rx.size, sizeof(uint32_t)) ||
+			setsockopt(iface->fd, SOL_XDP, XDP_TX_RING, &xsk->tx.size, sizeof(uint32_t)))
+	{
+		neterr(iface, "Failed to set up the XDP rings");
+		return -1;
+	}
+
+	len = sizeof(off);
+	if (getsockopt(iface->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len))
+	{
+		neterr(iface, "Failed to get the XDP ring offsets");
+		return -1;
+	}
+
+	if (map_ring(iface, &xsk->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) ||
+			map_ring(iface, &xsk->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) ||
+			map_ring(iface, &xsk->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) ||
+			map_ring(iface, &xsk->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING))
+		return -1;
+	return 0;
+}
+
+/* Packets must fit in a single UMEM frame */
+int xdp_clamp_mtu(int mtu)
+{
+	return MIN(mtu, XSK_FRAME_SIZE - XDP_PACKET_HEADROOM);
+}
+
+/* Open an AF_XDP socket on the interface and register it with the event
+ * loop. The MTU is clamped to what fits in an UMEM frame */
+int xdp_open(struct netif *iface, const struct netif_config *cfg, int *mtu)
+{
+	struct xdp_umem_reg reg;
+	struct sockaddr_xdp sa;
+	struct xsk *xsk;
+	uint64_t *fill;
+	uint32_t key;
+	unsigned i;
+
+	xsk = g_new0(struct xsk, 1);
+	xsk->prog_fd = -1;
+	xsk->map_fd = -1;
+	iface->xsk = xsk;
+
+	if (*mtu > xdp_clamp_mtu(*mtu))
+	{
+		*mtu = xdp_clamp_mtu(*mtu);
+		netlog(iface, LOG_NOTICE, "MTU clamped to %d for XDP", *mtu);
+	}
+
+	iface->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (iface->fd == -1)
+	{
+		neterr(iface, "Failed to allocate XDP socket");
+		return -1;
+	}
+
+	/* Half of the frames are used for receiving, half for sending */
+	xsk->umem_len = (size_t)cfg->xdp_frames * XSK_FRAME_SIZE;
+	xsk->umem = alloc_packet_area(xsk->umem_len);
+	if (!xsk->umem)
+		return -1;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (unsigned long)xsk->umem;
+	reg.len = xsk->umem_len;
+	reg.chunk_size = XSK_FRAME_SIZE;
+	if (setsockopt(iface->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)))
+	{
+		neterr(iface, "Failed to register the XDP packet buffer");
+		return -1;
+	}
+
+	xsk->rx.size = xsk->fill.size = cfg->xdp_frames / 2;
+	xsk->tx.size = xsk->comp.size = cfg->xdp_frames / 2;
+	if (setup_xsk_rings(iface, xsk))
+		return -1;
+
+	/* Hand the receive frames over to the kernel */
+	fill = xsk->fill.desc;
+	for (i = 0; i < xsk->fill.size; i++)
+		fill[i] = (uint64_t)i * XSK_FRAME_SIZE;
+	AO_nop_write();
+	*xsk->fill.producer = xsk->fill.size;
+
+	xsk->free_frames = g_new(uint64_t, xsk->tx.size);
+	for (i = 0; i < xsk->tx.size; i++)
+		xsk->free_frames[i] = (uint64_t)(xsk->fill.size + i) * XSK_FRAME_SIZE;
+	xsk->free_cnt = xsk->tx.size;
+
+	/* Generic mode only supports copying */
+	memset(&sa, 0, sizeof(sa));
+	sa.sxdp_family = AF_XDP;
+	sa.sxdp_ifindex = iface->ifindex;
+	sa.sxdp_queue_id = cfg->xdp_queue;
+	sa.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+	if (bind(iface->fd, (struct sockaddr *)&sa, sizeof(sa)))
+	{
+		neterr(iface, "Failed to bind the XDP socket to queue %d", cfg->xdp_queue);
+		return -1;
+	}
+
+	xsk->map_fd = create_map(iface, cfg->xdp_queue);
+	if (xsk->map_fd == -1)
+		return -1;
+	key = cfg->xdp_queue;
+	{
+		union bpf_attr attr;
+		uint32_t val = iface->fd;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = xsk->map_fd;
+		attr.key = (unsigned long)&key;
+		attr.value = (unsigned long)&val;
+		if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr))
+		{
+			neterr(iface, "Failed to add the socket to the XDP map");
+			return -1;
+		}
+	}
+
+	xsk->prog_fd = load_prog(iface, xsk->map_fd);
+	if (xsk->prog_fd == -1)
+		return -1;
+	if (set_link_xdp(iface, xsk->prog_fd))
+		return -1;
+	xsk->attached = TRUE;
+
+	add_fd(iface->fd, &iface->event_ctx);
+	xsk->registered = TRUE;
+
+	return 0;
+}
+
+/* Tear down the XDP state. The caller closes iface->fd */
+void xdp_close(struct netif *iface)
+{
+	struct xsk *xsk = iface->xsk;
+
+	if (!xsk)
+		return;
+
+	if (xsk->attached)
+		set_link_xdp(iface, -1);
+	if (xsk->prog_fd != -1)
+		close(xsk->prog_fd);
+	if (xsk->map_fd != -1)
+		close(xsk->map_fd);
+
+	unmap_ring(&xsk->rx);
+	unmap_ring(&xsk->tx);
+	unmap_ring(&xsk->fill);
+	unmap_ring(&xsk->comp);
+
+	/* The kernel releases the UMEM when the socket is closed, so the area
+	 * may only be re-used after that */
+	if (iface->fd != -1)
+	{
+		if (xsk->registered)
+			del_fd(iface->fd);
+		close(iface->fd);
+		iface->fd = -1;
+	}
+	if (xsk->umem)
+		free_packet_area(xsk->umem, xsk->umem_len);
+
+	g_free(xsk->free_frames);
+	g_free(xsk);
+	iface->xsk = NULL;
+}
+
+/**********************************************************************
+ * Packet I/O
+ */
+
+/* Receive packets from the XDP socket */
+void xdp_rx(struct netif *iface)
+{
+	struct xsk *const xsk = iface->xsk;
+	const struct xdp_desc *desc;
+	uint32_t prod, cons, fprod, i;
+	uint64_t *fill;
+
+	prod = *xsk->rx.producer;
+	/* Make sure the descriptors are read after the producer index */
+	AO_nop_read();
+	cons = *xsk->rx.consumer;
+	fprod = *xsk->fill.producer;
+	fill = xsk->fill.desc;
+
+	for (i = cons; i != prod; i++)
+	{
+		desc = (const struct xdp_desc *)xsk->rx.desc + (i & (xsk->rx.size - 1));
+
+		if (G_UNLIKELY(desc->len < sizeof(struct aoe_hdr)))
+		{
+			netlog(iface, LOG_DEBUG, "Packet too short");
+			++iface->stats.dropped;
+		}
+		else
+			process_packet(iface, xsk->umem + desc->addr, desc->len, NULL);
+
+		/* Give the frame back to the kernel for receiving */
+		fill[fprod++ & (xsk->fill.size - 1)] = desc->addr & ~(uint64_t)(XSK_FRAME_SIZE - 1);
+	}
+
+	/* Make sure we are done with the frames before releasing them */
+	AO_nop_full();
+	*xsk->rx.consumer = prod;
+	*xsk->fill.producer = fprod;
+
+	if (*xsk->fill.flags & XDP_RING_NEED_WAKEUP)
+		recvfrom(iface->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+
+	++iface->stats.rx_runs;
+}
+
+/* Collect the frames the kernel has finished sending */
+static void reclaim_frames(struct xsk *xsk)
+{
+	uint32_t prod, cons;
+	uint64_t *comp;
+
+	prod = *xsk->comp.producer;
+	AO_nop_read();
+	comp = xsk->comp.desc;
+	for (cons = *xsk->comp.consumer; cons != prod; cons++)
+		xsk->free_frames[xsk->free_cnt++] = comp[cons & (xsk->comp.size - 1)];
+	AO_nop_full();
+	*xsk->comp.consumer = prod;
+}
+
+void xdp_tx(struct netif *iface, struct queue_item *q)
+{
+	struct xsk *const xsk = iface->xsk;
+	struct xdp_desc *desc;
+	unsigned len;
+	uint32_t prod;
+	void *data;
+
+	/* This may happen if the MTU changes while requests are
+	 * in flight */
+	if (G_UNLIKELY(q->hdrlen + q->length > (unsigned)iface->mtu))
+	{
+		drop_request(q);
+		return;
+	}
+
+	if (!xsk->free_cnt)
+		reclaim_frames(xsk);
+	prod = *xsk->tx.producer;
+	if (!xsk->free_cnt || prod - *xsk->tx.consumer >= xsk->tx.size)
+	{
+		++iface->stats.tx_buffers_full;
+		defer_response(iface, q);
+		return;
+	}
+
+	desc = (struct xdp_desc *)xsk->tx.desc + (prod & (xsk->tx.size - 1));
+	desc->addr = xsk->free_frames[--xsk->free_cnt];
+	desc->options = 0;
+
+	data = xsk->umem + desc->addr;
+	memcpy(data, &q->aoe_hdr, q->hdrlen);
+	len = q->hdrlen;
+	if (q->length)
+	{
+		memcpy(data + len, q->buf, q->length);
+		len += q->length;
+	}
+	/* Pad short frames, see tx_sendmsg() */
+	if (len < ETH_ZLEN)
+	{
+		memset(data + len, 0, ETH_ZLEN - len);
+		len = ETH_ZLEN;
+	}
+	desc->len = len;
+
+	iface->stats.tx_bytes += len;
+	++iface->stats.tx_cnt;
+	if (q->dev && G_UNLIKELY(q->dev->cfg.trace_io))
+		devlog(q->dev, LOG_DEBUG, "%s/%08x: Response sent",
+			ether_ntoa((struct ether_addr *)&q->aoe_hdr.addr.ether_dhost),
+			(uint32_t)ntohl(q->aoe_hdr.tag));
+
+	drop_request(q);
+
+	/* Make sure the frame is stable before we update the producer */
+	AO_nop_write();
+	*xsk->tx.producer = prod + 1;
+
+	if (!iface->is_active)
+	{
+		g_queue_push_tail_link(&active_ifaces, &iface->chain);
+		iface->is_active = TRUE;
+	}
+}
+
+/* Tell the kernel to send the queued frames */
+void xdp_kick(struct netif *iface)
+{
+	int ret;
+
+	/* Copy mode always needs a kick, regardless of XDP_RING_NEED_WAKEUP */
+	ret = sendto(iface->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+	if (ret == -1 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+		neterr(iface, "Async write error");
+	else
+		++iface->stats.tx_runs;
+
+	reclaim_frames(iface->xsk);
+}
+
+#else /* HAVE_LINUX_IF_XDP_H */
+
+int xdp_clamp_mtu(int mtu)
+{
+	return mtu;
+}
+
+int xdp_open(struct netif *iface, const struct netif_config *cfg G_GNUC_UNUSED,
+	int *mtu G_GNUC_UNUSED)
+{
+	netlog(iface, LOG_ERR, "XDP support is not compiled in");
+	return -1;
+}
+
+void xdp_close(struct netif *iface G_GNUC_UNUSED)
+{
+}
+
+void xdp_rx(struct netif *iface G_GNUC_UNUSED)
+{
+}
+
+void xdp_tx(struct netif *iface G_GNUC_UNUSED, struct queue_item *q)
+{
+	drop_request(q);
+}
+
+void xdp_kick(struct netif *iface G_GNUC_UNUSED)
+{
+}
+
+#endif /* HAVE_LINUX_IF_XDP_H */